@@ -0,0 +1,638 @@
+/*
+ * bench.c - region allocator benchmarks
+ *
+ * Copyright (c) 2024, NLnet Labs. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#include <assert.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "region.h"
+
+// benchmarks report throughput and latency percentiles. timing individual
+// operations costs more than most operations take, latencies are therefore
+// measured per batch of operations and reported per operation. glibc malloc
+// and jemalloc (if available, loaded at runtime so that it does not replace
+// malloc) serve as baselines.
+
+// operations per latency sample
+#define BATCH (16)
+
+#define MEGABYTE (1024llu * 1024llu)
+#define PAGE_SIZE (4096llu)
+
+static void error(const char *message)
+{
+  fprintf(stderr, "%s\n", message);
+  exit(1);
+}
+
+static always_inline uint64_t now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000llu + (uint64_t)ts.tv_nsec;
+}
+
+// xorshift, benchmarks must be reproducible and rand is too slow
+static uint64_t seed = 88172645463325252llu;
+
+static always_inline uint64_t random64(void)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return seed;
+}
+
+// allocators are accessed through handles, offsets for regions and
+// addresses otherwise
+struct allocator {
+  const char *name;
+  void *context;
+  uintptr_t (*alloc)(void *context, size_t size);
+  void (*free)(void *context, uintptr_t object, size_t size);
+  // write to the object so that every allocator pays for faulting in pages
+  void *(*address)(void *context, uintptr_t object);
+};
+
+static uintptr_t bench_region_alloc(void *context, size_t size)
+{
+  return (uintptr_t)region_alloc(context, size);
+}
+
+static void bench_region_free(void *context, uintptr_t object, size_t size)
+{
+  (void)size;
+  region_free(context, (intptr_t)object);
+}
+
+static void *bench_region_address(void *context, uintptr_t object)
+{
+  return swizzle(context, (intptr_t)object);
+}
+
+static uintptr_t bench_malloc(void *context, size_t size)
+{
+  (void)context;
+  return (uintptr_t)malloc(size);
+}
+
+static void bench_free(void *context, uintptr_t object, size_t size)
+{
+  (void)context;
+  (void)size;
+  free((void *)object);
+}
+
+static void *bench_address(void *context, uintptr_t object)
+{
+  (void)context;
+  return (void *)object;
+}
+
+struct jemalloc {
+  void *handle;
+  void *(*malloc)(size_t);
+  void (*free)(void *);
+};
+
+static uintptr_t bench_jemalloc(void *context, size_t size)
+{
+  const struct jemalloc *jemalloc = context;
+  return (uintptr_t)jemalloc->malloc(size);
+}
+
+static void bench_jefree(void *context, uintptr_t object, size_t size)
+{
+  const struct jemalloc *jemalloc = context;
+  (void)size;
+  jemalloc->free((void *)object);
+}
+
+// symbols of a library loaded with RTLD_LOCAL do not interpose on those in
+// the executable, glibc malloc remains in use by everything else
+static int load_jemalloc(struct jemalloc *jemalloc, const char *path)
+{
+  if (!(jemalloc->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)))
+    return -1;
+  jemalloc->malloc = (void *(*)(size_t))dlsym(jemalloc->handle, "malloc");
+  jemalloc->free = (void (*)(void *))dlsym(jemalloc->handle, "free");
+  if (!jemalloc->malloc || !jemalloc->free) {
+    dlclose(jemalloc->handle);
+    jemalloc->handle = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+// region benchmarks get a fresh region each so that runs do not affect
+// each other
+static size_t region_size = 1024 * MEGABYTE;
+static uint32_t region_flags = 0;
+
+static region_t *new_region(void)
+{
+  region_t *region = region_create(region_size, region_flags);
+  if (!region)
+    error("cannot create region");
+  return region;
+}
+
+static void region_allocator(struct allocator *allocator, region_t *region)
+{
+  allocator->name = "region";
+  allocator->context = region;
+  allocator->alloc = bench_region_alloc;
+  allocator->free = bench_region_free;
+  allocator->address = bench_region_address;
+}
+
+static const struct allocator malloc_allocator = {
+  "malloc", NULL, bench_malloc, bench_free, bench_address
+};
+
+static struct jemalloc jemalloc;
+
+static const struct allocator jemalloc_allocator = {
+  "jemalloc", &jemalloc, bench_jemalloc, bench_jefree, bench_address
+};
+
+// latency samples, sorted to determine percentiles
+struct samples {
+  uint64_t *samples;
+  size_t count;
+  size_t size;
+};
+
+static void add_sample(struct samples *samples, uint64_t sample)
+{
+  if (samples->count == samples->size) {
+    const size_t size = samples->size ? samples->size * 2 : 1024;
+    uint64_t *buffer = realloc(samples->samples, size * sizeof(*buffer));
+    if (!buffer)
+      error("cannot allocate samples");
+    samples->samples = buffer;
+    samples->size = size;
+  }
+  samples->samples[samples->count++] = sample;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+  const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(const struct samples *samples, double percent)
+{
+  if (!samples->count)
+    return 0.0;
+  size_t index = (size_t)((double)samples->count * percent / 100.0);
+  if (index >= samples->count)
+    index = samples->count - 1;
+  return (double)samples->samples[index] / BATCH;
+}
+
+static void report(
+  const char *benchmark, const char *allocator, size_t operations,
+  uint64_t elapsed, struct samples *samples)
+{
+  qsort(samples->samples, samples->count, sizeof(uint64_t), compare_samples);
+  printf("%-24s %-10s %8.2f Mops/s  p50 %7.1f ns  p99 %7.1f ns  p99.9 %8.1f ns\n",
+         benchmark, allocator,
+         elapsed ? (double)operations * 1000.0 / (double)elapsed : 0.0,
+         percentile(samples, 50.0), percentile(samples, 99.0),
+         percentile(samples, 99.9));
+  samples->count = 0;
+}
+
+// allocate count objects, then release them in allocation order
+static void alloc_free(
+  const struct allocator *allocator, const char *benchmark, size_t size,
+  size_t count, uintptr_t *objects)
+{
+  struct samples allocs = { 0 }, frees = { 0 };
+  uint64_t alloc_time = 0, free_time = 0;
+  size_t allocated = 0;
+
+  for (size_t index = 0; index < count; index += BATCH) {
+    const uint64_t start = now();
+    for (size_t round = 0; round < BATCH; round++) {
+      uintptr_t object = allocator->alloc(allocator->context, size);
+      if (!object)
+        break;
+      *(uint64_t *)allocator->address(allocator->context, object) = index;
+      objects[allocated++] = object;
+    }
+    const uint64_t elapsed = now() - start;
+    alloc_time += elapsed;
+    add_sample(&allocs, elapsed);
+    if (allocated != index + BATCH)
+      break;
+  }
+
+  for (size_t index = 0; index + BATCH <= allocated; index += BATCH) {
+    const uint64_t start = now();
+    for (size_t round = 0; round < BATCH; round++)
+      allocator->free(allocator->context, objects[index + round], size);
+    const uint64_t elapsed = now() - start;
+    free_time += elapsed;
+    add_sample(&frees, elapsed);
+  }
+  for (size_t index = allocated - (allocated % BATCH); index < allocated; index++)
+    allocator->free(allocator->context, objects[index], size);
+
+  char name[64];
+  snprintf(name, sizeof(name), "%s alloc", benchmark);
+  report(name, allocator->name, allocated, alloc_time, &allocs);
+  snprintf(name, sizeof(name), "%s free", benchmark);
+  report(name, allocator->name, allocated, free_time, &frees);
+  free(allocs.samples);
+  free(frees.samples);
+}
+
+static const size_t sizes[] = { 8, 24, 48, 96, 160, 256, 512, 4000, 16384 };
+
+static void size_classes(const struct allocator *baselines, size_t count)
+{
+  uintptr_t *objects = malloc(count * sizeof(*objects));
+  if (!objects)
+    error("cannot allocate objects");
+
+  for (size_t index = 0; index < sizeof(sizes) / sizeof(sizes[0]); index++) {
+    char name[32];
+    snprintf(name, sizeof(name), "size %zu", sizes[index]);
+    // large objects take too much space to allocate as many
+    size_t number = count;
+    if (sizes[index] * number > region_size / 2)
+      number = (region_size / 2) / sizes[index];
+
+    struct allocator allocator;
+    region_t *region = new_region();
+    region_allocator(&allocator, region);
+    alloc_free(&allocator, name, sizes[index], number, objects);
+    region_destroy(region);
+    for (const struct allocator *baseline = baselines; baseline->name; baseline++)
+      alloc_free(baseline, name, sizes[index], number, objects);
+  }
+
+  free(objects);
+}
+
+// free pages are scattered across the region after caches are populated
+// and every other slab is returned. allocating a slab then requires finding
+// a free page in the index, large objects require runs of free pages
+static void fragmentation(size_t count)
+{
+  region_t *region = new_region();
+  // one object per slab so that slabs can be returned individually, both
+  // caches use slabs of a single page
+  const intptr_t filler = region_cache_create(region, "bench-filler", 4000, 0);
+  const intptr_t cache = region_cache_create(region, "bench-page", 2000, 0);
+  if (filler == -1 || cache == -1)
+    error("cannot create caches");
+  (void)region_cache_retain(region, filler, 0);
+  (void)region_cache_retain(region, cache, 0);
+
+  const size_t pages = (region_size / PAGE_SIZE) / 2;
+  intptr_t *fillers = malloc(pages * sizeof(*fillers));
+  uintptr_t *objects = malloc(count * sizeof(*objects));
+  if (!fillers || !objects)
+    error("cannot allocate objects");
+
+  size_t filled = 0;
+  for (; filled < pages; filled++)
+    if (!(fillers[filled] = region_cache_alloc(region, filler)))
+      break;
+  for (size_t index = 0; index < filled; index += 2)
+    region_cache_free(region, filler, fillers[index]);
+
+  struct samples samples = { 0 };
+  uint64_t elapsed_time = 0;
+  size_t allocated = 0;
+  for (; allocated + BATCH <= count; ) {
+    const uint64_t start = now();
+    size_t round = 0;
+    for (; round < BATCH; round++) {
+      const intptr_t object = region_cache_alloc(region, cache);
+      if (!object)
+        break;
+      objects[allocated++] = (uintptr_t)object;
+    }
+    const uint64_t elapsed = now() - start;
+    elapsed_time += elapsed;
+    add_sample(&samples, elapsed);
+    if (round != BATCH)
+      break;
+  }
+  report("fragmented slab", "region", allocated, elapsed_time, &samples);
+  for (size_t index = 0; index < allocated; index++)
+    region_cache_free(region, cache, (intptr_t)objects[index]);
+
+  // holes are single pages, large objects require the heap to grow
+  // into the tail
+  allocated = 0;
+  elapsed_time = 0;
+  for (; allocated + BATCH <= count; ) {
+    const uint64_t start = now();
+    size_t round = 0;
+    for (; round < BATCH; round++) {
+      const intptr_t object = region_alloc(region, 3 * PAGE_SIZE);
+      if (!object)
+        break;
+      objects[allocated++] = (uintptr_t)object;
+    }
+    const uint64_t elapsed = now() - start;
+    elapsed_time += elapsed;
+    add_sample(&samples, elapsed);
+    if (round != BATCH)
+      break;
+  }
+  report("fragmented heap", "region", allocated, elapsed_time, &samples);
+
+  free(samples.samples);
+  free(objects);
+  free(fillers);
+  region_destroy(region);
+}
+
+// cost of taking a snapshot, updating a number of pages and committing the
+// changes. commit cost should scale with the number of updated pages, not
+// the size of the region
+static void snapshots(size_t repeat)
+{
+  static const size_t updates[] = { 1, 16, 256, 4096, 16384 };
+  region_t *region = new_region();
+
+  // populate a quarter of the region with objects of one page
+  const size_t count = (region_size / PAGE_SIZE) / 4;
+  intptr_t *objects = malloc(count * sizeof(*objects));
+  if (!objects)
+    error("cannot allocate objects");
+  const intptr_t cache = region_cache_create(region, "bench-snapshot", 4000, 0);
+  if (cache == -1)
+    error("cannot create cache");
+  for (size_t index = 0; index < count; index++) {
+    if (!(objects[index] = region_cache_alloc(region, cache)))
+      error("cannot populate region");
+    memset(swizzle(region, objects[index]), 1, 64);
+  }
+
+  for (size_t index = 0; index < sizeof(updates) / sizeof(updates[0]); index++) {
+    struct samples samples = { 0 };
+    uint64_t elapsed_time = 0;
+    for (size_t round = 0; round < repeat; round++) {
+      const uint64_t start = now();
+      region_t *snapshot = region_snapshot(region, 0);
+      if (!snapshot)
+        error("cannot take snapshot");
+      for (size_t update = 0; update < updates[index]; update++) {
+        const intptr_t object = objects[random64() % count];
+        ((uint8_t *)swizzle(snapshot, object))[0]++;
+        region_dirty(snapshot, object, 1);
+      }
+      if (!(region = region_commit(snapshot)))
+        error("cannot commit snapshot");
+      region_abort(snapshot);
+      const uint64_t elapsed = now() - start;
+      elapsed_time += elapsed;
+      // report per transaction, not per batch
+      add_sample(&samples, elapsed * BATCH);
+    }
+
+    qsort(samples.samples, samples.count, sizeof(uint64_t), compare_samples);
+    printf("commit %-5zu pages     region     %8.1f us/op   p50 %7.1f us  p99 %7.1f us\n",
+           updates[index],
+           (double)elapsed_time / (1000.0 * (double)repeat),
+           percentile(&samples, 50.0) / 1000.0,
+           percentile(&samples, 99.0) / 1000.0);
+    free(samples.samples);
+  }
+
+  free(objects);
+  region_destroy(region);
+}
+
+// size distribution of resource records. the default approximates a signed
+// top-level domain (mostly delegations: NS, DS, NSEC3 and RRSIG records),
+// specify a histogram of an actual zone with -H for realistic results
+struct bucket {
+  size_t size;
+  size_t weight;
+};
+
+static const struct bucket default_histogram[] = {
+  { 24, 40 }, { 32, 95 }, { 40, 160 }, { 48, 210 }, { 56, 180 },
+  { 64, 150 }, { 72, 110 }, { 88, 70 }, { 104, 40 }, { 128, 25 },
+  { 176, 60 }, { 200, 120 }, { 232, 90 }, { 280, 40 }, { 320, 12 },
+  { 480, 4 }, { 1100, 2 }, { 2048, 1 }, { 8192, 1 }, { 0, 0 }
+};
+
+struct histogram {
+  size_t *sizes;
+  size_t count;
+};
+
+// expand histogram into a table that is indexed by a random number
+static void expand_histogram(
+  struct histogram *histogram, const struct bucket *buckets, size_t count)
+{
+  size_t total = 0;
+  for (size_t index = 0; index < count; index++)
+    total += buckets[index].weight;
+  if (!total)
+    error("histogram is empty");
+  // scale large histograms down to a reasonably sized table
+  const size_t scale = total > 65536 ? total / 65536 : 1;
+  if (!(histogram->sizes = malloc(((total / scale) + count) * sizeof(size_t))))
+    error("cannot allocate histogram");
+  histogram->count = 0;
+  for (size_t index = 0; index < count; index++) {
+    size_t weight = buckets[index].weight / scale;
+    if (!weight && buckets[index].weight)
+      weight = 1;
+    while (weight--)
+      histogram->sizes[histogram->count++] = buckets[index].size;
+  }
+}
+
+// histogram files hold one bucket per line, size followed by count
+static void load_histogram(struct histogram *histogram, const char *path)
+{
+  FILE *file = fopen(path, "r");
+  if (!file)
+    error("cannot open histogram");
+
+  struct bucket *buckets = NULL;
+  size_t count = 0, size = 0;
+  unsigned long long bytes, weight;
+  while (fscanf(file, "%llu %llu", &bytes, &weight) == 2) {
+    if (!bytes)
+      continue;
+    if (count == size) {
+      size = size ? size * 2 : 64;
+      if (!(buckets = realloc(buckets, size * sizeof(*buckets))))
+        error("cannot allocate histogram");
+    }
+    buckets[count].size = (size_t)bytes;
+    buckets[count].weight = (size_t)weight;
+    count++;
+  }
+  if (!feof(file))
+    error("malformed histogram");
+  fclose(file);
+  expand_histogram(histogram, buckets, count);
+  free(buckets);
+}
+
+// mixed workload modeled after applying zone transfers: a working set of
+// records is built up, then records are replaced at random (IXFR churn)
+static void mixed(
+  const struct allocator *allocator, const struct histogram *histogram,
+  size_t count, size_t operations)
+{
+  uintptr_t *objects = malloc(count * sizeof(*objects));
+  size_t *lengths = malloc(count * sizeof(*lengths));
+  if (!objects || !lengths)
+    error("cannot allocate objects");
+
+  seed = 88172645463325252llu;
+  struct samples samples = { 0 };
+  const uint64_t load = now();
+  for (size_t index = 0; index < count; index++) {
+    lengths[index] = histogram->sizes[random64() % histogram->count];
+    if (!(objects[index] = allocator->alloc(allocator->context, lengths[index])))
+      error("cannot populate working set");
+    memset(allocator->address(allocator->context, objects[index]), 0, 8);
+  }
+  const uint64_t load_time = now() - load;
+
+  uint64_t elapsed_time = 0;
+  for (size_t done = 0; done < operations; done += BATCH) {
+    const uint64_t start = now();
+    for (size_t round = 0; round < BATCH / 2; round++) {
+      const size_t index = random64() % count;
+      allocator->free(allocator->context, objects[index], lengths[index]);
+      lengths[index] = histogram->sizes[random64() % histogram->count];
+      if (!(objects[index] = allocator->alloc(allocator->context, lengths[index])))
+        error("cannot replace object");
+      memset(allocator->address(allocator->context, objects[index]), 0, 8);
+    }
+    const uint64_t elapsed = now() - start;
+    elapsed_time += elapsed;
+    add_sample(&samples, elapsed);
+  }
+
+  printf("%-24s %-10s %8.2f Mops/s\n", "mixed load", allocator->name,
+         load_time ? (double)count * 1000.0 / (double)load_time : 0.0);
+  report("mixed churn", allocator->name, operations, elapsed_time, &samples);
+
+  for (size_t index = 0; index < count; index++)
+    allocator->free(allocator->context, objects[index], lengths[index]);
+  free(samples.samples);
+  free(lengths);
+  free(objects);
+}
+
+static void usage(const char *program)
+{
+  fprintf(stderr,
+    "usage: %s [-n objects] [-s region-size-mb] [-H histogram] [-j jemalloc]\n"
+    "          [-t (transparent huge pages)] [-T (hugetlb)]\n"
+    "          [size|fragment|snapshot|mixed]...\n", program);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *histogram_path = NULL;
+  const char *jemalloc_path = "libjemalloc.so.2";
+  size_t count = 1000000;
+  int option;
+
+  while ((option = getopt(argc, argv, "n:s:H:j:tTh")) != -1) {
+    switch (option) {
+      case 'n':
+        count = strtoull(optarg, NULL, 10);
+        break;
+      case 's':
+        region_size = strtoull(optarg, NULL, 10) * MEGABYTE;
+        break;
+      case 'H':
+        histogram_path = optarg;
+        break;
+      case 'j':
+        jemalloc_path = optarg;
+        break;
+      case 't':
+        region_flags |= REGION_HUGE_PAGES;
+        break;
+      case 'T':
+        region_flags |= REGION_HUGETLB;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (count < BATCH || region_size < 64 * MEGABYTE)
+    usage(argv[0]);
+
+  struct allocator baselines[3] = { malloc_allocator, { 0 }, { 0 } };
+  if (load_jemalloc(&jemalloc, jemalloc_path) == 0)
+    baselines[1] = jemalloc_allocator;
+  else
+    fprintf(stderr, "cannot load %s, jemalloc baseline disabled\n", jemalloc_path);
+
+  struct histogram histogram;
+  if (histogram_path)
+    load_histogram(&histogram, histogram_path);
+  else
+    expand_histogram(&histogram, default_histogram,
+                     sizeof(default_histogram) / sizeof(default_histogram[0]) - 1);
+
+  // run every benchmark if none are selected
+  static const char *everything[] = { "size", "fragment", "snapshot", "mixed" };
+  const char **benchmarks = (const char **)argv + optind;
+  int benchmark_count = argc - optind;
+  if (!benchmark_count) {
+    benchmarks = everything;
+    benchmark_count = sizeof(everything) / sizeof(everything[0]);
+  }
+
+  for (int index = 0; index < benchmark_count; index++) {
+    const char *benchmark = benchmarks[index];
+    if (strcmp(benchmark, "size") == 0) {
+      size_classes(baselines, count);
+    } else if (strcmp(benchmark, "fragment") == 0) {
+      fragmentation(count);
+    } else if (strcmp(benchmark, "snapshot") == 0) {
+      snapshots(64);
+    } else if (strcmp(benchmark, "mixed") == 0) {
+      struct allocator allocator;
+      region_t *region = new_region();
+      region_allocator(&allocator, region);
+      mixed(&allocator, &histogram, count, count * 4);
+      region_destroy(region);
+      for (const struct allocator *baseline = baselines; baseline->name; baseline++)
+        mixed(baseline, &histogram, count, count * 4);
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  free(histogram.sizes);
+  if (jemalloc.handle)
+    dlclose(jemalloc.handle);
+  return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * epoch.c - lock-free reader handoff between region generations
+ *
+ * Copyright (c) 2024, NLnet Labs. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <sched.h>
+
+#include "macros.h"
+#include "region.h"
+#include "internal.h"
+
+// epoch based reclamation in the spirit of RCU. the writer publishes the
+// version readers are to use and increments the global epoch, readers
+// announce the epoch they observed in a slot of their own on entry and
+// clear it on exit. once every slot is either clear or holds the current
+// epoch, no reader can hold a reference to the previous version. readers
+// only write the cache line of their own slot, the current version and the
+// global epoch share a cache line that is written by the writer only.
+//
+// commits copy updated pages back to the region in place, readers are
+// therefore moved to the snapshot before the commit and moved back to the
+// region after. the snapshot is dropped once the last reader has left.
+
+#define CACHE_LINE (64)
+
+struct region_reader {
+  /** Epoch announced on entry, 0 if the reader is quiescent. */
+  _Alignas(CACHE_LINE) uint64_t epoch;
+  /** Slot is taken by a reader. */
+  bool used;
+  region_readers_t *readers;
+};
+
+struct region_readers {
+  /** Version readers are to use. */
+  _Alignas(CACHE_LINE) region_t *current;
+  /** Incremented on every publication, starts at 1. */
+  uint64_t epoch;
+  /** Number of reader slots. */
+  size_t count;
+  struct region_reader readers[];
+};
+
+region_readers_t *region_readers_create(region_t *region, size_t readers)
+{
+  assert(region);
+
+  if (!readers)
+    return NULL;
+
+  const size_t size =
+    sizeof(struct region_readers) + readers * sizeof(struct region_reader);
+  region_readers_t *domain;
+  if (posix_memalign((void **)&domain, CACHE_LINE, size))
+    return NULL;
+
+  domain->current = region;
+  domain->epoch = 1;
+  domain->count = readers;
+  for (size_t index = 0; index < readers; index++) {
+    domain->readers[index].epoch = 0;
+    domain->readers[index].used = false;
+    domain->readers[index].readers = domain;
+  }
+
+  return domain;
+}
+
+void region_readers_destroy(region_readers_t *readers)
+{
+  assert(readers);
+#if !defined(NDEBUG)
+  for (size_t index = 0; index < readers->count; index++)
+    assert(!readers->readers[index].used);
+#endif
+  free(readers);
+}
+
+region_reader_t *region_reader_create(region_readers_t *readers)
+{
+  assert(readers);
+
+  for (size_t index = 0; index < readers->count; index++) {
+    struct region_reader *reader = &readers->readers[index];
+    bool used = false;
+    if (__atomic_compare_exchange_n(
+          &reader->used, &used, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return reader;
+  }
+
+  return NULL;
+}
+
+void region_reader_destroy(region_reader_t *reader)
+{
+  assert(reader);
+  assert(!__atomic_load_n(&reader->epoch, __ATOMIC_RELAXED));
+  __atomic_store_n(&reader->used, false, __ATOMIC_RELEASE);
+}
+
+region_t *region_read_begin(region_reader_t *reader)
+{
+  assert(reader);
+  assert(!reader->epoch);
+
+  region_readers_t *readers = reader->readers;
+  // acquire pairs with the increment, a reader that observes the
+  // incremented epoch observes the version published before it
+  const uint64_t epoch = __atomic_load_n(&readers->epoch, __ATOMIC_ACQUIRE);
+  __atomic_store_n(&reader->epoch, epoch, __ATOMIC_RELAXED);
+  // announcement must be visible before the version is read, or the writer
+  // may miss the reader while the previous version is still referenced
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return __atomic_load_n(&readers->current, __ATOMIC_ACQUIRE);
+}
+
+void region_read_end(region_reader_t *reader)
+{
+  assert(reader);
+  assert(reader->epoch);
+  __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+region_t *region_readers_current(const region_readers_t *readers)
+{
+  assert(readers);
+  return __atomic_load_n(&readers->current, __ATOMIC_ACQUIRE);
+}
+
+void region_synchronize(region_readers_t *readers)
+{
+  assert(readers);
+
+  const uint64_t epoch = __atomic_add_fetch(&readers->epoch, 1, __ATOMIC_SEQ_CST);
+  // pairs with the fence in region_read_begin
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (size_t index = 0; index < readers->count; index++) {
+    const struct region_reader *reader = &readers->readers[index];
+    for (;;) {
+      const uint64_t announced = __atomic_load_n(&reader->epoch, __ATOMIC_ACQUIRE);
+      if (!announced || announced >= epoch)
+        break;
+      sched_yield();
+    }
+  }
+}
+
+// make version current and wait for readers of the previous version
+nonnull_all
+static void publish(region_readers_t *readers, region_t *region)
+{
+  __atomic_store_n(&readers->current, region, __ATOMIC_SEQ_CST);
+  region_synchronize(readers);
+}
+
+region_t *region_readers_commit(region_readers_t *readers, region_t *snapshot)
+{
+  assert(readers);
+  assert(snapshot);
+
+  const struct mapping *mapping = region_mapping(snapshot);
+  if (!(mapping->flags & MAPPING_PRIVATE) ||
+      mapping->origin != region_readers_current(readers))
+    return NULL;
+
+  // readers use the snapshot while updated pages are copied back
+  publish(readers, snapshot);
+  region_t *region = region_commit(snapshot);
+  // origin may have been remapped, the mapping of the snapshot tracks it
+  publish(readers, region ? region : mapping->origin);
+  if (!region)
+    return NULL;
+
+  region_abort(snapshot);
+  return region;
+}
@@ -0,0 +1,227 @@
+/*
+ * internal.h
+ *
+ * Copyright (c) 2024, NLnet Labs. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#ifndef INTERNAL_H
+#define INTERNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "macros.h"
+#include "region.h"
+
+// hardware page size is typically 4096 bytes. for large objects a single
+// page slab is on the small side, caches use slabs of multiple pages to
+// compensate (see cache_init).
+#define PAGE_SIZE (4096llu)
+#define PAGE_MASK (~(PAGE_SIZE - 1))
+
+// number of caches space is reserved for in the region administration
+#define REGION_CACHES (20)
+
+// cache used by region_alloc for objects of size, -1 for large objects
+intptr_t region_size_cache(size_t size);
+
+// the allocator is embedded in the region and is oblivious to the memory
+// backing it. mapping routines (map.c) create and maintain the mappings and
+// record what is required to do so in the region administration. the
+// information is process local by nature and is therefore never copied back
+// on commit.
+
+#define MAPPING_SHARED (1u<<0)
+#define MAPPING_PRIVATE (1u<<1)
+// backed by transparent huge pages or huge pages from the hugetlb pool
+#define MAPPING_HUGE_PAGES (1u<<2)
+#define MAPPING_HUGETLB (1u<<3)
+// backed by a regular file, changes are written back on commit
+#define MAPPING_FILE (1u<<4)
+// shared memory object is sealed, the region is mapped privately and all
+// but the first page, which holds the mapping information, is read-only
+#define MAPPING_SEALED (1u<<5)
+// memory is interleaved across or bound to NUMA nodes, the policy is applied
+// to every mapping of the region (see region_place)
+#define MAPPING_NUMA_INTERLEAVE (1u<<6)
+#define MAPPING_NUMA_BIND (1u<<7)
+#define MAPPING_NUMA (MAPPING_NUMA_INTERLEAVE | MAPPING_NUMA_BIND)
+
+struct region_trace;
+
+// move callback registered for a cache
+struct region_move {
+  region_move_t move;
+  void *arg;
+};
+
+// constructor and destructor registered for a cache
+struct region_ctor {
+  region_ctor_t ctor;
+  region_dtor_t dtor;
+  void *arg;
+};
+
+struct mapping {
+  /** File descriptor of shared memory object (-1 if memory is not owned). */
+  int fd;
+  /** Type of mapping (MAPPING_SHARED or MAPPING_PRIVATE). */
+  uint32_t flags;
+  /** Size of the mapping. */
+  size_t size;
+  /** NUMA node memory is bound to (MAPPING_NUMA_BIND only). */
+  uint32_t node;
+  /** Region a snapshot was taken of (snapshots only). */
+  region_t *origin;
+  /** Ring buffer allocations are traced to (regions only, see mapping_trace). */
+  struct region_trace *trace;
+  /** Pages that passed verification, one bit per page. */
+  uint64_t *verified;
+  /** Number of pages covered by verified. */
+  size_t verified_size;
+  /** Move callbacks per cache (regions only, snapshots use the origin). */
+  struct region_move *moves;
+  /** Constructors per cache (regions only, snapshots use the origin). */
+  struct region_ctor *ctors;
+  /** Number of outstanding snapshots (regions only). */
+  size_t snapshots;
+  /** Commit is being written back (regions only, see writeback.c). */
+  bool writeback;
+};
+
+// tracing is disabled by default, define REGION_TRACE as 1 to enable
+#if !defined(REGION_TRACE)
+# define REGION_TRACE (0)
+#endif
+
+nonnull_all
+void region_trace_record(
+  struct region_trace *trace, uint16_t op, uint64_t offset, size_t size,
+  intptr_t cache);
+
+#if REGION_TRACE
+# define region_trace(mapping, op, offset, size, cache) \
+    do { \
+      struct region_trace *trace__ = mapping_trace(mapping); \
+      if (unlikely(trace__)) \
+        region_trace_record(trace__, op, offset, size, cache); \
+    } while (0)
+#else
+# define region_trace(mapping, op, offset, size, cache) \
+    do { } while (0)
+#endif
+
+nonnull_all
+struct mapping *region_mapping(region_t *region);
+
+// the region owns the ring buffer, snapshots record to the ring buffer of
+// the region they were taken of
+nonnull_all
+static always_inline struct region_trace *mapping_trace(
+  const struct mapping *mapping)
+{
+  if (mapping->origin)
+    return region_mapping(mapping->origin)->trace;
+  return mapping->trace;
+}
+
+// create cache, see region_cache_create. the free list link of objects in
+// caches of constructed objects follows the object.
+nonnull_all
+warn_unused_result
+intptr_t region_cache_init(
+  region_t *region,
+  const char *name,
+  size_t object_size,
+  size_t object_align,
+  bool constructed);
+
+nonnull_all
+size_t region_size(const region_t *region);
+
+// smallest size the region can be resized to that is at least size. pages
+// for administration are reserved from the tail if need be.
+nonnull_all
+size_t region_resize_size(const region_t *region, size_t size);
+
+// extend region administration to cover pages up to size. memory must be
+// mapped. returns 0 on success, -1 on failure.
+nonnull_all
+warn_unused_result
+int region_resize(region_t *region, size_t size);
+
+// mark pages in range updated, regardless of what the pages are used for.
+nonnull_all
+void region_mark(region_t *region, uintptr_t offset, size_t size);
+
+// release memory backing pages in range to the operating system, the
+// contents of the pages are lost. pages are dropped from private mappings,
+// private pages then reflect the shared memory object again. memory that is
+// not owned is left alone.
+nonnull_all
+void region_discard(region_t *region, uintptr_t offset, size_t size);
+
+// initiate write back of pages in range for regions mapped from a file.
+nonnull_all
+void region_flush(region_t *region, uintptr_t offset, size_t size);
+
+// wait for pages written back to reach stable storage for regions mapped
+// from a file. returns 0 on success, -1 on failure.
+nonnull_all
+int region_barrier(region_t *region);
+
+// verify page against the checksum recorded on commit. returns 0 if the
+// page matches or has no checksum, -1 if the page is corrupt.
+nonnull_all
+int region_check_page(const region_t *region, size_t page);
+
+// validate snapshot can be committed and extend the mapping of the region
+// it was taken of to cover the snapshot, see region_commit. returns the
+// region (which may have moved) or NULL on failure.
+nonnull_all
+warn_unused_result
+region_t *region_prepare_commit(region_t *snapshot);
+
+// copy pages updated in copy back to region, mapping information of region
+// is retained. region must be mapped with at least the size of copy. data
+// pages are written back before the administration if region is mapped
+// from a file. returns 0 on success, -1 on failure.
+nonnull_all
+warn_unused_result
+int region_copy(region_t *region, region_t *copy);
+
+// region_copy in steps, for pages to be written back by other means.
+// region_copy_begin prepares copy and returns 0, or -1 if copy cannot be
+// copied to region. region_copy_next returns the first page of the next
+// run of updated pages at or after page and the number of pages in count
+// (0 if there are none), discard is set if the pages were released.
+// region_copy_end copies the administration after the pages were copied
+// and returns 0 on success, -1 if the administration cannot be written
+// back.
+nonnull_all
+warn_unused_result
+int region_copy_begin(region_t *region, region_t *copy);
+
+nonnull_all
+size_t region_copy_next(
+  const region_t *copy, size_t page, size_t *count, bool *discard);
+
+nonnull_all
+int region_copy_end(region_t *region, region_t *copy);
+
+// copy administration and pages in use of region to memory at address,
+// which must be at least the size of region. free pages are not copied,
+// memory backing those is not touched. the copy must be adopted with
+// region_open.
+nonnull_all
+void region_clone(void *address, const region_t *region);
+
+// apply NUMA policy to memory in range, flags are mapping flags
+// (MAPPING_NUMA_INTERLEAVE or MAPPING_NUMA_BIND). pages that are allocated
+// already are not moved. returns 0 on success, -1 on failure.
+nonnull_all
+int region_place(void *address, size_t size, uint32_t flags, uint32_t node);
+
+#endif // INTERNAL_H
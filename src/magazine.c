@@ -0,0 +1,346 @@
+/*
+ * magazine.c - per-thread object caching for regions
+ *
+ * Copyright (c) 2024, NLnet Labs. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "macros.h"
+#include "region.h"
+#include "internal.h"
+
+// magazines as described by Bonwick & Adams. every thread holds a loaded
+// and a previous magazine per cache, allocations and releases are satisfied
+// from those without synchronization. if both are depleted (or full), the
+// thread exchanges a magazine with the depot. the depot holds full and empty
+// magazines and is the only layer that interacts with the slab layer (and
+// heap), always with the lock held.
+//
+// magazines hold offsets of objects the slab layer considers allocated.
+// pages are marked updated by the slab layer when objects are handed out, so
+// threads never touch the region administration. the region must therefore
+// not be committed, grown or destroyed while objects are cached, i.e.
+// release per-thread magazines and the depot first.
+
+// default number of objects per magazine
+#define MAGAZINE_ROUNDS (64)
+// full magazines held per cache by the depot, objects in excess magazines
+// are returned to the slab layer
+#define DEPOT_LIMIT (16)
+
+struct magazine {
+  struct magazine *next;
+  size_t rounds;
+  intptr_t objects[];
+};
+
+struct magazine_list {
+  struct magazine *list;
+  size_t count;
+};
+
+struct region_depot {
+  pthread_mutex_t lock;
+  region_t *region;
+  /** Number of objects per magazine. */
+  size_t rounds;
+  struct {
+    struct magazine_list full;
+    struct magazine_list empty;
+  } caches[REGION_CACHES];
+};
+
+struct region_magazines {
+  region_depot_t *depot;
+  struct {
+    struct magazine *loaded;
+    struct magazine *previous;
+  } caches[REGION_CACHES];
+};
+
+static always_inline void push_magazine(
+  struct magazine_list *list, struct magazine *magazine)
+{
+  magazine->next = list->list;
+  list->list = magazine;
+  list->count++;
+}
+
+static always_inline struct magazine *pop_magazine(struct magazine_list *list)
+{
+  struct magazine *magazine = list->list;
+  if (magazine) {
+    list->list = magazine->next;
+    list->count--;
+  }
+  return magazine;
+}
+
+nonnull_all
+static struct magazine *new_magazine(const region_depot_t *depot)
+{
+  const size_t size =
+    sizeof(struct magazine) + depot->rounds * sizeof(intptr_t);
+  struct magazine *magazine = malloc(size);
+  if (magazine) {
+    magazine->next = NULL;
+    magazine->rounds = 0;
+  }
+  return magazine;
+}
+
+// return objects in magazine to the slab layer in one go, lock must be
+// held. the slab layer identifies the cache objects belong to
+nonnull_all
+static void empty_magazine(region_depot_t *depot, struct magazine *magazine)
+{
+  region_free_bulk(depot->region, magazine->objects, magazine->rounds);
+  magazine->rounds = 0;
+}
+
+// fill magazine from the slab layer in one go, lock must be held
+nonnull_all
+static void fill_magazine(
+  region_depot_t *depot, intptr_t cache, struct magazine *magazine)
+{
+  magazine->rounds += region_cache_alloc_bulk(
+    depot->region, cache, depot->rounds - magazine->rounds,
+    magazine->objects + magazine->rounds);
+}
+
+region_depot_t *region_depot_create(region_t *region, size_t rounds)
+{
+  assert(region);
+
+  region_depot_t *depot = calloc(1, sizeof(*depot));
+  if (!depot)
+    return NULL;
+  if (pthread_mutex_init(&depot->lock, NULL) != 0) {
+    free(depot);
+    return NULL;
+  }
+
+  depot->region = region;
+  depot->rounds = rounds ? rounds : MAGAZINE_ROUNDS;
+  return depot;
+}
+
+void region_depot_destroy(region_depot_t *depot)
+{
+  assert(depot);
+
+  for (size_t cache = 0; cache < REGION_CACHES; cache++) {
+    struct magazine *magazine;
+    while ((magazine = pop_magazine(&depot->caches[cache].full))) {
+      empty_magazine(depot, magazine);
+      free(magazine);
+    }
+    while ((magazine = pop_magazine(&depot->caches[cache].empty)))
+      free(magazine);
+  }
+
+  pthread_mutex_destroy(&depot->lock);
+  free(depot);
+}
+
+region_magazines_t *region_magazines_create(region_depot_t *depot)
+{
+  assert(depot);
+
+  region_magazines_t *magazines = calloc(1, sizeof(*magazines));
+  if (!magazines)
+    return NULL;
+  magazines->depot = depot;
+  return magazines;
+}
+
+void region_magazines_destroy(region_magazines_t *magazines)
+{
+  assert(magazines);
+
+  region_depot_t *depot = magazines->depot;
+  pthread_mutex_lock(&depot->lock);
+  for (size_t cache = 0; cache < REGION_CACHES; cache++) {
+    struct magazine *loaded = magazines->caches[cache].loaded;
+    struct magazine *previous = magazines->caches[cache].previous;
+    if (loaded)
+      empty_magazine(depot, loaded);
+    if (previous)
+      empty_magazine(depot, previous);
+    free(loaded);
+    free(previous);
+  }
+  pthread_mutex_unlock(&depot->lock);
+  free(magazines);
+}
+
+// loaded and previous magazines are depleted, exchange an empty magazine
+// for a full one or fill the loaded magazine from the slab layer
+nonnull_all
+static never_inline intptr_t reload(region_magazines_t *magazines, intptr_t cache)
+{
+  region_depot_t *depot = magazines->depot;
+  struct magazine *loaded = magazines->caches[cache].loaded;
+  struct magazine *previous = magazines->caches[cache].previous;
+  struct magazine *full;
+  intptr_t object = 0;
+
+  // magazines are allocated on first use
+  if (!loaded && !(loaded = new_magazine(depot)))
+    goto direct;
+  magazines->caches[cache].loaded = loaded;
+  if (!previous && (previous = new_magazine(depot)))
+    magazines->caches[cache].previous = previous;
+
+  pthread_mutex_lock(&depot->lock);
+  if (previous && (full = pop_magazine(&depot->caches[cache].full))) {
+    push_magazine(&depot->caches[cache].empty, previous);
+    magazines->caches[cache].previous = loaded;
+    magazines->caches[cache].loaded = loaded = full;
+  } else {
+    fill_magazine(depot, cache, loaded);
+  }
+  pthread_mutex_unlock(&depot->lock);
+
+  if (loaded->rounds)
+    object = loaded->objects[--loaded->rounds];
+  return object;
+direct:
+  pthread_mutex_lock(&depot->lock);
+  object = region_cache_alloc(depot->region, cache);
+  pthread_mutex_unlock(&depot->lock);
+  return object;
+}
+
+// loaded and previous magazines are full, exchange a full magazine for an
+// empty one
+nonnull_all
+static never_inline void unload(
+  region_magazines_t *magazines, intptr_t cache, intptr_t object)
+{
+  region_depot_t *depot = magazines->depot;
+  struct magazine *loaded = magazines->caches[cache].loaded;
+  struct magazine *previous = magazines->caches[cache].previous;
+  struct magazine *empty;
+
+  pthread_mutex_lock(&depot->lock);
+  if (!loaded) {
+    empty = pop_magazine(&depot->caches[cache].empty);
+  } else if (!previous) {
+    assert(loaded->rounds == depot->rounds);
+    magazines->caches[cache].previous = loaded;
+    magazines->caches[cache].loaded = NULL;
+    empty = pop_magazine(&depot->caches[cache].empty);
+  } else if (depot->caches[cache].full.count >= DEPOT_LIMIT) {
+    // return objects to the slab layer if the depot holds sufficiently
+    // many full magazines already, the magazine is reused
+    empty_magazine(depot, loaded);
+    empty = loaded;
+  } else {
+    assert(loaded->rounds == depot->rounds);
+    assert(previous->rounds == depot->rounds);
+    push_magazine(&depot->caches[cache].full, previous);
+    magazines->caches[cache].previous = loaded;
+    magazines->caches[cache].loaded = NULL;
+    empty = pop_magazine(&depot->caches[cache].empty);
+  }
+  pthread_mutex_unlock(&depot->lock);
+
+  if (!empty && !(empty = new_magazine(depot))) {
+    pthread_mutex_lock(&depot->lock);
+    region_cache_free(depot->region, cache, object);
+    pthread_mutex_unlock(&depot->lock);
+    return;
+  }
+
+  magazines->caches[cache].loaded = empty;
+  empty->objects[empty->rounds++] = object;
+}
+
+intptr_t region_magazine_cache_alloc(
+  region_magazines_t *magazines, intptr_t cache)
+{
+  assert(magazines);
+  assert(cache >= 0 && cache < REGION_CACHES);
+
+  struct magazine *loaded = magazines->caches[cache].loaded;
+  if (likely(loaded && loaded->rounds))
+    return loaded->objects[--loaded->rounds];
+
+  struct magazine *previous = magazines->caches[cache].previous;
+  if (previous && previous->rounds) {
+    magazines->caches[cache].loaded = previous;
+    magazines->caches[cache].previous = loaded;
+    return previous->objects[--previous->rounds];
+  }
+
+  return reload(magazines, cache);
+}
+
+void region_magazine_cache_free(
+  region_magazines_t *magazines, intptr_t cache, intptr_t object)
+{
+  assert(magazines);
+  assert(cache >= 0 && cache < REGION_CACHES);
+  assert(object);
+
+  const size_t rounds = magazines->depot->rounds;
+  struct magazine *loaded = magazines->caches[cache].loaded;
+  if (likely(loaded && loaded->rounds < rounds)) {
+    loaded->objects[loaded->rounds++] = object;
+    return;
+  }
+
+  struct magazine *previous = magazines->caches[cache].previous;
+  if (previous && previous->rounds < rounds) {
+    magazines->caches[cache].loaded = previous;
+    magazines->caches[cache].previous = loaded;
+    previous->objects[previous->rounds++] = object;
+    return;
+  }
+
+  unload(magazines, cache, object);
+}
+
+intptr_t region_magazine_alloc(region_magazines_t *magazines, size_t size)
+{
+  assert(magazines);
+
+  const intptr_t cache = region_size_cache(size);
+  if (likely(cache != -1))
+    return region_magazine_cache_alloc(magazines, cache);
+  if (!size)
+    return 0;
+
+  // large objects are not cached
+  region_depot_t *depot = magazines->depot;
+  pthread_mutex_lock(&depot->lock);
+  const intptr_t object = region_alloc(depot->region, size);
+  pthread_mutex_unlock(&depot->lock);
+  return object;
+}
+
+void region_magazine_free(
+  region_magazines_t *magazines, intptr_t object, size_t size)
+{
+  assert(magazines);
+
+  if (!object)
+    return;
+
+  const intptr_t cache = region_size_cache(size);
+  if (likely(cache != -1)) {
+    region_magazine_cache_free(magazines, cache, object);
+    return;
+  }
+
+  region_depot_t *depot = magazines->depot;
+  pthread_mutex_lock(&depot->lock);
+  region_free(depot->region, object);
+  pthread_mutex_unlock(&depot->lock);
+}
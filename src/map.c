@@ -0,0 +1,845 @@
+/*
+ * map.c - mapping routines for snapshots of regions
+ *
+ * Copyright (c) 2024, NLnet Labs. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+# include <sys/ioctl.h>
+# include <linux/fs.h>
+#endif
+
+#include "macros.h"
+#include "region.h"
+#include "internal.h"
+
+// Memory mappings cannot be resized, but we can create a new mapping.
+// That's exactly what is used for the copy-on-write map. A snapshot is a
+// MAP_PRIVATE mapping of the shared memory object backing the region. The
+// object is extended if the snapshot is to be larger than the region, the
+// shared mapping is not affected by that. Once the snapshot is committed,
+// the shared mapping is extended (if required) and modified pages are
+// copied over. As relative addresses are used, the data remains valid.
+
+#if defined(__linux__) && !defined(PAGEMAP_SCAN)
+// PAGEMAP_SCAN is available since Linux 6.7, define interface if headers
+// predate it. the ioctl simply fails on older kernels
+#define PAGE_IS_FILE (1 << 2)
+#define PAGE_IS_PRESENT (1 << 3)
+#define PAGE_IS_SWAPPED (1 << 4)
+
+struct page_region {
+  uint64_t start;
+  uint64_t end;
+  uint64_t categories;
+};
+
+struct pm_scan_arg {
+  uint64_t size;
+  uint64_t flags;
+  uint64_t start;
+  uint64_t end;
+  uint64_t walk_end;
+  uint64_t vec;
+  uint64_t vec_len;
+  uint64_t max_pages;
+  uint64_t category_inverted;
+  uint64_t category_mask;
+  uint64_t category_anyof_mask;
+  uint64_t return_mask;
+};
+
+#define PAGEMAP_SCAN _IOWR('f', 16, struct pm_scan_arg)
+#endif
+
+#if defined(__linux__) && !defined(MFD_HUGE_2MB)
+// defined in linux/memfd.h, encodes log2 of the huge page size
+#define MFD_HUGE_2MB (21u << 26)
+#endif
+
+// huge pages are 2 MiB on x86_64 (and aarch64 with 4 KiB base pages).
+// regions backed by huge pages are sized and aligned accordingly
+#define HUGE_PAGE_SIZE (2llu * 1024llu * 1024llu)
+#define MAPPING_HUGE (MAPPING_HUGE_PAGES | MAPPING_HUGETLB)
+
+static int create_shm(uint32_t flags)
+{
+  // Linux, FreeBSD and NetBSD offer memfd_create
+  // FreeBSD additionally offers SHM_ANON (shm_open since FreeBSD 4.3)
+  // OpenBSD offers shm_mkstemp (shm_open since OpenBSD 5.4, Nov 1, 2013)
+  // Solaris 9, 10 support shm_open
+#if defined(__linux__)
+  // allow sealing for region_publish
+  unsigned int memfd_flags = MFD_CLOEXEC | MFD_ALLOW_SEALING;
+  if (flags & MAPPING_HUGETLB)
+    memfd_flags |= MFD_HUGETLB | MFD_HUGE_2MB;
+  return memfd_create("region", memfd_flags);
+#elif defined(__FreeBSD__) || defined(__NetBSD__)
+  if (flags & MAPPING_HUGETLB)
+    return -1;
+  return memfd_create("region", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+  if (flags & MAPPING_HUGETLB)
+    return -1;
+  static unsigned int count = 0;
+  char name[64];
+  snprintf(name, sizeof(name), "/region-%ld-%u", (long)getpid(), count++);
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+  if (fd != -1)
+    shm_unlink(name);
+  return fd;
+#endif
+}
+
+static always_inline size_t round_size(size_t size, uint32_t flags)
+{
+  const size_t page_size = (flags & MAPPING_HUGE) ? HUGE_PAGE_SIZE : PAGE_SIZE;
+  return (size + (page_size - 1)) & ~(page_size - 1);
+}
+
+// size of region administration must account for size to be rounded to
+// the huge page size
+nonnull_all
+static size_t resize_size(const region_t *region, size_t size, uint32_t flags)
+{
+  size_t new_size = round_size(region_resize_size(region, size), flags);
+  while ((size = region_resize_size(region, new_size)) != new_size)
+    new_size = round_size(size, flags);
+  return new_size;
+}
+
+// transparent huge pages are only used for ranges that are aligned to the
+// huge page size
+static void advise_huge_pages(void *address, size_t size, uint32_t flags)
+{
+#if defined(MADV_HUGEPAGE)
+  if (flags & MAPPING_HUGE_PAGES)
+    (void)madvise(address, size, MADV_HUGEPAGE);
+#else
+  (void)address;
+  (void)size;
+  (void)flags;
+#endif
+}
+
+static void *map_shm(size_t size, int flags, int fd, uint32_t mapping_flags)
+{
+  const int prot = PROT_READ | PROT_WRITE;
+  if (!(mapping_flags & MAPPING_HUGE_PAGES))
+    return mmap(NULL, size, prot, flags, fd, 0);
+
+  // reserve address space to align the mapping on a huge page boundary,
+  // mappings of hugetlb files are aligned by the kernel
+  const size_t reserve = size + HUGE_PAGE_SIZE;
+  uint8_t *reserved =
+    mmap(NULL, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (reserved == MAP_FAILED)
+    return MAP_FAILED;
+  uint8_t *aligned = (uint8_t *)(
+    ((uintptr_t)reserved + (HUGE_PAGE_SIZE - 1)) & ~(HUGE_PAGE_SIZE - 1));
+  void *address = mmap(aligned, size, prot, flags | MAP_FIXED, fd, 0);
+  if (address == MAP_FAILED) {
+    munmap(reserved, reserve);
+    return MAP_FAILED;
+  }
+  if (aligned != reserved)
+    munmap(reserved, (size_t)(aligned - reserved));
+  munmap(aligned + size, (size_t)((reserved + reserve) - (aligned + size)));
+  advise_huge_pages(address, size, mapping_flags);
+  return address;
+}
+
+static void *extend_mapping(
+  void *address, size_t size, size_t new_size, int fd, int flags, bool move)
+{
+  // map the pages that are added directly after the mapping so that the
+  // region does not move. pages updated in a private mapping are retained
+#if defined(MAP_FIXED_NOREPLACE) || defined(MAP_EXCL)
+# if defined(MAP_FIXED_NOREPLACE)
+  const int fixed = MAP_FIXED_NOREPLACE;
+# else
+  const int fixed = MAP_FIXED | MAP_EXCL;
+# endif
+  uint8_t *extra = (uint8_t *)address + size;
+  void *extra_address = mmap(
+    extra, new_size - size, PROT_READ | PROT_WRITE, flags | fixed, fd, (off_t)size);
+  if (extra_address == extra)
+    return address;
+  // kernels that do not support the flag may map elsewhere
+  if (extra_address != MAP_FAILED)
+    munmap(extra_address, new_size - size);
+#endif
+
+#if defined(__linux__)
+  // private pages are retained, the mapping may move
+  (void)fd;
+  (void)flags;
+  void *new_address =
+    mremap(address, size, new_size, move ? MREMAP_MAYMOVE : 0);
+  return new_address == MAP_FAILED ? NULL : new_address;
+#else
+  // private pages cannot be retained, only shared mappings can be extended
+  if (!(flags & MAP_SHARED) || !move)
+    return NULL;
+  void *new_address =
+    mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (new_address == MAP_FAILED)
+    return NULL;
+  munmap(address, size);
+  return new_address;
+#endif
+}
+
+// copy-on-write pages are no longer backed by the file. have the kernel
+// report pages that were written to complement updates tracked by the
+// allocator, modifications that were not explicitly marked are committed too
+nonnull_all
+static void mark_written(region_t *snapshot)
+{
+#if defined(__linux__)
+  const struct mapping *mapping = region_mapping(snapshot);
+  const int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return;
+
+  struct page_region regions[64];
+  struct pm_scan_arg arg = {
+    .size = sizeof(arg),
+    .start = (uintptr_t)snapshot,
+    .end = (uintptr_t)snapshot + mapping->size,
+    .vec = (uintptr_t)regions,
+    .vec_len = sizeof(regions) / sizeof(regions[0]),
+    .category_inverted = PAGE_IS_FILE,
+    .category_mask = PAGE_IS_FILE,
+    .category_anyof_mask = PAGE_IS_PRESENT | PAGE_IS_SWAPPED,
+    .return_mask = PAGE_IS_FILE | PAGE_IS_PRESENT | PAGE_IS_SWAPPED
+  };
+
+  for (;;) {
+    const int count = ioctl(fd, PAGEMAP_SCAN, &arg);
+    if (count <= 0)
+      break;
+    for (int index = 0; index < count; index++) {
+      const uintptr_t offset = regions[index].start - (uintptr_t)snapshot;
+      region_mark(snapshot, offset, regions[index].end - regions[index].start);
+    }
+    if (arg.walk_end >= arg.end)
+      break;
+    arg.start = arg.walk_end;
+  }
+
+  close(fd);
+#else
+  (void)snapshot;
+#endif
+}
+
+void region_discard(region_t *region, uintptr_t offset, size_t size)
+{
+  assert(region);
+  assert((offset & PAGE_MASK) == offset);
+
+  const struct mapping *mapping = region_mapping(region);
+  void *address = swizzle(region, (intptr_t)offset);
+
+  // memory not owned by the library
+  if (mapping->fd == -1)
+    return;
+
+  // memory backed by huge pages is released a huge page at a time
+  if (mapping->flags & MAPPING_HUGE) {
+    const uintptr_t start = (offset + (HUGE_PAGE_SIZE - 1)) & ~(HUGE_PAGE_SIZE - 1);
+    const uintptr_t end = (offset + size) & ~(HUGE_PAGE_SIZE - 1);
+    if (end <= start)
+      return;
+    address = swizzle(region, (intptr_t)start);
+    offset = start;
+    size = end - start;
+  }
+
+  // drop private copies of pages. holes must not be punched as the shared
+  // memory object backs the region the snapshot was taken from
+  if (mapping->flags & MAPPING_PRIVATE) {
+#if defined(MADV_DONTNEED)
+    (void)madvise(address, size, MADV_DONTNEED);
+#endif
+    return;
+  }
+
+  // pages in shared mappings are only released by removing them from the
+  // shared memory object
+#if defined(FALLOC_FL_PUNCH_HOLE)
+  if (fallocate(mapping->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                (off_t)offset, (off_t)size) == 0)
+    return;
+#endif
+#if defined(MADV_REMOVE)
+  (void)madvise(address, size, MADV_REMOVE);
+#else
+  (void)address;
+  (void)size;
+#endif
+}
+
+void region_flush(region_t *region, uintptr_t offset, size_t size)
+{
+  assert(region);
+
+  const struct mapping *mapping = region_mapping(region);
+  if (!(mapping->flags & MAPPING_FILE))
+    return;
+
+  // start write back so that the barrier only waits for pages in flight
+#if defined(__linux__)
+  (void)sync_file_range(
+    mapping->fd, (off_t)offset, (off_t)size, SYNC_FILE_RANGE_WRITE);
+#else
+  (void)msync(swizzle(region, (intptr_t)offset), size, MS_ASYNC);
+#endif
+}
+
+int region_barrier(region_t *region)
+{
+  assert(region);
+
+  const struct mapping *mapping = region_mapping(region);
+  if (!(mapping->flags & MAPPING_FILE))
+    return 0;
+
+  // pages of shared mappings are in the page cache, fdatasync writes back
+  // dirty pages of the file, including pages updated through the mapping
+#if defined(__linux__)
+  return fdatasync(mapping->fd);
+#else
+  if (msync(region, mapping->size, MS_SYNC) == -1)
+    return -1;
+  return fsync(mapping->fd);
+#endif
+}
+
+int region_verify(region_t *region, intptr_t object, size_t size)
+{
+  assert(region);
+
+  const size_t end = region_size(region);
+  if (object < 0 || (size_t)object >= end ||
+      size > end - (size_t)object)
+    return -1;
+  if (!size)
+    return 0;
+
+  // pages are verified once, the bitset grows with the region
+  struct mapping *mapping = region_mapping(region);
+  const size_t pages = end / PAGE_SIZE;
+  if (mapping->verified_size < pages) {
+    const size_t words = (pages + 63) / 64;
+    const size_t old_words = (mapping->verified_size + 63) / 64;
+    uint64_t *verified = realloc(mapping->verified, words * sizeof(uint64_t));
+    if (!verified)
+      return -1;
+    memset(verified + old_words, 0, (words - old_words) * sizeof(uint64_t));
+    mapping->verified = verified;
+    mapping->verified_size = pages;
+  }
+
+  const size_t last = ((size_t)object + size - 1) / PAGE_SIZE;
+  for (size_t page = (size_t)object / PAGE_SIZE; page <= last; page++) {
+    uint64_t *word = &mapping->verified[page / 64];
+    const uint64_t bit = 1llu << (page % 64);
+    if (*word & bit)
+      continue;
+    if (region_check_page(region, page) == -1)
+      return -1;
+    *word |= bit;
+  }
+
+  return 0;
+}
+
+int region_cache_move(
+  region_t *region, intptr_t cache, region_move_t move, void *arg)
+{
+  assert(region);
+
+  struct region_cache_stats stats;
+  if (region_cache_stats(region, cache, &stats) == -1)
+    return -1;
+
+  // callbacks are shared with snapshots
+  struct mapping *mapping = region_mapping(region);
+  if (mapping->origin)
+    mapping = region_mapping(mapping->origin);
+  if (!mapping->moves &&
+      !(mapping->moves = calloc(REGION_CACHES, sizeof(*mapping->moves))))
+    return -1;
+
+  mapping->moves[cache].move = move;
+  mapping->moves[cache].arg = arg;
+  return 0;
+}
+
+intptr_t region_cache_create_ctor(
+  region_t *region,
+  const char *name,
+  size_t object_size,
+  size_t object_align,
+  region_ctor_t ctor,
+  region_dtor_t dtor,
+  void *arg)
+{
+  assert(region);
+  assert(name);
+  assert(ctor);
+
+  // callbacks are shared with snapshots, register callbacks before slabs
+  // are created
+  struct mapping *mapping = region_mapping(region);
+  if (mapping->origin)
+    mapping = region_mapping(mapping->origin);
+  if (!mapping->ctors &&
+      !(mapping->ctors = calloc(REGION_CACHES, sizeof(*mapping->ctors))))
+    return -1;
+
+  const intptr_t cache =
+    region_cache_init(region, name, object_size, object_align, true);
+  if (cache == -1)
+    return -1;
+
+  mapping->ctors[cache].ctor = ctor;
+  mapping->ctors[cache].dtor = dtor;
+  mapping->ctors[cache].arg = arg;
+  return cache;
+}
+
+// regions are left alone while a commit is written back, see writeback.c
+nonnull_all
+static always_inline bool is_writing_back(const struct mapping *mapping)
+{
+  return __atomic_load_n(&mapping->writeback, __ATOMIC_ACQUIRE);
+}
+
+region_t *region_create(size_t size, uint32_t flags)
+{
+  if (!size)
+    return NULL;
+
+  // mapping flags match region flags
+  uint32_t huge = 0;
+  if (flags & REGION_HUGE_PAGES)
+    huge |= MAPPING_HUGE_PAGES;
+  if (flags & REGION_HUGETLB)
+    huge |= MAPPING_HUGETLB;
+  uint32_t numa = 0;
+  if (flags & REGION_NUMA_INTERLEAVE)
+    numa = MAPPING_NUMA_INTERLEAVE;
+  else if (flags & REGION_NUMA_BIND)
+    numa = MAPPING_NUMA_BIND;
+  const uint32_t node = flags >> 24;
+  size = round_size(size, huge);
+
+  const int fd = create_shm(huge);
+  if (fd == -1)
+    return NULL;
+  if (ftruncate(fd, (off_t)size) == -1)
+    goto error;
+
+  void *address = map_shm(size, MAP_SHARED, fd, huge);
+  if (address == MAP_FAILED)
+    goto error;
+
+  // policy must be in place before pages are touched by region_init
+  region_t *region = NULL;
+  if (region_place(address, size, numa, node) == 0)
+    region = region_init(address, size);
+  if (!region) {
+    munmap(address, size);
+    goto error;
+  }
+
+  struct mapping *mapping = region_mapping(region);
+  mapping->fd = fd;
+  mapping->flags = MAPPING_SHARED | huge | numa;
+  mapping->size = size;
+  mapping->node = node;
+  mapping->origin = NULL;
+  mapping->trace = NULL;
+  mapping->verified = NULL;
+  mapping->verified_size = 0;
+  mapping->moves = NULL;
+  mapping->ctors = NULL;
+  mapping->snapshots = 0;
+  mapping->writeback = false;
+  return region;
+error:
+  close(fd);
+  return NULL;
+}
+
+region_t *region_map_file(const char *path, size_t size, uint32_t flags)
+{
+  assert(path);
+
+  // hugetlbfs does not persist files
+  if (flags & REGION_HUGETLB)
+    return NULL;
+  const uint32_t huge = (flags & REGION_HUGE_PAGES) ? MAPPING_HUGE_PAGES : 0;
+
+  const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  if (fd == -1)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    goto error;
+
+  region_t *region;
+  void *address;
+  if (st.st_size == 0) {
+    size = round_size(size, huge);
+    if (!size || ftruncate(fd, (off_t)size) == -1)
+      goto error;
+    address = map_shm(size, MAP_SHARED, fd, huge);
+    if (address == MAP_FAILED)
+      goto error;
+    // the region is written back on commit, write back the empty region
+    // so that the file holds a valid region right away
+    region = region_init(address, size);
+    if (region && msync(address, size, MS_SYNC) == -1)
+      region = NULL;
+  } else {
+    // a snapshot may have extended the file if it was not committed
+    size = (size_t)st.st_size;
+    address = map_shm(size, MAP_SHARED, fd, huge);
+    if (address == MAP_FAILED)
+      goto error;
+    region = region_open(address, size);
+  }
+
+  if (!region) {
+    munmap(address, size);
+    goto error;
+  }
+
+  struct mapping *mapping = region_mapping(region);
+  mapping->fd = fd;
+  mapping->flags = MAPPING_SHARED | MAPPING_FILE | huge;
+  mapping->size = size;
+  mapping->origin = NULL;
+  mapping->trace = NULL;
+  mapping->verified = NULL;
+  mapping->verified_size = 0;
+  mapping->moves = NULL;
+  mapping->ctors = NULL;
+  mapping->snapshots = 0;
+  mapping->writeback = false;
+  return region;
+error:
+  close(fd);
+  return NULL;
+}
+
+void region_destroy(region_t *region)
+{
+  assert(region);
+
+  const struct mapping mapping = *region_mapping(region);
+  assert(!mapping.writeback);
+  if (mapping.flags & MAPPING_PRIVATE) {
+    region_abort(region);
+    return;
+  }
+
+  free(mapping.verified);
+  free(mapping.moves);
+  free(mapping.ctors);
+  // memory not owned by the library
+  if (mapping.fd == -1)
+    return;
+
+  region_trace_stop(region);
+  munmap(region, mapping.size);
+  close(mapping.fd);
+}
+
+region_t *region_snapshot(region_t *region, size_t size)
+{
+  assert(region);
+
+  const struct mapping *mapping = region_mapping(region);
+  if (!(mapping->flags & MAPPING_SHARED) || mapping->fd == -1 ||
+      is_writing_back(mapping))
+    return NULL;
+
+  // reserve space for administration if need be
+  const uint32_t huge = mapping->flags & MAPPING_HUGE;
+  size = resize_size(region, size, huge);
+
+  // extend shared memory object (or file) to back the snapshot
+  struct stat st;
+  if (fstat(mapping->fd, &st) == -1)
+    return NULL;
+  if ((size_t)st.st_size < size && ftruncate(mapping->fd, (off_t)size) == -1)
+    return NULL;
+
+  void *address = map_shm(size, MAP_PRIVATE, mapping->fd, huge);
+  if (address == MAP_FAILED)
+    goto error;
+
+  // copies of updated pages are placed like the region
+  const uint32_t numa = mapping->flags & MAPPING_NUMA;
+  region_t *snapshot = address;
+  if (region_place(address, size, numa, mapping->node) == -1 ||
+      region_resize(snapshot, size) == -1) {
+    munmap(address, size);
+    goto error;
+  }
+
+  struct mapping *snapshot_mapping = region_mapping(snapshot);
+  snapshot_mapping->fd = mapping->fd;
+  snapshot_mapping->flags = MAPPING_PRIVATE | huge | numa;
+  snapshot_mapping->size = size;
+  snapshot_mapping->node = mapping->node;
+  snapshot_mapping->origin = region;
+  snapshot_mapping->trace = NULL;
+  snapshot_mapping->verified = NULL;
+  snapshot_mapping->verified_size = 0;
+  snapshot_mapping->moves = NULL;
+  snapshot_mapping->ctors = NULL;
+  snapshot_mapping->snapshots = 0;
+  snapshot_mapping->writeback = false;
+  region_mapping(region)->snapshots++;
+  region_trace(snapshot_mapping, REGION_TRACE_SNAPSHOT, size, 0, -1);
+  return snapshot;
+error:
+  // outstanding snapshots may be backed by pages beyond the region
+  if (!mapping->snapshots && mapping->size < size)
+    (void)ftruncate(mapping->fd, (off_t)mapping->size);
+  return NULL;
+}
+
+region_t *region_grow(region_t *region, size_t size)
+{
+  assert(region);
+
+  struct mapping *mapping = region_mapping(region);
+  if (mapping->fd == -1 || (mapping->flags & MAPPING_SEALED) ||
+      is_writing_back(mapping))
+    return NULL;
+
+  // reserve space for administration if need be
+  const uint32_t huge = mapping->flags & MAPPING_HUGE;
+  size = resize_size(region, size, huge);
+  if (size <= mapping->size) {
+    if (region_resize(region, size) == -1)
+      return NULL;
+    region_trace(mapping, REGION_TRACE_GROW, size, 0, -1);
+    return region;
+  }
+
+  struct stat st;
+  if (fstat(mapping->fd, &st) == -1)
+    return NULL;
+  if ((size_t)st.st_size < size && ftruncate(mapping->fd, (off_t)size) == -1)
+    return NULL;
+
+  // snapshots reference the region they were taken of, the region must not
+  // move while snapshots are outstanding
+  const int flags = (mapping->flags & MAPPING_PRIVATE) ? MAP_PRIVATE : MAP_SHARED;
+  void *address = extend_mapping(
+    region, mapping->size, size, mapping->fd, flags, !mapping->snapshots);
+  if (!address)
+    return NULL;
+
+  advise_huge_pages(address, size, huge);
+  region = address;
+  mapping = region_mapping(region);
+  // policy was applied to the mapping before, extend it to the new pages
+  (void)region_place(
+    address, size, mapping->flags & MAPPING_NUMA, mapping->node);
+  mapping->size = size;
+  // size was rounded to accommodate administration
+  const int result = region_resize(region, size);
+  assert(result == 0);
+  (void)result;
+  region_trace(mapping, REGION_TRACE_GROW, size, 0, -1);
+  return region;
+}
+
+region_t *region_prepare_commit(region_t *snapshot)
+{
+  assert(snapshot);
+
+  struct mapping *mapping = region_mapping(snapshot);
+  if (!(mapping->flags & MAPPING_PRIVATE) || !mapping->origin)
+    return NULL;
+
+  region_t *region = mapping->origin;
+  struct mapping *origin = region_mapping(region);
+  if ((origin->flags & MAPPING_SEALED) || is_writing_back(origin))
+    return NULL;
+
+  mark_written(snapshot);
+
+  // extend shared mapping to cover the snapshot. the mapping of the
+  // snapshot tracks the region if it moves, other snapshots would not
+  if (origin->size < mapping->size) {
+    void *address = extend_mapping(
+      region, origin->size, mapping->size, origin->fd, MAP_SHARED,
+      origin->snapshots == 1);
+    if (!address)
+      return NULL;
+    advise_huge_pages(address, mapping->size, mapping->flags);
+    (void)region_place(
+      address, mapping->size, mapping->flags & MAPPING_NUMA, mapping->node);
+    region = address;
+    origin = region_mapping(region);
+    origin->size = mapping->size;
+    mapping->origin = region;
+  }
+
+  return region;
+}
+
+region_t *region_commit(region_t *snapshot)
+{
+  assert(snapshot);
+
+  region_t *region = region_prepare_commit(snapshot);
+  if (!region)
+    return NULL;
+  if (region_copy(region, snapshot) == -1)
+    return NULL;
+  region_trace(region_mapping(snapshot), REGION_TRACE_COMMIT, 0, 0, -1);
+  return region;
+}
+
+void region_abort(region_t *snapshot)
+{
+  assert(snapshot);
+
+  const struct mapping mapping = *region_mapping(snapshot);
+  assert(mapping.flags & MAPPING_PRIVATE);
+  if (!(mapping.flags & MAPPING_PRIVATE))
+    return;
+
+  region_trace(&mapping, REGION_TRACE_ABORT, 0, 0, -1);
+  free(mapping.verified);
+  munmap(snapshot, mapping.size);
+
+  // release space reserved for the snapshot. other snapshots may be backed
+  // by the same pages, space is released once the last one is dropped
+  if (mapping.origin) {
+    struct mapping *origin = region_mapping(mapping.origin);
+    assert(origin->snapshots);
+    origin->snapshots--;
+    struct stat st;
+    if (!origin->snapshots && fstat(mapping.fd, &st) == 0 &&
+        (size_t)st.st_size > origin->size)
+      (void)ftruncate(mapping.fd, (off_t)origin->size);
+  }
+}
+
+#if defined(F_ADD_SEALS)
+// seals that guarantee the contents of the shared memory object never change
+#define SEALS (F_SEAL_WRITE | F_SEAL_GROW | F_SEAL_SHRINK)
+
+// sealed regions are mapped privately so that mapping information can be
+// recorded, pages are shared with the shared memory object until written
+// to. everything but the first page is made read-only
+nonnull_all
+static void protect_sealed(region_t *region, size_t size, uint32_t flags)
+{
+  struct mapping *mapping = region_mapping(region);
+  mapping->flags = MAPPING_SEALED | (flags & MAPPING_HUGE_PAGES);
+  mapping->size = size;
+  advise_huge_pages(region, size, flags);
+  (void)mprotect((uint8_t *)region + PAGE_SIZE, size - PAGE_SIZE, PROT_READ);
+}
+#endif
+
+int region_publish(region_t *region)
+{
+  assert(region);
+
+#if defined(F_ADD_SEALS)
+  const struct mapping mapping = *region_mapping(region);
+  if (!(mapping.flags & MAPPING_SHARED) ||
+      (mapping.flags & (MAPPING_FILE | MAPPING_HUGETLB)) ||
+      mapping.fd == -1 || mapping.snapshots || is_writing_back(&mapping))
+    return -1;
+
+  // shared memory objects created without MFD_ALLOW_SEALING are sealed
+  const int seals = fcntl(mapping.fd, F_GET_SEALS);
+  if (seals == -1 || (seals & F_SEAL_SEAL))
+    return -1;
+  const int fd = fcntl(mapping.fd, F_DUPFD_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+
+  // slabs that are being loaded are on no list
+  region_seal(region);
+
+  // writable shared mappings prevent sealing, replace the mapping in place
+  const int prot = PROT_READ | PROT_WRITE;
+  if (mmap(region, mapping.size, prot, MAP_PRIVATE | MAP_FIXED, mapping.fd, 0) == MAP_FAILED)
+    goto error;
+  if (fcntl(mapping.fd, F_ADD_SEALS, SEALS) == -1) {
+    // the first page was not written to yet, mapping information is intact
+    (void)mmap(region, mapping.size, prot, MAP_SHARED | MAP_FIXED, mapping.fd, 0);
+    goto error;
+  }
+
+  *region_mapping(region) = mapping;
+  protect_sealed(region, mapping.size, mapping.flags);
+  return fd;
+error:
+  close(fd);
+  return -1;
+#else
+  (void)region;
+  return -1;
+#endif
+}
+
+region_t *region_attach(int fd)
+{
+#if defined(F_GET_SEALS)
+  const int seals = fcntl(fd, F_GET_SEALS);
+  if (seals == -1 || (seals & SEALS) != SEALS)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 ||
+      st.st_size <= 0 || ((size_t)st.st_size & PAGE_MASK) != (size_t)st.st_size)
+    return NULL;
+
+  const size_t size = (size_t)st.st_size;
+  void *address = map_shm(size, MAP_PRIVATE, fd, 0);
+  if (address == MAP_FAILED)
+    return NULL;
+
+  region_t *region = region_open(address, size);
+  if (!region) {
+    munmap(address, size);
+    return NULL;
+  }
+
+  region_mapping(region)->fd = fd;
+  protect_sealed(region, size, 0);
+  return region;
+#else
+  (void)fd;
+  return NULL;
+#endif
+}
@@ -0,0 +1,211 @@
+/*
+ * numa.c - placement of regions on NUMA nodes
+ *
+ * Copyright (c) 2024, NLnet Labs. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#if defined(__linux__)
+# include <sys/syscall.h>
+#endif
+
+#include "macros.h"
+#include "region.h"
+#include "internal.h"
+
+// policies as defined in linux/mempolicy.h. the system calls are invoked
+// directly, libnuma is not required
+#define MPOL_BIND (2)
+#define MPOL_INTERLEAVE (3)
+#define MPOL_F_MEMS_ALLOWED (1u<<2)
+
+// nodes are encoded in eight bits (REGION_NUMA_NODE), masks are sized
+// accordingly. the kernel expects the number of bits plus one
+#define NUMA_NODES (256)
+#define NODE_BITS (8 * sizeof(unsigned long))
+#define NODE_WORDS (NUMA_NODES / NODE_BITS)
+
+// getcpu is available since glibc 2.29
+#if defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+# if __GLIBC_PREREQ(2, 29)
+#   define HAVE_GETCPU 1
+# endif
+#endif
+
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_get_mempolicy)
+// nodes the process may allocate memory from, nodes without memory are
+// never included
+static int allowed_nodes(unsigned long nodes[NODE_WORDS])
+{
+  memset(nodes, 0, NODE_WORDS * sizeof(nodes[0]));
+  if (syscall(SYS_get_mempolicy, NULL, nodes, NUMA_NODES + 1, NULL,
+              MPOL_F_MEMS_ALLOWED) == -1)
+    return -1;
+  return 0;
+}
+
+int region_place(void *address, size_t size, uint32_t flags, uint32_t node)
+{
+  assert(address);
+
+  unsigned long nodes[NODE_WORDS];
+  int mode;
+  if (flags & MAPPING_NUMA_BIND) {
+    if (node >= NUMA_NODES)
+      return -1;
+    memset(nodes, 0, sizeof(nodes));
+    nodes[node / NODE_BITS] = 1lu << (node % NODE_BITS);
+    mode = MPOL_BIND;
+  } else if (flags & MAPPING_NUMA_INTERLEAVE) {
+    if (allowed_nodes(nodes) == -1)
+      return -1;
+    mode = MPOL_INTERLEAVE;
+  } else {
+    return 0;
+  }
+
+  if (syscall(SYS_mbind, address, size, mode, nodes, NUMA_NODES + 1, 0) == -1)
+    return -1;
+  return 0;
+}
+#else
+static int allowed_nodes(unsigned long nodes[NODE_WORDS])
+{
+  // memory is local to every thread, treat it as a single node
+  memset(nodes, 0, NODE_WORDS * sizeof(nodes[0]));
+  nodes[0] = 1;
+  return 0;
+}
+
+int region_place(void *address, size_t size, uint32_t flags, uint32_t node)
+{
+  (void)address;
+  (void)size;
+  (void)node;
+  return (flags & MAPPING_NUMA) ? -1 : 0;
+}
+#endif
+
+// node the calling thread runs on, -1 if unknown. glibc uses the vDSO,
+// which is cheap enough to be used on every lookup
+static always_inline int local_node(void)
+{
+#if defined(HAVE_GETCPU)
+  unsigned int cpu, node;
+  if (getcpu(&cpu, &node) == -1)
+    return -1;
+  return (int)node;
+#elif defined(__linux__) && defined(SYS_getcpu)
+  unsigned int cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) == -1)
+    return -1;
+  return (int)node;
+#else
+  return -1;
+#endif
+}
+
+struct region_replicas {
+  /** Region replicas were taken of, used on nodes without a replica. */
+  region_t *region;
+  /** Number of replicas, i.e. the highest node with a replica plus one. */
+  size_t count;
+  /** Replica per node, NULL for nodes without one. */
+  region_t *replicas[];
+};
+
+// create a region bound to node and adopt a copy of region. the replica
+// is published so that it is sealed like the region it was taken of
+nonnull_all
+static region_t *replicate(region_t *region, uint32_t node)
+{
+  const struct mapping *mapping = region_mapping(region);
+  uint32_t flags = REGION_NUMA_BIND | REGION_NUMA_NODE(node);
+  if (mapping->flags & MAPPING_HUGE_PAGES)
+    flags |= REGION_HUGE_PAGES;
+
+  region_t *replica = region_create(mapping->size, flags);
+  if (!replica)
+    return NULL;
+
+  // pages are allocated on the node as they are copied
+  const struct mapping replica_mapping = *region_mapping(replica);
+  region_clone(replica, region);
+  if (!region_open(replica, replica_mapping.size))
+    goto error;
+  *region_mapping(replica) = replica_mapping;
+
+  const int fd = region_publish(replica);
+  if (fd == -1)
+    goto error;
+  close(fd);
+  return replica;
+error:
+  // mapping information may be overwritten by the copy
+  *region_mapping(replica) = replica_mapping;
+  region_destroy(replica);
+  return NULL;
+}
+
+region_replicas_t *region_replicate(region_t *region)
+{
+  assert(region);
+
+  // contents of sealed regions cannot change while they are copied
+  if (!(region_mapping(region)->flags & MAPPING_SEALED))
+    return NULL;
+
+  unsigned long nodes[NODE_WORDS];
+  if (allowed_nodes(nodes) == -1)
+    return NULL;
+
+  size_t count = 0;
+  for (size_t node = 0; node < NUMA_NODES; node++)
+    if (nodes[node / NODE_BITS] & (1lu << (node % NODE_BITS)))
+      count = node + 1;
+
+  region_replicas_t *replicas =
+    calloc(1, sizeof(*replicas) + count * sizeof(replicas->replicas[0]));
+  if (!replicas)
+    return NULL;
+  replicas->region = region;
+  replicas->count = count;
+
+  for (size_t node = 0; node < count; node++) {
+    if (!(nodes[node / NODE_BITS] & (1lu << (node % NODE_BITS))))
+      continue;
+    if (!(replicas->replicas[node] = replicate(region, (uint32_t)node))) {
+      region_replicas_destroy(replicas);
+      return NULL;
+    }
+  }
+
+  return replicas;
+}
+
+void region_replicas_destroy(region_replicas_t *replicas)
+{
+  assert(replicas);
+
+  for (size_t node = 0; node < replicas->count; node++)
+    if (replicas->replicas[node])
+      region_destroy(replicas->replicas[node]);
+  free(replicas);
+}
+
+region_t *region_replica(const region_replicas_t *replicas)
+{
+  assert(replicas);
+
+  const int node = local_node();
+  if (node >= 0 && (size_t)node < replicas->count && replicas->replicas[node])
+    return replicas->replicas[node];
+  return replicas->region;
+}
@@ -8,16 +8,27 @@
  */
 #include <assert.h>
 #include <string.h>
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+# include <arm_neon.h>
+#endif
 
 #include "macros.h"
 #include "region.h"
-
-// hardware page size is typically 4096 bytes, though increasing the virtual
-// size makes it more efficient for large objects. e.g., for 512 byte objects,
-// a single page slab is on the small side. depending on requirements,
-// consider increasing virtual page size to 16384?
-#define PAGE_SIZE (4096llu)
-#define PAGE_MASK (~(PAGE_SIZE - 1))
+#include "internal.h"
+
+// verify objects released to a cache are in use (detect double free and
+// invalid offsets). invalid releases are ignored, and trigger an assertion
+// in debug builds. enabled in debug builds by default, define as 0 or 1 to
+// override
+#if !defined(REGION_CHECK_FREE)
+# if defined(NDEBUG)
+#   define REGION_CHECK_FREE (0)
+# else
+#   define REGION_CHECK_FREE (1)
+# endif
+#endif
 
 #if 0
 struct object {
@@ -31,18 +42,61 @@ struct object_list {
   size_t count; // << this can be a 16-bit number
 };
 
-#if 0
 // large objects require bookkeeping too. return the offset (address) from
-// where the user can start writing data. prepend bookkeeping information to
-// the object and perhaps a signature to detect memory errors
-
+// where the user can start writing data. bookkeeping information is prepended
+// to the object in the form of a boundary tag (Knuth). the tag holds the size
+// of the block and flags to signal if the block and the block preceding it
+// are in use. free blocks additionally hold the offsets of the previous and
+// next free block in the same size class and replicate the size in the last
+// eight bytes (footer) so that a block can be coalesced with the block
+// preceding it on release without searching.
 struct large_object {
-  // * signature? (error detection)
-  // * size
-  // * previous, next
-  // * dirty
+  /** Size of the block (including tag) and in-use flags. */
+  uint64_t tag;
+  // * free blocks only
+  /** Offset of next free block in the same size class. */
+  uintptr_t next;
+  /** Offset of previous free block in the same size class. */
+  uintptr_t prev;
 };
-#endif
+
+#define IN_USE (1llu)
+#define PREV_IN_USE (2llu)
+#define TAG_FLAGS (7llu)
+// tag, next, prev and footer
+#define MIN_BLOCK_SIZE (32llu)
+#define HEAP_CLASSES (64)
+
+// levels in the index of used pages
+#define INDEX_LEVELS (3)
+
+// slabs span 1, 2, 4 or 16 pages. caches use the smallest slab that loses
+// no more than 1/SLAB_WASTE to the header and unused space, or the slab
+// that loses the least if none qualify
+#define SLAB_WASTE (32)
+#define MAX_SLAB_PAGES (16)
+
+// the start of objects is offset per slab within the space left unused in
+// the slab so that objects at the same index in different slabs do not
+// share cache sets (coloring, Bonwick)
+#define CACHE_LINE (64)
+
+// free slabs retained per cache by default. a small number avoids returning
+// and allocating pages repeatedly if usage fluctuates around a slab boundary
+#define CACHE_RETAIN (2)
+
+// statistics are maintained by the (single) writer and may be read while
+// the region is updated. counters are updated with relaxed atomic loads and
+// stores (plain moves on common architectures), not read-modify-write
+// operations, readers load counters individually and may therefore observe
+// counters that are slightly out of sync with each other
+#define STAT_LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#define STAT_STORE(counter, value) \
+  __atomic_store_n(&(counter), (value), __ATOMIC_RELAXED)
+#define STAT_ADD(counter, value) \
+  STAT_STORE(counter, STAT_LOAD(counter) + (value))
+#define STAT_SUB(counter, value) \
+  STAT_STORE(counter, STAT_LOAD(counter) - (value))
 
 struct page {
   /** Offset of next page. */
@@ -60,9 +114,19 @@ struct slab {
   uintptr_t list;
   /** Offset of next slab that belongs to the same cache+list. */
   uintptr_t next;
+  /** Offset of previous slab that belongs to the same cache+list. */
+  uintptr_t prev;
   /** Offset where objects start from. */
   uintptr_t objects;
+  /** Number of bytes objects are offset by (color). */
+  size_t color;
+  /** Offset of next slab objects were released to in the same snapshot. */
+  uintptr_t next_dirty;
+  /** Snapshot slab was put on the list of updated slabs in. */
+  uint64_t epoch;
   struct object_list free_objects;
+  /** Objects in use, one bit per object. */
+  uint64_t used[];
 };
 
 struct slab_list {
@@ -79,12 +143,53 @@ struct cache {
   uint16_t object_size;
   /** Boundary to align cache objects on (always a multiple of 8). */
   uint16_t alignment;
+  /** Offset of the free list link in objects. objects are constructed
+      once for caches with a constructor, the link follows the object so
+      that constructed state is retained. */
+  uint16_t link;
   /** Aligned object size for cache. */
   size_t aligned_size;
+  /** Number of pages per slab. */
+  size_t slab_pages;
   /** Number of objects that fit in a slab. */
   size_t object_count;
-  // * constructor / destructor interfaces are not required (yet)
-  // * statistics
+  /** Reciprocal of aligned size, ceil(2^32 / aligned_size). */
+  uint64_t reciprocal;
+  /** Number of free slabs retained, surplus slabs are returned. */
+  size_t retain;
+  /** Largest color, i.e. number of bytes left unused in a slab. */
+  size_t max_color;
+  /** Color of the next slab. */
+  size_t color;
+  /** Offset of last slab objects were released to in a snapshot. */
+  uintptr_t dirty_slabs;
+  // slab objects are handed out from in load mode (see load_alloc)
+  struct {
+    /** Offset of slab, 0 if no slab is being loaded. */
+    uintptr_t slab;
+    /** Offset of next object. */
+    uintptr_t next;
+    /** Offset just past the last object. */
+    uintptr_t end;
+  } load;
+  // objects allocated when an estimate was made and objects allocated by
+  // the transfer that was last committed (see region_estimate)
+  struct {
+    uint64_t allocs;
+    uint64_t objects;
+  } estimate;
+  struct {
+    /** Number of objects allocated. */
+    uint64_t allocs;
+    /** Number of objects released. */
+    uint64_t frees;
+    /** Number of slabs allocated. */
+    uint64_t slabs_created;
+    /** Number of slabs returned to the region. */
+    uint64_t slabs_released;
+    /** Number of bytes requested (object size for cache allocations). */
+    uint64_t requested;
+  } stats;
 };
 
 // cache and heap pages are located apart to allow for large objects. slab
@@ -92,19 +197,36 @@ struct cache {
 // to determine if an object is allocated from a slab or the heap, checking
 // the range it falls into works if the region is fixed. unfortunately,
 // regions may need to be resized (and remapped), meaning the contiguous
-// memory space becomes segmented. to conveniently determine if a page is
-// managed as a slab or as heap memory, the allocator maintains two bitsets
-// where each bit represents a page. if the corresponding bit for a page is
-// not set, the page is free.
+// memory space becomes segmented. to conveniently determine what a page is
+// used for, the allocator maintains a descriptor (one byte) per page in the
+// spirit of vmcache (Leis et al.). the descriptor holds the type of page,
+// the cache slab pages belong to and if the page was updated, i.e. an
+// object is classified, its cache found and its page marked updated from a
+// single cache line.
 //
-// the bitsets are located in the first page while the region is small enough.
-// if a region is resized and the number of bits required to cover the entire
-// region exceeds the (otherwise unused) space available in the first page,
-// pages are reserved from the tail. the bitsets are never exposed to the user
-// and are therefore safe to move.
+// descriptors are located in the first page while the region is small
+// enough. if a region is resized and the number of descriptors required to
+// cover the entire region exceeds the (otherwise unused) space available in
+// the first page, pages are reserved from the tail. descriptors are never
+// exposed to the user and are therefore safe to move.
 //
-// using bitsets allows for flexibile use of pages and does not force
-// allocating segments, or lineair allocation of pages.
+// using descriptors allows for flexibile use of pages and does not force
+// allocating segments, or lineair allocation of pages. bitsets that
+// summarize descriptors are stored alongside.
+#define PAGE_FREE (0u)
+#define PAGE_HEAP (1u)
+// first page of a slab, other pages of a slab follow directly
+#define PAGE_SLAB (2u)
+#define PAGE_SLAB_TAIL (3u)
+#define PAGE_TYPE (3u)
+#define PAGE_DIRTY (1u<<2)
+// cache slab pages belong to
+#define PAGE_CACHE_SHIFT (3)
+#define PAGE_CACHE(descriptor) ((size_t)(descriptor) >> PAGE_CACHE_SHIFT)
+
+_Static_assert(REGION_CACHES <= (1 << (8 - PAGE_CACHE_SHIFT)),
+               "cache identifiers must fit a page descriptor");
+
 struct bitset {
   uintptr_t bits;
   size_t size;
@@ -116,48 +238,155 @@ struct bitset {
 // * multiple copies are easy to maintain
 // * addresses that overlap with the administration are always invalid
 // * address of mapped region automatically points to the administration
+//
+// regions may be persisted (mapped from a file), the administration starts
+// with a header to identify regions and the layout they were created with.
+
+#define REGION_MAGIC (0x6e6f69676572llu) // "region"
+#define REGION_VERSION (5u)
 
 struct region {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t page_size;
   size_t size;
-#if 0
-  /** List of pages that have been updated. */
-  uintptr_t dirty_pages;
-  /** List of large objects that have been updated. */
-  uintptr_t dirty_objects;
-#endif
   uintptr_t pages;
-  // pointer to first free page (avoid unnecessary scanning)
-  // FIXME: transform into a circular buffer or similar to improve
-  //        performance in scenarios where a low order page is released
-  //        after allocating a high order page
-  uintptr_t free_page;
-
-  // (binary?) heap is maintained with the region, but we have to account for
-  // multiple non-contiguous segments
+  // process local, retained on commit
+  struct mapping mapping;
+
+  // descriptor per page, see above
+  struct {
+    uintptr_t entries;
+    /** Number of descriptors, one per page in the region. */
+    size_t size;
+    /** Number of pages that can be allocated, pages reserved for the
+        descriptors and bitmaps follow. */
+    size_t limit;
+  } descriptors;
+
+  // heap is maintained with the region, but we have to account for multiple
+  // non-contiguous segments. each segment is a run of consecutive pages that
+  // starts with a block and ends with a fence (an empty tag that is always in
+  // use) unless the segment is directly followed by another segment. free
+  // blocks are segregated by size in power-of-two classes (vmem), list n
+  // holding free blocks with a size in the range [2^n, 2^(n+1)).
   struct {
-    struct bitset bitset;
-    // implement
+    // pointer just past the highest page that can be free. heap pages are
+    // allocated from the tail (avoid unnecessary scanning)
+    uintptr_t free_page;
+    /** Bitmap of size classes with at least one free block. */
+    uint64_t classes;
+    /** Offset of first free block per size class. */
+    uintptr_t free[HEAP_CLASSES];
+    struct {
+      /** Number of objects allocated. */
+      uint64_t allocs;
+      /** Number of objects released. */
+      uint64_t frees;
+      /** Number of bytes requested. */
+      uint64_t requested;
+      /** Number of bytes handed out (blocks including tags). */
+      uint64_t allocated;
+      /** Number of pages allocated to the heap. */
+      uint64_t pages;
+      /** Number of bytes in blocks in use. */
+      uint64_t in_use;
+      /** Number of bytes in free blocks. */
+      uint64_t free;
+      /** Number of free blocks. */
+      uint64_t free_blocks;
+    } stats;
   } heap;
 
   // region reserves space for a predefined set of caches
   struct {
-    struct bitset bitset;
     size_t count;
-    struct cache cache[20];
+    /** Objects are allocated by bump pointer, see region_load. */
+    bool load;
+    struct cache cache[REGION_CACHES];
   } caches;
+
+  // index of pages in use to find free pages without scanning descriptors
+  // in their entirety. a bit in the first level is set if all 64 pages
+  // covered by the corresponding descriptors are in use, a bit in the next
+  // level is set if the corresponding word in the level below is full, and
+  // so on. the top level is scanned linearly, but one
+  // word covers 2^24 pages (64 GiB)
+  struct bitset used[INDEX_LEVELS];
+
+  // pages that have been updated. copy-on-write copies are committed by
+  // copying back updated pages only. descriptors flag updated pages for the
+  // entire region (including pages reserved for descriptors), one bit per
+  // 64 pages in the summary to find updated pages without scanning
+  // descriptors in their entirety. the region administration is considered
+  // to be updated on every change
+  struct {
+    struct bitset summary;
+    /** Number of pages that have been updated. */
+    size_t count;
+    /** Number of pages that have been updated and were released. */
+    size_t released;
+    /** Incremented whenever updates are cleared, identifies snapshots. */
+    uint64_t epoch;
+  } dirty;
+
+  // checksum per page for regions that are persisted. checksums of data
+  // pages are updated on commit, pages that are updated in place (and
+  // pages that were never committed) have no checksum (0)
+  struct {
+    uintptr_t checksums;
+    size_t size;
+    /** Checksum of the administration, computed on commit after the
+        administration is copied back, 0 if updated since. */
+    uint64_t administration;
+  } checksums;
+
+  // memory required by the transfer that was last committed, learned from
+  // the statistics (see region_estimate)
+  struct {
+    /** Records and octets of the transfer an estimate was made for. */
+    uint64_t records;
+    uint64_t octets;
+    /** Bytes handed out by the heap when the estimate was made. */
+    uint64_t heap_allocated;
+    /** Pages allocated to the heap when the estimate was made. */
+    uint64_t heap_pages;
+    struct {
+      /** Records and octets of the transfer that was last committed. */
+      uint64_t records;
+      uint64_t octets;
+      /** Bytes handed out by the heap, or taken from the region by the
+          heap if more (objects per cache are recorded with the caches). */
+      uint64_t heap_bytes;
+    } profile;
+  } estimate;
 };
 
 
-// map small object sizes to caches. use next power of two for now.
+// size classes for small objects. classes are spaced 8 to 32 bytes apart
+// (at most 25% above 64 bytes) to limit internal fragmentation for the
+// 24 to 96 byte objects that are most common (domain names, small rdata).
+// the list expands to the class table and the size to class map at compile
+// time, classes must be multiples of 8 in ascending order up to 256
+#define ALLOC_CACHES(X, arg) \
+  X(8, arg) X(16, arg) X(24, arg) X(32, arg) X(48, arg) X(64, arg) \
+  X(80, arg) X(96, arg) X(128, arg) X(160, arg) X(192, arg) X(224, arg) \
+  X(256, arg)
+
+// index of the first class that fits size, i.e. the number of classes that
+// are smaller
+#define ALLOC_CACHE_SMALLER(class, size) + ((size) > (class))
+#define ALLOC_SIZE_INDEX(size) (0 ALLOC_CACHES(ALLOC_CACHE_SMALLER, size))
+#define ALLOC_SIZE_INDEX4(size) \
+  ALLOC_SIZE_INDEX(size), ALLOC_SIZE_INDEX(size + 8), \
+  ALLOC_SIZE_INDEX(size + 16), ALLOC_SIZE_INDEX(size + 24)
+
+// map small object sizes to caches, one entry per 8 bytes
 static const uint8_t alloc_size_index[] = {
-   0, /*   8 */     1, /*  16 */     2, /*  24 */     2, /*  32 */
-   3, /*  40 */     3, /*  48 */     3, /*  56 */     3, /*  64 */
-   4, /*  72 */     4, /*  80 */     4, /*  88 */     4, /*  96 */
-   4, /* 104 */     4, /* 112 */     4, /* 120 */     4, /* 128 */
-   5, /* 136 */     5, /* 144 */     5, /* 152 */     5, /* 160 */
-   5, /* 168 */     5, /* 176 */     5, /* 184 */     5, /* 192 */
-   5, /* 200 */     5, /* 208 */     5, /* 216 */     5, /* 224 */
-   5, /* 232 */     5, /* 240 */     5, /* 248 */     5  /* 256 */
+  ALLOC_SIZE_INDEX4(8), ALLOC_SIZE_INDEX4(40),
+  ALLOC_SIZE_INDEX4(72), ALLOC_SIZE_INDEX4(104),
+  ALLOC_SIZE_INDEX4(136), ALLOC_SIZE_INDEX4(168),
+  ALLOC_SIZE_INDEX4(200), ALLOC_SIZE_INDEX4(232)
 };
 
 struct alloc_cache {
@@ -166,435 +395,3004 @@ struct alloc_cache {
   size_t align;
 };
 
+// names must be unique after truncation to 15 characters
+#define ALLOC_CACHE(class, arg) { "alloc-" #class, class, 8 },
+
 static const struct alloc_cache alloc_caches[] = {
-  { "region_alloc-8",     8, 8 },
-  { "region_alloc-16",   16, 8 },
-  { "region_alloc-32",   32, 8 },
-  { "region_alloc-64",   64, 8 },
-  { "region_alloc-128", 128, 8 },
-  { "region_alloc-256", 256, 8 }
+  ALLOC_CACHES(ALLOC_CACHE, 0)
 };
 
+#define ALLOC_CACHE_COUNT (sizeof(alloc_caches) / sizeof(alloc_caches[0]))
+
+_Static_assert(sizeof(alloc_size_index) == 256 / 8,
+               "size index must cover small objects");
+_Static_assert(ALLOC_SIZE_INDEX(256) == ALLOC_CACHE_COUNT - 1,
+               "largest class must be 256 bytes");
+_Static_assert(ALLOC_CACHE_COUNT <
+               sizeof(((struct region *)0)->caches.cache) / sizeof(struct cache),
+               "caches must be available for region_cache_create");
+
 nonnull((1))
 static always_inline void set_bit(
   region_t *region, uintptr_t bits, size_t size, size_t bit)
 {
-  uint8_t *ptr = swizzle(region, bits);
-  ptr[ (bit >> 3) ] |= (1u << ((bit ^ 7) & 0xfu));
+  assert(bit < size);
+  (void)size;
+  uint64_t *ptr = swizzle(region, bits);
+  ptr[ (bit >> 6) ] |= (1llu << (bit & 63));
+}
+
+nonnull((1))
+static always_inline void clear_bit(
+  region_t *region, uintptr_t bits, size_t size, size_t bit)
+{
+  assert(bit < size);
+  (void)size;
+  uint64_t *ptr = swizzle(region, bits);
+  ptr[ (bit >> 6) ] &= ~(1llu << (bit & 63));
 }
 
 nonnull((1))
-static always_inline uint8_t get_bit(
+static always_inline bool get_bit(
   const region_t *region, uintptr_t bits, size_t size, size_t bit)
 {
-  const uint8_t *ptr = swizzle(region, bits);
-  return ptr[ (bit >> 3) ] & (1u << ((bit ^ 7) & 0xfu));
+  assert(bit < size);
+  (void)size;
+  const uint64_t *ptr = swizzle(region, bits);
+  return (ptr[ (bit >> 6) ] & (1llu << (bit & 63))) != 0;
 }
 
+// offset just past the last page that can be allocated
+nonnull_all
+static always_inline uintptr_t region_limit(const region_t *region)
+{
+  return (uintptr_t)region->descriptors.limit * PAGE_SIZE;
+}
 
-static size_t aligned_size(size_t size, size_t align)
+nonnull_all
+static always_inline uint8_t *page_descriptor(const region_t *region, size_t bit)
 {
-  if (align == 0)
-    align = 8;
+  assert(bit < region->descriptors.size);
+  return (uint8_t *)swizzle(region, (intptr_t)region->descriptors.entries) + bit;
+}
 
-  if (align > size)
-    return align;
+// one bit per descriptor for the 64 descriptors in word index, set if any
+// of the bits in mask is set. descriptors are padded to a multiple of 64
+nonnull_all
+static always_inline uint64_t descriptor_bits(
+  const region_t *region, size_t index, uint8_t mask)
+{
+  const uint8_t *descriptors =
+    (const uint8_t *)swizzle(region, (intptr_t)region->descriptors.entries) + index * 64;
+
+#if defined(__AVX2__)
+  const __m256i masks = _mm256_set1_epi8((char)mask);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i low = _mm256_and_si256(
+    _mm256_loadu_si256((const __m256i *)descriptors), masks);
+  const __m256i high = _mm256_and_si256(
+    _mm256_loadu_si256((const __m256i *)(descriptors + 32)), masks);
+  const uint32_t low_bits =
+    ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, zero));
+  const uint32_t high_bits =
+    ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, zero));
+  return (uint64_t)low_bits | ((uint64_t)high_bits << 32);
+#else
+  const uint64_t ones = 0x0101010101010101llu;
+  uint64_t word = 0;
+  for (size_t chunk = 0; chunk < 8; chunk++) {
+    uint64_t bytes;
+    memcpy(&bytes, descriptors + chunk * 8, sizeof(bytes));
+# if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    bytes = __builtin_bswap64(bytes);
+# endif
+    bytes &= mask * ones;
+    // set the high bit of bytes that are not zero and gather those
+    bytes = (bytes | ((bytes & (0x7f * ones)) + (0x7f * ones))) & (0x80 * ones);
+    word |= (((bytes >> 7) * 0x0102040810204080llu) >> 56) << (chunk * 8);
+  }
+  return word;
+#endif
+}
 
-  return align * ((size + (align - 1)) / align);
+nonnull_all
+static void mark_dirty(region_t *region, size_t bit);
+
+nonnull_all
+static always_inline bool is_free_page(const region_t *region, uintptr_t page)
+{
+  return (*page_descriptor(region, page / PAGE_SIZE) & PAGE_TYPE) == PAGE_FREE;
 }
 
-static intptr_t cache_init(
-  struct region *region, const char *name, size_t size, size_t align)
+// page is updated, but not in use by either heap or caches
+nonnull_all
+static always_inline bool is_released_page(const region_t *region, size_t bit)
 {
-  // FIXME: must not add duplicates, check (same name)
+  return bit >= region->pages / PAGE_SIZE &&
+         bit < region->descriptors.limit &&
+         is_free_page(region, bit * PAGE_SIZE);
+}
 
-  const size_t id = region->caches.count++;
-  struct cache *cache = &region->caches.cache[id];
+nonnull_all
+static always_inline void mark_page(region_t *region, uintptr_t offset)
+{
+  const size_t bit = offset / PAGE_SIZE;
+  if (likely(*page_descriptor(region, bit) & PAGE_DIRTY))
+    return;
+  mark_dirty(region, bit);
+}
 
-  const size_t slab_space = PAGE_SIZE - sizeof(struct slab);
-  size_t name_length = strlen(name);
-  if (name_length >= sizeof(cache->name))
-    name_length = sizeof(cache->name) - 1;
+// mark page updated, modifications to descriptors and bitsets themselves
+// are tracked too
+nonnull_all
+static never_inline void mark_dirty(region_t *region, size_t bit)
+{
+  // the administration is updated on every change
+  region->checksums.administration = 0;
+  *page_descriptor(region, bit) |= PAGE_DIRTY;
+  set_bit(region, region->dirty.summary.bits, region->dirty.summary.size, bit >> 6);
+  STAT_ADD(region->dirty.count, 1);
+  if (is_released_page(region, bit))
+    region->dirty.released++;
+  mark_page(region, region->descriptors.entries + bit);
+  mark_page(region, region->dirty.summary.bits + (bit >> 12) * sizeof(uint64_t));
+}
 
-  memset(cache, 0, sizeof(*cache));
-  memcpy(cache->name, name, name_length);
-  cache->object_size = size;
-  cache->alignment = align;
-  cache->aligned_size = aligned_size(size, align);
-  cache->object_count = slab_space / cache->aligned_size;
+nonnull_all
+static always_inline bool is_dirty_page(const region_t *region, size_t bit)
+{
+  return (*page_descriptor(region, bit) & PAGE_DIRTY) != 0;
+}
 
-  return id;
+// snapshots are transactions. pages are copied on first write and every
+// page that is updated is copied back on commit, i.e. the number of pages
+// touched determines the cost of a transaction. slabs and pages updated in
+// the snapshot are preferred over untouched ones
+nonnull_all
+static always_inline bool in_transaction(const region_t *region)
+{
+  return (region->mapping.flags & MAPPING_PRIVATE) != 0;
 }
 
-struct region *region_init(void *address, size_t size)
+// published regions are read-only but for the first page (see
+// region_publish), objects can no longer be allocated or released
+nonnull_all
+static always_inline bool is_sealed(const region_t *region)
 {
-  // region must be page aligned
-  if (((uintptr_t)address & PAGE_MASK) != (uintptr_t)address)
-    return NULL;
+  return (region->mapping.flags & MAPPING_SEALED) != 0;
+}
 
-  size_t pages = ((sizeof(struct region) + PAGE_SIZE) / PAGE_SIZE) * PAGE_SIZE;
-  size_t caches = sizeof(alloc_caches) / sizeof(alloc_caches[0]);
-  size_t size_pages = size / PAGE_SIZE;
+// the header is part of the administration, updates to fields that are not
+// accompanied by updates to other pages are marked explicitly so that the
+// checksum is cleared. published regions are not persisted
+nonnull_all
+static always_inline void mark_administration(region_t *region)
+{
+  if (!is_sealed(region))
+    mark_page(region, 0);
+}
 
-  // size must be a multiple of page size and sufficiently large enough
-  if ((size & PAGE_MASK) != size || size < pages || size_pages <= caches)
-    return NULL;
+nonnull_all
+static always_inline void mark_pages(
+  region_t *region, uintptr_t offset, size_t size)
+{
+  assert(size);
+  const uintptr_t last = (offset + (size - 1)) & PAGE_MASK;
+  for (uintptr_t page = offset & PAGE_MASK; page <= last; page += PAGE_SIZE)
+    mark_page(region, page);
+}
 
-  struct region *region = address;
+// mark page holding the bit updated
+nonnull_all
+static always_inline void mark_bit(
+  region_t *region, const struct bitset *bitset, size_t bit)
+{
+  mark_page(region, bitset->bits + (bit >> 6) * sizeof(uint64_t));
+}
 
-  // bitmap size required to track heap and slab pages (aligned to 8 bytes)
-  size_t bitmap_size = ((size / PAGE_SIZE) + 7) & (size_t)-8;
-  // space available for bitmaps is page size minus space required for
-  // region administration divided by two (cache and heap bitmaps)
-  size_t unused_space = (PAGE_SIZE - sizeof(struct region)) >> 1;
-  if (bitmap_size < unused_space) {
-    region->heap.bitset.bits = PAGE_SIZE - (bitmap_size << 1);
-    region->heap.bitset.size = bitmap_size;
-    region->caches.bitset.bits = PAGE_SIZE - bitmap_size;
-    region->caches.bitset.size = bitmap_size;
-  } else {
-    // a sensible number of pages must be available for data
-    size_t bitmap_pages = ((bitmap_size << 1) + (PAGE_SIZE - 1)) / PAGE_SIZE;
-    if (bitmap_pages + caches >= size_pages)
-      return NULL;
-    region->heap.bitset.bits = size - (PAGE_SIZE * bitmap_pages);
-    region->heap.bitset.size = bitmap_size;
-    region->caches.bitset.bits = size - ((PAGE_SIZE * bitmap_pages) >> 2);
-    region->caches.bitset.size = bitmap_size;
+// find first updated page at or after bit, returns size if there are none
+nonnull_all
+static size_t find_dirty_page(const region_t *region, size_t bit)
+{
+  const uint64_t *summary = swizzle(region, region->dirty.summary.bits);
+  const size_t size = region->descriptors.size;
+
+  if (bit >= size)
+    return size;
+
+  // check remainder of the block the bit resides in first
+  uint64_t block =
+    descriptor_bits(region, bit >> 6, PAGE_DIRTY) & ~((1llu << (bit & 63)) - 1);
+  if (block)
+    return (bit & ~(size_t)63) + (size_t)__builtin_ctzll(block);
+
+  // use summary to find the next block with updated pages
+  size_t index = (bit >> 6) + 1;
+  while (index < region->dirty.summary.size) {
+    uint64_t word = summary[index >> 6] & ~((1llu << (index & 63)) - 1);
+    if (!word) {
+      index = (index & ~(size_t)63) + 64;
+      continue;
+    }
+    index = (index & ~(size_t)63) + (size_t)__builtin_ctzll(word);
+    assert(index < region->dirty.summary.size);
+    block = descriptor_bits(region, index, PAGE_DIRTY);
+    assert(block);
+    return (index << 6) + (size_t)__builtin_ctzll(block);
   }
 
-  region->size = size;
-  region->caches.count = 0;
-  region->pages = region->free_page = pages;
+  return size;
+}
 
-  // initialize small object caches
-  for (size_t index=0; index < caches; index++) {
-    const struct alloc_cache *cache = &alloc_caches[index];
-    (void)cache_init(region, cache->name, cache->size, cache->align);
+nonnull_all
+static void clear_dirty(region_t *region)
+{
+  uint8_t *descriptors = swizzle(region, (intptr_t)region->descriptors.entries);
+  uint64_t *summary = swizzle(region, region->dirty.summary.bits);
+  const size_t size = (region->dirty.summary.size + 63) / 64;
+
+  for (size_t index = 0; index < size; index++) {
+    for (uint64_t word = summary[index]; word; word &= word - 1) {
+      uint8_t *block = descriptors + (index * 64 + (size_t)__builtin_ctzll(word)) * 64;
+      for (size_t bit = 0; bit < 64; bit++)
+        block[bit] &= (uint8_t)~PAGE_DIRTY;
+    }
+    summary[index] = 0;
   }
 
-  return region;
+  STAT_STORE(region->dirty.count, 0);
+  region->dirty.released = 0;
+  region->dirty.epoch++;
 }
 
+// pages released in a snapshot are updated and thus committed regardless,
+// i.e. reusing these pages within the snapshot is free. one bit per page in
+// block index, set if the page is released
 nonnull_all
-static uintptr_t allocate_page(struct region *region)
+static always_inline uint64_t released_bits(const region_t *region, size_t index)
 {
-  // check if a free (lowest to highest) page is available
-  const uintptr_t page = region->free_page;
-
-  if (!page)
-    return 0;
-
-  assert((page & PAGE_MASK) == page);
-  assert(region->heap.bitset.size == region->caches.bitset.size);
-
-  // determine offset relative to heap and cache bases and scan forward in
-  // 64 bit blocks (64 pages)
-  // FIXME: improve using vectorization or roaring bitmaps?
+  uint64_t bits = descriptor_bits(region, index, PAGE_DIRTY) &
+                 ~descriptor_bits(region, index, PAGE_TYPE);
+  // pages reserved for region administration are never released
+  const size_t first = region->pages / PAGE_SIZE, limit = region->descriptors.limit;
+  if (index * 64 < first)
+    bits &= first - index * 64 < 64 ? (uint64_t)-1 << (first - index * 64) : 0;
+  if (index * 64 + 64 > limit)
+    bits &= limit > index * 64 ? (1llu << (limit - index * 64)) - 1 : 0;
+  return bits;
+}
 
-  size_t bit = page / PAGE_SIZE;
-  size_t block = (bit + 1) & (size_t)-64;
-  const size_t last_block = region->heap.bitset.size & (size_t)-64;
-  uint64_t bits = 0;
-  // ignore current page
-  if (bit > block)
-    bits = 1llu << ((bit ^ 63) & 63);
+// number of released pages, the count is maintained as pages are updated,
+// used and released, but is determined from scratch if the layout changes
+nonnull_all
+static size_t count_released(const region_t *region)
+{
+  const uint64_t *summary = swizzle(region, region->dirty.summary.bits);
+  const size_t size = (region->dirty.summary.size + 63) / 64;
+  size_t count = 0;
 
-  const uint64_t *heap_bits = swizzle(region, region->heap.bitset.bits);
-  const uint64_t *cache_bits = swizzle(region, region->caches.bitset.bits);
+  for (size_t index = 0; index < size; index++)
+    for (uint64_t word = summary[index]; word; word &= word - 1)
+      count += (size_t)__builtin_popcountll(
+        released_bits(region, index * 64 + (size_t)__builtin_ctzll(word)));
 
-  // pages are allocated to heap or cache, never both
-  assert(!(heap_bits[block] & cache_bits[block]));
-  bits |= heap_bits[block] | cache_bits[block];
-  block++;
+  return count;
+}
 
-  for (; bits == (uint64_t)-1 && block <= last_block; block++) {
-    assert(!(heap_bits[block] & cache_bits[block]));
-    bits = heap_bits[block] | cache_bits[block];
+// find lowest run of count released pages, returns 0 if there is none
+nonnull_all
+static uintptr_t find_released_pages(const region_t *region, size_t count)
+{
+  const uint64_t *summary = swizzle(region, region->dirty.summary.bits);
+  const size_t size = (region->dirty.summary.size + 63) / 64;
+  size_t run = 0, end = 0;
+
+  for (size_t index = 0; index < size; index++) {
+    for (uint64_t word = summary[index]; word; word &= word - 1) {
+      const size_t block = index * 64 + (size_t)__builtin_ctzll(word);
+      for (uint64_t bits = released_bits(region, block); bits; bits &= bits - 1) {
+        const size_t bit = block * 64 + (size_t)__builtin_ctzll(bits);
+        run = bit == end ? run + 1 : 1;
+        end = bit + 1;
+        if (run == count)
+          return (end - count) * PAGE_SIZE;
+      }
+    }
   }
 
-  // ignore unavailable pages
-  if (block == last_block + 1)
-    bits |= 1llu << ((region->heap.bitset.size ^ 63) & 63);
-
-  if (bits != (uint64_t)-1)
-    region->free_page = (block + __builtin_ctzll(~bits)) * PAGE_SIZE;
-  else
-    region->free_page = 0;
-
-  return page;
+  return 0;
 }
 
-nonnull((1,2))
-static uintptr_t allocate_slab(region_t *region, struct cache *cache)
+nonnull_all
+static always_inline bool is_heap_page(const region_t *region, size_t bit)
 {
-  uintptr_t slab_offset;
-  if (!(slab_offset = allocate_page(region)))
-    return 0;
-
-  uint8_t *bits = swizzle(region, region->caches.bitset.bits);
-  size_t bit = slab_offset / PAGE_SIZE;
-
-  assert(bit < region->caches.bitset.size);
-  bits[ bit / 8 ] |= (1 << (7 - bit % 8));
+  return (*page_descriptor(region, bit) & PAGE_TYPE) == PAGE_HEAP;
+}
 
+// pages in use (level 0) or word in a level of the index. bits that do not
+// correspond to a page (or word) and pages reserved for region
+// administration are reported as in use
+nonnull_all
+static always_inline uint64_t index_word(
+  const region_t *region, size_t level, size_t index)
+{
+  uint64_t word;
+  size_t size;
 
-  struct slab *slab = swizzle(region, slab_offset);
-  memset((uint8_t *)slab + sizeof(uintptr_t), 0, PAGE_SIZE - sizeof(uintptr_t));
+  if (level == 0) {
+    word = descriptor_bits(region, index, PAGE_TYPE);
+    size = region->descriptors.limit;
+    const size_t first = region->pages / PAGE_SIZE;
+    if (index < (first + 63) / 64)
+      word |= first >= (index + 1) * 64
+        ? (uint64_t)-1 : (1llu << (first & 63)) - 1;
+  } else {
+    const uint64_t *bits = swizzle(region, region->used[level - 1].bits);
+    word = bits[index];
+    size = region->used[level - 1].size;
+  }
 
-  // slab
-  slab->cache = unswizzle(region, cache);
-  slab->list = unswizzle(region, &cache->free_slabs);
-  slab->next = cache->free_slabs.list;
-  slab->objects = slab_offset + (PAGE_SIZE - ((cache->object_count - 1) * cache->aligned_size));
-  slab->free_objects.list = slab->objects;
-  slab->free_objects.count = cache->object_count;
+  assert(index < (size + 63) / 64);
+  if (index == size / 64)
+    word |= ~((1llu << (size & 63)) - 1);
+  return word;
+}
 
-  // objects
-  uintptr_t object = slab->objects + ((cache->object_count - 1) * cache->aligned_size);
-  uintptr_t next_object = 0u;
-  for (; object > slab->objects; next_object = object, object -= cache->aligned_size)
-    memcpy(swizzle(region, object), &next_object, sizeof(object));
+// number of bits in a level
+nonnull_all
+static always_inline size_t index_bits(const region_t *region, size_t level)
+{
+  if (level == 0)
+    return region->descriptors.limit;
+  return region->used[level - 1].size;
+}
 
-  assert(object == slab->objects);
+// find first word in the top level at or after index that is not full,
+// returns the number of words if there are none
+nonnull_all
+static size_t find_top_word(const region_t *region, size_t index)
+{
+  const size_t size = region->used[INDEX_LEVELS - 1].size;
+  const size_t count = (size + 63) / 64;
+  const uint64_t *bits = swizzle(region, region->used[INDEX_LEVELS - 1].bits);
+
+  // the last word may be partial, leave it to index_word
+#if defined(__AVX2__)
+  const __m256i ones = _mm256_set1_epi64x(-1);
+  for (; index + 4 < count; index += 4) {
+    const __m256i words = _mm256_loadu_si256((const __m256i *)&bits[index]);
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(words, ones)) != -1)
+      break;
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  for (; index + 2 < count; index += 2) {
+    const uint32x4_t words = vreinterpretq_u32_u64(vld1q_u64(&bits[index]));
+    if (vminvq_u32(words) != UINT32_MAX)
+      break;
+  }
+#else
+  (void)bits;
+#endif
 
-  // cache
-  cache->free_slabs.list = slab_offset;
-  cache->free_slabs.count++;
+  for (; index < count; index++) {
+    if (index_word(region, INDEX_LEVELS, index) != (uint64_t)-1)
+      break;
+  }
 
-  return slab_offset;
+  return index;
 }
 
-nonnull((1))
-static intptr_t cache_alloc(region_t *region, size_t index, size_t size)
+// find lowest free page at or after bit, returns 0 if there are none. the
+// index is ascended until a word with a free page (or word) is found and
+// descended again to locate the page
+nonnull_all
+static size_t next_free_page(const region_t *region, size_t bit)
 {
-  assert(region);
-  assert(index < sizeof(region->caches.count));
+  size_t level = 0, index = bit;
 
-  struct slab *slab;
-  struct cache *cache = &region->caches.cache[index];
-  uintptr_t slab_offset, object_offset;
-
-  if (cache->partial_slabs.list) {
-    slab_offset = cache->partial_slabs.list;
-    slab = swizzle(region, slab_offset);
-    // move to full slabs if depleted
-    if (slab->free_objects.count == 1) {
-      cache->partial_slabs.count--;
-      cache->partial_slabs.list = slab->next;
-      slab->list = slab->next = cache->full_slabs.list;
-      cache->full_slabs.count++;
-      cache->full_slabs.list = slab_offset;
+  if (bit >= region->descriptors.limit)
+    return 0;
+
+  for (;;) {
+    // ignore bits before index
+    const uint64_t word = index_word(region, level, index / 64) |
+                          ((1llu << (index & 63)) - 1);
+    if (word != (uint64_t)-1) {
+      index = (index & ~(size_t)63) + (size_t)__builtin_ctzll(~word);
+      break;
     }
-  } else {
-    if (!cache->free_slabs.list && !allocate_slab(region, cache))
-      return 0;
-    assert(cache->free_slabs.count && cache->free_slabs.list);
-    slab_offset = cache->free_slabs.list;
-    slab = swizzle(region, slab_offset);
-    // remove from free slab list
-    cache->free_slabs.count--;
-    cache->free_slabs.list = slab->next;
-    if (slab->free_objects.count == 1) {
-      slab->list = unswizzle(region, &cache->full_slabs);
-      slab->next = cache->full_slabs.list;
-      cache->full_slabs.count++;
-      cache->full_slabs.list = slab_offset;
-    } else {
-      slab->list = unswizzle(region, &cache->partial_slabs);
-      slab->next = cache->partial_slabs.list;
-      cache->partial_slabs.count++;
-      cache->partial_slabs.list = slab_offset;
+
+    if (level == INDEX_LEVELS) {
+      const size_t next = find_top_word(region, (index / 64) + 1);
+      if (next * 64 >= index_bits(region, level))
+        return 0;
+      index = (next * 64) +
+        (size_t)__builtin_ctzll(~index_word(region, level, next));
+      break;
     }
-  }
 
-  slab->free_objects.count--;
-  object_offset = slab->free_objects.list;
-  memcpy(&slab->free_objects.list, swizzle(region, object_offset), sizeof(uintptr_t));
+    index = (index / 64) + 1;
+    if (index >= index_bits(region, ++level))
+      return 0;
+  }
 
-//  mark_page(region, slab_offset);
+  for (; level > 0; level--) {
+    const uint64_t word = index_word(region, level - 1, index);
+    assert(word != (uint64_t)-1);
+    index = (index * 64) + (size_t)__builtin_ctzll(~word);
+  }
 
-  return (intptr_t)object_offset;
+  return index;
 }
 
-nonnull((1))
-static always_inline void
-cache_free(region_t *region, size_t index, intptr_t object)
+// find highest free page before bit, returns 0 if there are none
+nonnull_all
+static size_t prev_free_page(const region_t *region, size_t bit)
 {
-  assert(region);
-  assert(index < sizeof(region->caches.count));
+  size_t level = 0, index = bit;
 
-  const uintptr_t slab_offset = object & PAGE_MASK;
-  const uintptr_t next_page = slab_offset + PAGE_SIZE;
-  struct slab *slab = swizzle(region, slab_offset);
-  struct cache *cache = &region->caches.cache[index];
-  assert((uintptr_t)swizzle(region, slab->cache) == (uintptr_t)cache);
+  assert(bit <= region->descriptors.limit);
 
-  const size_t uintptr_size = sizeof(object);
+  for (;;) {
+    if (!index)
+      return 0;
+    index--;
+    // ignore bits after index
+    uint64_t word = index_word(region, level, index / 64);
+    if ((index & 63) != 63)
+      word |= ~((2llu << (index & 63)) - 1);
+    if (word != (uint64_t)-1) {
+      index = (index & ~(size_t)63) + 63 - (size_t)__builtin_clzll(~word);
+      break;
+    }
 
-  // detect double free
-  for (uintptr_t free_object = slab->free_objects.list; free_object; ) {
-    assert(free_object != object);
-    assert(free_object < next_page);
-    memcmp(&free_object, swizzle(region, free_object), uintptr_size);
+    index = index / 64;
+    if (level == INDEX_LEVELS) {
+      while (index && index_word(region, level, index - 1) == (uint64_t)-1)
+        index--;
+      if (!index)
+        return 0;
+      index--;
+      index = (index * 64) + 63 -
+        (size_t)__builtin_clzll(~index_word(region, level, index));
+      break;
+    }
+    level++;
   }
 
-  memcpy(swizzle(region, object), &slab->free_objects.list, uintptr_size);
-  slab->free_objects.list = object;
-  slab->free_objects.count++;
-
-  if (slab->free_objects.count != cache->object_count)
-    return;
-
-  if (cache->partial_slabs.list == slab_offset) {
-    cache->partial_slabs.count--;
-    cache->partial_slabs.list = slab->next;
-    assert(!cache->partial_slabs.count == !cache->partial_slabs.list);
+  for (; level > 0; level--) {
+    const uint64_t word = index_word(region, level - 1, index);
+    assert(word != (uint64_t)-1);
+    index = (index * 64) + 63 - (size_t)__builtin_clzll(~word);
   }
 
-  slab->next = cache->free_slabs.list;
-  cache->free_slabs.count++;
-  memcpy(&cache->free_slabs.list, &slab_offset, uintptr_size);
+  return index;
 }
 
-nonnull((1))
-static always_inline bool is_heap_object(
-  const region_t *region, intptr_t object)
+// a page is allocated, update levels that became full
+nonnull_all
+static void index_page(region_t *region, size_t bit)
 {
-  const size_t bit = object & PAGE_MASK;
-  return 0 != get_bit(
-    region, region->caches.bitset.bits, region->caches.bitset.size, bit);
+  for (size_t level = 0; level < INDEX_LEVELS; level++) {
+    if (index_word(region, level, bit / 64) != (uint64_t)-1)
+      return;
+    bit /= 64;
+    set_bit(region, region->used[level].bits, region->used[level].size, bit);
+    mark_bit(region, &region->used[level], bit);
+  }
 }
 
-nonnull((1))
-static always_inline bool is_cache_object(
-  const region_t *region, intptr_t object)
+// a page is released, update levels that are no longer full
+nonnull_all
+static void unindex_page(region_t *region, size_t bit)
 {
-  const size_t bit = object & PAGE_MASK;
-  return 0 != get_bit(
-    region, region->heap.bitset.bits, region->heap.bitset.size, bit);
+  for (size_t level = 0; level < INDEX_LEVELS; level++) {
+    bit /= 64;
+    if (!get_bit(region, region->used[level].bits, region->used[level].size, bit))
+      return;
+    clear_bit(region, region->used[level].bits, region->used[level].size, bit);
+    mark_bit(region, &region->used[level], bit);
+  }
 }
 
-nonnull((1))
-bool is_object(const region_t *region, intptr_t object)
+// rebuild the index from the descriptors
+nonnull_all
+static void index_pages(region_t *region)
 {
-  assert(region);
-  if (object <= region->pages || object >= region->size)
-    return false;
-  // objects are aligned to 8 bytes
-  if (object & 0x7u)
-    return false;
-  // object page must be allocated to cache or heap
-  if (!is_cache_object(region, object) && !is_heap_object(region, object))
-    return false;
-  return true;
+  for (size_t level = 0; level < INDEX_LEVELS; level++) {
+    uint64_t *bits = swizzle(region, region->used[level].bits);
+    const size_t size = region->used[level].size;
+    memset(bits, 0, ((size + 63) / 64) * 8);
+    for (size_t index = 0; index < size; index++) {
+      if (index_word(region, level, index) == (uint64_t)-1)
+        bits[index / 64] |= 1llu << (index & 63);
+    }
+  }
 }
 
-nonnull((1))
-static always_inline intptr_t object_cache(
-  const region_t *region, intptr_t object)
+// mark a page as allocated to the heap or a cache
+nonnull_all
+static always_inline void use_page(
+  region_t *region, size_t bit, uint8_t descriptor)
 {
-  const struct slab *slab = swizzle(region, object & PAGE_MASK);
-  const size_t cache_offset = slab->cache;
-  const struct cache *cache = swizzle(region, cache_offset);
-  uintptr_t x = (uintptr_t)cache - (uintptr_t)&region->caches.cache[0];
-  x = x / sizeof(region->caches.cache[0]);
-  return x;//slab->cache;
+  assert(is_free_page(region, bit * PAGE_SIZE));
+  assert(descriptor & PAGE_TYPE);
+  uint8_t *page = page_descriptor(region, bit);
+  if (*page & PAGE_DIRTY) {
+    assert(region->dirty.released);
+    region->dirty.released--;
+  }
+  *page = (uint8_t)((*page & PAGE_DIRTY) | descriptor);
+  mark_page(region, region->descriptors.entries + bit);
+  index_page(region, bit);
 }
 
-#if 0
-// the heap will grow from the tail in our case. large objects are uncommon
-// in dns, but in theory, an RR may contain as much as 65535 bytes of data.
-nonnull((1))
-static intptr_t heap_alloc(region_t *region, size_t size)
+// return a page allocated to the heap or a cache to the region
+nonnull_all
+static always_inline void release_page(region_t *region, size_t bit)
 {
-  // * verify size indeed exceeds small object size
-  // * at least align on 8 bytes
-  // * reserve entire pages
+  assert(!is_free_page(region, bit * PAGE_SIZE));
+  uint8_t *page = page_descriptor(region, bit);
+  if (*page & PAGE_DIRTY)
+    region->dirty.released++;
+  *page &= PAGE_DIRTY;
+  mark_page(region, region->descriptors.entries + bit);
+  unindex_page(region, bit);
+  // heap grows downwards from the highest free page
+  if ((bit + 1) * PAGE_SIZE > region->heap.free_page)
+    region->heap.free_page = (bit + 1) * PAGE_SIZE;
 }
 
-nonnull((1))
-static void heap_free(region_t *region, intptr_t object)
+
+static size_t aligned_size(size_t size, size_t align)
 {
-  // implement
-}
-#endif
+  if (align == 0)
+    align = 8;
 
-// non-caching allocation routines use object caches internally for object
-// sizes ranging from 8 bytes to 256 bytes in roughly 10-20% increments. a
-// best-fit heap allocator is used for large objects.
+  if (align > size)
+    return align;
 
-static always_inline bool is_small_object_size(size_t size)
-{
-  return size <= 256;
+  return align * ((size + (align - 1)) / align);
 }
 
-// objects have a minimum size of sizeof(void*) bytes. an object is opaque
-// when allocated, but contains a pointer to the next free object otherwise.
-// the last available object in a slab is zeroed to indicate the slab is
-// depleted
-
-static always_inline size_t small_object_cache(size_t size)
+// number of objects that fit a slab, taking the header and one bit per
+// object into account
+static size_t slab_objects(size_t pages, size_t aligned_size)
 {
-  assert(size <= 256);
-  return alloc_size_index[ (size - 1) >> 3 ];
+  const size_t space = pages * PAGE_SIZE - sizeof(struct slab);
+  size_t count = (space * 8) / (aligned_size * 8 + 1);
+  while (count && count * aligned_size + ((count + 63) / 64) * 8 > space)
+    count--;
+  return count;
 }
 
-intptr_t region_alloc(region_t *region, size_t size)
+static size_t slab_pages(size_t aligned_size)
 {
-  assert(region);
+  static const size_t pages[] = { 1, 2, 4, MAX_SLAB_PAGES };
+  size_t best = 0, best_waste = 0;
+
+  for (size_t index = 0; index < sizeof(pages) / sizeof(pages[0]); index++) {
+    const size_t size = pages[index] * PAGE_SIZE;
+    const size_t count = slab_objects(pages[index], aligned_size);
+    if (!count)
+      continue;
+    const size_t waste = size - count * aligned_size;
+    if (waste * SLAB_WASTE <= size)
+      return pages[index];
+    // compare fractions of slab size
+    if (!best || waste * best * PAGE_SIZE < best_waste * size) {
+      best = pages[index];
+      best_waste = waste;
+    }
+  }
+
+  return best;
+}
+
+// returns the identifier of the cache or -1 if the cache cannot be created.
+// caches are identified by name, names are truncated to fit. creating a
+// cache that exists returns the existing cache if the object size and
+// alignment match
+nonnull_all
+static intptr_t cache_init(
+  struct region *region, const char *name, size_t size, size_t align,
+  bool constructed)
+{
+  const size_t max_count =
+    sizeof(region->caches.cache) / sizeof(region->caches.cache[0]);
+
+  // align must be a power of two and a multiple of 8 (or 0 for the
+  // default), objects must fit a slab. slabs are aligned to pages, larger
+  // alignments cannot be honored
+  if ((align & (align - 1)) || (align & 7) || align > PAGE_SIZE)
+    return -1;
+  // free list link follows the object if objects are constructed
+  const size_t link = constructed ? (size + 7) & ~(size_t)7 : 0;
+  const size_t link_size = constructed ? link + sizeof(uintptr_t) : size;
+  if (!size || link > UINT16_MAX ||
+      !slab_objects(MAX_SLAB_PAGES, aligned_size(link_size, align)))
+    return -1;
+
+  for (size_t index = 0; index < region->caches.count; index++) {
+    const struct cache *cache = &region->caches.cache[index];
+    if (strncmp(cache->name, name, sizeof(cache->name) - 1) != 0)
+      continue;
+    if (cache->object_size != size || cache->alignment != (align ? align : 8) ||
+        cache->link != link)
+      return -1;
+    return (intptr_t)index;
+  }
+
+  if (region->caches.count == max_count)
+    return -1;
+
+  const size_t id = region->caches.count;
+  struct cache *cache = &region->caches.cache[id];
+
+  size_t name_length = strlen(name);
+  if (name_length >= sizeof(cache->name))
+    name_length = sizeof(cache->name) - 1;
+
+  memset(cache, 0, sizeof(*cache));
+  memcpy(cache->name, name, name_length);
+  cache->object_size = size;
+  cache->alignment = align ? align : 8;
+  cache->link = (uint16_t)link;
+  cache->aligned_size = aligned_size(link_size, align);
+  cache->slab_pages = slab_pages(cache->aligned_size);
+  cache->object_count = slab_objects(cache->slab_pages, cache->aligned_size);
+  const size_t used = sizeof(struct slab) + ((cache->object_count + 63) / 64) * 8 +
+                      cache->object_count * cache->aligned_size;
+  cache->max_color = cache->slab_pages * PAGE_SIZE - used;
+  cache->color = 0;
+  cache->reciprocal = ((1llu << 32) + cache->aligned_size - 1) / cache->aligned_size;
+  cache->retain = CACHE_RETAIN;
+
+  // publish cache after it is initialized for region_cache_stats
+  __atomic_store_n(&region->caches.count, id + 1, __ATOMIC_RELEASE);
+  return id;
+}
+
+// one 32-bit checksum per page (aligned to 8 bytes)
+static always_inline size_t checksums_size(size_t pages)
+{
+  return ((pages + 1) / 2) * 8;
+}
+
+// size of descriptors (padded to read descriptors for 64 pages at once),
+// summary size required to track blocks of updated pages and size of
+// checksums
+static always_inline size_t bitmaps_size(
+  size_t pages, size_t *descriptors_size, size_t *summary_size)
+{
+  *descriptors_size = ((pages + 63) / 64) * 64;
+  *summary_size = (((*descriptors_size / 64) + 63) / 64) * 8;
+  return *descriptors_size + *summary_size + checksums_size(pages);
+}
+
+// size required for each level in the index of used pages
+static always_inline size_t index_size(size_t pages, size_t sizes[INDEX_LEVELS])
+{
+  size_t total_size = 0;
+  for (size_t level = 0; level < INDEX_LEVELS; level++) {
+    pages = (pages + 63) / 64;
+    sizes[level] = ((pages + 63) / 64) * 8;
+    total_size += sizes[level];
+  }
+  return total_size;
+}
+
+// descriptors, bitmaps and index are stored consecutively
+static always_inline size_t layout_size(
+  size_t pages, size_t *descriptors_size, size_t *summary_size)
+{
+  size_t sizes[INDEX_LEVELS];
+  return bitmaps_size(pages, descriptors_size, summary_size) + index_size(pages, sizes);
+}
+
+nonnull_all
+static void place_bitmaps(
+  region_t *region, uintptr_t bitmaps, size_t size_pages, size_t limit)
+{
+  size_t descriptors_size, summary_size;
+  (void)bitmaps_size(size_pages, &descriptors_size, &summary_size);
+
+  region->descriptors.entries = bitmaps;
+  region->descriptors.size = size_pages;
+  region->descriptors.limit = limit;
+  region->dirty.summary.bits = bitmaps + descriptors_size;
+  region->dirty.summary.size = descriptors_size / 64;
+  region->checksums.checksums = bitmaps + descriptors_size + summary_size;
+  region->checksums.size = size_pages;
+
+  size_t sizes[INDEX_LEVELS];
+  (void)index_size(size_pages, sizes);
+  uintptr_t bits = region->checksums.checksums + checksums_size(size_pages);
+  size_t size = limit;
+  for (size_t level = 0; level < INDEX_LEVELS; level++) {
+    size = (size + 63) / 64;
+    region->used[level].bits = bits;
+    region->used[level].size = size;
+    bits += sizes[level];
+  }
+}
+
+struct region *region_init(void *address, size_t size)
+{
+  // region must be page aligned
+  if (((uintptr_t)address & PAGE_MASK) != (uintptr_t)address)
+    return NULL;
+
+  size_t pages = ((sizeof(struct region) + PAGE_SIZE) / PAGE_SIZE) * PAGE_SIZE;
+  size_t caches = ALLOC_CACHE_COUNT;
+  size_t size_pages = size / PAGE_SIZE;
+
+  // size must be a multiple of page size and sufficiently large enough
+  if ((size & PAGE_MASK) != size || size < pages || size_pages <= caches)
+    return NULL;
+
+  struct region *region = address;
+  memset(region, 0, sizeof(*region));
+
+  size_t descriptors_size, summary_size;
+  size_t total_size = layout_size(size_pages, &descriptors_size, &summary_size);
+  // space available for bitmaps is the space in the first page(s) that is
+  // not required for region administration
+  size_t unused_space = pages - sizeof(struct region);
+  size_t limit = size_pages;
+  uintptr_t bitmaps;
+  if (total_size <= unused_space) {
+    bitmaps = pages - total_size;
+  } else {
+    // a sensible number of pages must be available for data
+    size_t bitmap_pages = (total_size + (PAGE_SIZE - 1)) / PAGE_SIZE;
+    if ((pages / PAGE_SIZE) + bitmap_pages + caches >= size_pages)
+      return NULL;
+    // pages reserved for bitmaps are not tracked, i.e. are never allocated
+    limit = size_pages - bitmap_pages;
+    bitmaps = limit * PAGE_SIZE;
+  }
+
+  memset(swizzle(region, bitmaps), 0, total_size);
+  place_bitmaps(region, bitmaps, size_pages, limit);
+
+  region->magic = REGION_MAGIC;
+  region->version = REGION_VERSION;
+  region->page_size = (uint32_t)PAGE_SIZE;
+  region->size = size;
+  region->mapping.fd = -1;
+  region->caches.count = 0;
+  region->pages = pages;
+  region->heap.free_page = limit * PAGE_SIZE;
+  region->dirty.epoch = 1;
+
+  // initialize small object caches
+  for (size_t index=0; index < caches; index++) {
+    const struct alloc_cache *cache = &alloc_caches[index];
+    const intptr_t id = cache_init(region, cache->name, cache->size, cache->align, false);
+    assert(id == (intptr_t)index);
+    (void)id;
+  }
+
+  return region;
+}
+
+nonnull_all
+static bool is_offset(const region_t *region, uintptr_t offset, size_t align)
+{
+  return offset >= region->pages &&
+         offset < region_limit(region) &&
+         (offset & (align - 1)) == 0;
+}
+
+// caches are derived from object size and alignment, the number of caches
+// and the lists of slabs are validated, slabs themselves are not
+nonnull_all
+static bool is_valid_cache(const region_t *region, size_t id)
+{
+  const struct cache *cache = &region->caches.cache[id];
+  const size_t align = cache->alignment;
+  if (!cache->object_size || !align || (align & (align - 1)) || (align & 7) ||
+      align > PAGE_SIZE)
+    return false;
+  const size_t link = (cache->object_size + 7) & ~(size_t)7;
+  if (cache->link && cache->link != link)
+    return false;
+  const size_t size = cache->link ? link + sizeof(uintptr_t) : cache->object_size;
+  if (cache->aligned_size != aligned_size(size, align) ||
+      cache->slab_pages != slab_pages(cache->aligned_size) ||
+      !cache->slab_pages ||
+      cache->object_count != slab_objects(cache->slab_pages, cache->aligned_size))
+    return false;
+  const size_t used = sizeof(struct slab) + ((cache->object_count + 63) / 64) * 8 +
+                      cache->object_count * cache->aligned_size;
+  if (cache->max_color != cache->slab_pages * PAGE_SIZE - used ||
+      cache->color > cache->max_color ||
+      cache->reciprocal != ((1llu << 32) + cache->aligned_size - 1) / cache->aligned_size)
+    return false;
+
+  const struct slab_list *lists[] =
+    { &cache->full_slabs, &cache->partial_slabs, &cache->free_slabs };
+  for (size_t index = 0; index < sizeof(lists) / sizeof(lists[0]); index++) {
+    const uintptr_t slab = lists[index]->list;
+    if (!slab != !lists[index]->count)
+      return false;
+    if (slab && (!is_offset(region, slab, PAGE_SIZE) ||
+                  (*page_descriptor(region, slab / PAGE_SIZE) & ~PAGE_DIRTY) !=
+                    ((id << PAGE_CACHE_SHIFT) | PAGE_SLAB)))
+      return false;
+  }
+
+  // slab that is being loaded is sealed later on, objects must be in range
+  const uintptr_t slab_offset = cache->load.slab;
+  if (!slab_offset)
+    return !cache->load.next && !cache->load.end;
+  if (!is_offset(region, slab_offset, PAGE_SIZE) ||
+      (*page_descriptor(region, slab_offset / PAGE_SIZE) & ~PAGE_DIRTY) !=
+        ((id << PAGE_CACHE_SHIFT) | PAGE_SLAB))
+    return false;
+  const struct slab *slab = swizzle(region, slab_offset);
+  const size_t objects_size = cache->object_count * cache->aligned_size;
+  return !slab->list &&
+         slab->cache == (uintptr_t)((const uint8_t *)cache - (const uint8_t *)region) &&
+         slab->objects >= slab_offset + (used - objects_size) &&
+         slab->objects + objects_size <= slab_offset + cache->slab_pages * PAGE_SIZE &&
+         cache->load.end == slab->objects + objects_size &&
+         cache->load.next >= slab->objects &&
+         cache->load.next <= cache->load.end &&
+         (cache->load.next - slab->objects) % cache->aligned_size == 0;
+}
+
+nonnull_all
+static bool is_valid_heap(const region_t *region)
+{
+  const uintptr_t free_page = region->heap.free_page;
+  if (free_page < region->pages || free_page > region_limit(region) ||
+      (free_page & PAGE_MASK) != free_page)
+    return false;
+  for (size_t index = 0; index < HEAP_CLASSES; index++) {
+    const uintptr_t block = region->heap.free[index];
+    if (!block != !(region->heap.classes & (1llu << index)))
+      return false;
+    if (block && (!is_offset(region, block, 8) ||
+                  !is_heap_page(region, block / PAGE_SIZE)))
+      return false;
+  }
+  return true;
+}
+
+// only data pages are in use and slabs consist of a first page followed by
+// the remaining pages of the slab, all belonging to an existing cache
+nonnull_all
+static bool is_valid_descriptors(const region_t *region)
+{
+  const uint8_t *descriptors = swizzle(region, (intptr_t)region->descriptors.entries);
+  const size_t first = region->pages / PAGE_SIZE;
+  const size_t limit = region->descriptors.limit;
+  size_t cache = 0, pages = 0;
+
+  for (size_t bit = 0; bit < region->descriptors.size; bit++) {
+    const uint8_t type = descriptors[bit] & PAGE_TYPE;
+    if (type == PAGE_SLAB_TAIL) {
+      if (!pages-- || PAGE_CACHE(descriptors[bit]) != cache)
+        return false;
+      continue;
+    }
+    if (pages)
+      return false;
+    if (type == PAGE_FREE)
+      continue;
+    if (bit < first || bit >= limit)
+      return false;
+    if (type == PAGE_SLAB) {
+      cache = PAGE_CACHE(descriptors[bit]);
+      if (cache >= region->caches.count)
+        return false;
+      pages = region->caches.cache[cache].slab_pages - 1;
+    }
+  }
+
+  // padding is read along with the last descriptors
+  const size_t padded = ((region->descriptors.size + 63) / 64) * 64;
+  for (size_t bit = region->descriptors.size; bit < padded; bit++)
+    if (descriptors[bit])
+      return false;
+  return pages == 0;
+}
+
+static uint64_t administration_checksum(const region_t *region);
+
+region_t *region_open(void *address, size_t size)
+{
+  // region must be page aligned
+  if (((uintptr_t)address & PAGE_MASK) != (uintptr_t)address)
+    return NULL;
+
+  const size_t pages = ((sizeof(struct region) + PAGE_SIZE) / PAGE_SIZE) * PAGE_SIZE;
+  if (size < pages)
+    return NULL;
+
+  struct region *region = address;
+  if (region->magic != REGION_MAGIC ||
+      region->version != REGION_VERSION ||
+      region->page_size != PAGE_SIZE)
+    return NULL;
+  if (region->pages != pages ||
+      region->size > size ||
+      (region->size & PAGE_MASK) != region->size)
+    return NULL;
+
+  // layout is fully determined by the size and the first page reserved
+  // for bitmaps, offsets must match
+  const size_t size_pages = region->size / PAGE_SIZE;
+  const size_t limit = region->descriptors.limit;
+  if (size_pages <= ALLOC_CACHE_COUNT || limit > size_pages ||
+      limit * PAGE_SIZE <= pages)
+    return NULL;
+
+  size_t descriptors_size, summary_size;
+  const size_t total_size = layout_size(size_pages, &descriptors_size, &summary_size);
+  uintptr_t bitmaps;
+  if (limit == size_pages) {
+    if (total_size > pages - sizeof(struct region))
+      return NULL;
+    bitmaps = pages - total_size;
+  } else {
+    if (total_size > (size_pages - limit) * PAGE_SIZE)
+      return NULL;
+    bitmaps = limit * PAGE_SIZE;
+  }
+
+  struct region layout;
+  place_bitmaps(&layout, bitmaps, size_pages, limit);
+  if (memcmp(&layout.descriptors, &region->descriptors, sizeof(layout.descriptors)) ||
+      memcmp(&layout.dirty.summary, &region->dirty.summary, sizeof(layout.dirty.summary)) ||
+      memcmp(&layout.checksums, &region->checksums,
+             offsetof(struct region, checksums.administration) -
+             offsetof(struct region, checksums)))
+    return NULL;
+  // lists are not followed before the administration is known to be
+  // intact. regions updated in place since the last commit are not verified
+  if (region->checksums.administration &&
+      region->checksums.administration != administration_checksum(region))
+    return NULL;
+
+  const size_t count = region->caches.count;
+  if (count < ALLOC_CACHE_COUNT || count > REGION_CACHES)
+    return NULL;
+  for (size_t index = 0; index < ALLOC_CACHE_COUNT; index++)
+    if (region->caches.cache[index].object_size != alloc_caches[index].size)
+      return NULL;
+  for (size_t index = 0; index < count; index++)
+    if (!is_valid_cache(region, index))
+      return NULL;
+  if (!is_valid_heap(region) || !is_valid_descriptors(region))
+    return NULL;
+
+  // mapping information is process local, the index is not persisted
+  memset(&region->mapping, 0, sizeof(region->mapping));
+  region->mapping.fd = -1;
+  memcpy(region->used, layout.used, sizeof(region->used));
+  index_pages(region);
+  region->dirty.released = count_released(region);
+  return region;
+}
+
+// determine the first page reserved for bitmaps if the region is resized.
+// bitmaps are stored in the first page(s) while sufficient space is
+// available, pages are reserved from the tail otherwise. pages reserved by
+// the current layout can be reused, allocated pages cannot. returns 0 if
+// the region cannot be resized to the given number of pages
+nonnull_all
+static size_t resize_limit(
+  const region_t *region, size_t size_pages, size_t *total_size)
+{
+  size_t descriptors_size, summary_size;
+  *total_size = layout_size(size_pages, &descriptors_size, &summary_size);
+  if (*total_size <= region->pages - sizeof(struct region))
+    return size_pages;
+  const size_t bitmap_pages = (*total_size + (PAGE_SIZE - 1)) / PAGE_SIZE;
+  if (size_pages - region->descriptors.limit < bitmap_pages)
+    return 0;
+  return size_pages - bitmap_pages;
+}
+
+size_t region_resize_size(const region_t *region, size_t size)
+{
+  assert(region);
+
+  size = (size + (PAGE_SIZE - 1)) & PAGE_MASK;
+  if (size <= region->size)
+    return region->size;
+
+  size_t total_size;
+  while (!resize_limit(region, size / PAGE_SIZE, &total_size))
+    size += PAGE_SIZE;
+  return size;
+}
+
+int region_resize(region_t *region, size_t size)
+{
+  assert(region);
+
+  if ((size & PAGE_MASK) != size || size < region->size)
+    return -1;
+  if (size == region->size)
+    return 0;
+
+  const uintptr_t pages = region->pages;
+  const size_t size_pages = size / PAGE_SIZE;
+  const size_t old_size_pages = region->size / PAGE_SIZE;
+  size_t descriptors_size, summary_size, old_descriptors_size, old_summary_size;
+  size_t total_size;
+  const size_t limit = resize_limit(region, size_pages, &total_size);
+  if (!limit)
+    return -1;
+  (void)bitmaps_size(size_pages, &descriptors_size, &summary_size);
+  (void)bitmaps_size(old_size_pages, &old_descriptors_size, &old_summary_size);
+
+  // descriptors and bitmaps are stored consecutively, descriptors, dirty
+  // summary, checksums and the index. the index is rebuilt rather than
+  // moved
+  size_t old_sizes[3 + INDEX_LEVELS] = {
+    old_descriptors_size, old_summary_size, checksums_size(old_size_pages) };
+  size_t sizes[3 + INDEX_LEVELS] = {
+    descriptors_size, summary_size, checksums_size(size_pages) };
+  (void)index_size(size_pages, &sizes[3]);
+  const size_t count = sizeof(sizes) / sizeof(sizes[0]);
+  uintptr_t old_bitmaps = region->descriptors.entries;
+  uintptr_t bitmaps;
+
+  if (limit == size_pages) {
+    // bitmaps grow towards the region administration. as each bitmap moves
+    // down by at least the number of bytes the preceding bitmaps grew, move
+    // bitmaps in order and clear the newly required space in between
+    bitmaps = pages - total_size;
+    assert(bitmaps <= old_bitmaps);
+    for (size_t index = 0; index < count; index++) {
+      uint8_t *to = swizzle(region, bitmaps);
+      memmove(to, swizzle(region, old_bitmaps), old_sizes[index]);
+      memset(to + old_sizes[index], 0, sizes[index] - old_sizes[index]);
+      bitmaps += sizes[index];
+      old_bitmaps += old_sizes[index];
+    }
+    bitmaps = pages - total_size;
+  } else {
+    // pages for bitmaps are reserved from the tail, pages reserved for
+    // bitmaps before that are not reused are released. bitmaps move up by
+    // at least the number of bytes the preceding bitmaps grew, move bitmaps
+    // in reverse order
+    bitmaps = limit * PAGE_SIZE;
+    assert(bitmaps >= old_bitmaps || old_bitmaps < pages);
+    uintptr_t to = bitmaps + total_size;
+    old_bitmaps += old_sizes[0] + old_sizes[1] + old_sizes[2];
+    for (size_t index = count; index > 0; index--) {
+      to -= sizes[index - 1];
+      old_bitmaps -= old_sizes[index - 1];
+      uint8_t *ptr = swizzle(region, to);
+      memmove(ptr, swizzle(region, old_bitmaps), old_sizes[index - 1]);
+      memset(ptr + old_sizes[index - 1], 0, sizes[index - 1] - old_sizes[index - 1]);
+    }
+    assert(to == bitmaps);
+  }
+
+  place_bitmaps(region, bitmaps, size_pages, limit);
+  region->size = size;
+  // pages that are added (or released) are free
+  region->heap.free_page = limit * PAGE_SIZE;
+  index_pages(region);
+
+  // bitmaps were copied without tracking
+  if (bitmaps >= pages)
+    mark_pages(region, bitmaps, total_size);
+  region->dirty.released = count_released(region);
+
+  return 0;
+}
+
+// find highest run of count free pages that ends at or before page. free
+// pages are located using the index, the run is then extended downwards a
+// word at a time
+nonnull_all
+static uintptr_t find_free_pages(
+  const region_t *region, uintptr_t page, size_t count)
+{
+  assert((page & PAGE_MASK) == page);
+  assert(count);
+
+  size_t bit = page / PAGE_SIZE;
+
+  while ((bit = prev_free_page(region, bit))) {
+    size_t low = bit;
+    for (;;) {
+      // pages reserved for administration are reported as in use
+      assert(low);
+      const size_t valid = ((low - 1) & 63) + 1;
+      const uint64_t word = index_word(region, 0, (low - 1) / 64) << (64 - valid);
+      const size_t free = word ? (size_t)__builtin_clzll(word) : 64;
+      low -= free < valid ? free : valid;
+      if (bit + 1 - low >= count)
+        return (bit + 1 - count) * PAGE_SIZE;
+      if (free < valid)
+        break;
+    }
+    bit = low;
+  }
+
+  return 0;
+}
+
+// find lowest run of count free pages. slabs are packed towards the start
+// of the region so that huge pages fill up before others are touched.
+// snapshots reuse pages released in the snapshot first
+nonnull_all
+static uintptr_t allocate_pages(struct region *region, size_t count)
+{
+  uintptr_t page;
+  if (unlikely(in_transaction(region)) &&
+      region->dirty.released >= count &&
+      (page = find_released_pages(region, count)))
+    return page;
+
+  // check if a free (lowest to highest) page is available. pages may be
+  // released in any order, the index is consulted to find the lowest
+  const size_t limit = region->descriptors.limit;
+  size_t bit = region->pages / PAGE_SIZE;
+
+  while ((bit = next_free_page(region, bit))) {
+    size_t last = bit + 1;
+    while (last - bit < count && last < limit && is_free_page(region, last * PAGE_SIZE))
+      last++;
+    if (last - bit == count)
+      return bit * PAGE_SIZE;
+    if (last == limit)
+      break;
+    bit = last;
+  }
+
+  return 0;
+}
+
+nonnull_all
+static always_inline void push_slab(
+  region_t *region, struct slab_list *list, uintptr_t slab_offset)
+{
+  struct slab *slab = swizzle(region, slab_offset);
+  mark_page(region, slab_offset);
+  slab->list = unswizzle(region, list);
+  slab->prev = 0;
+  slab->next = list->list;
+  if (list->list) {
+    struct slab *next = swizzle(region, list->list);
+    next->prev = slab_offset;
+    mark_page(region, list->list);
+  }
+  list->list = slab_offset;
+  STAT_ADD(list->count, 1);
+}
+
+nonnull_all
+static always_inline void remove_slab(region_t *region, uintptr_t slab_offset)
+{
+  struct slab *slab = swizzle(region, slab_offset);
+  struct slab_list *list = swizzle(region, slab->list);
+  if (slab->prev) {
+    struct slab *prev = swizzle(region, slab->prev);
+    prev->next = slab->next;
+    mark_page(region, slab->prev);
+  } else {
+    assert(list->list == slab_offset);
+    list->list = slab->next;
+  }
+  if (slab->next) {
+    struct slab *next = swizzle(region, slab->next);
+    next->prev = slab->prev;
+    mark_page(region, slab->next);
+  }
+  assert(list->count);
+  STAT_SUB(list->count, 1);
+  assert(!list->count == !list->list);
+}
+
+nonnull_all
+static always_inline void move_slab(
+  region_t *region, struct slab_list *list, uintptr_t slab_offset)
+{
+  remove_slab(region, slab_offset);
+  push_slab(region, list, slab_offset);
+}
+
+// constructor and destructor registered for cache, if any. callbacks are
+// registered with the region snapshots are taken of
+nonnull_all
+static const struct region_ctor *cache_ctor(
+  const region_t *region, const struct cache *cache)
+{
+  const struct mapping *mapping = &region->mapping;
+  if (mapping->origin)
+    mapping = &mapping->origin->mapping;
+  if (!mapping->ctors)
+    return NULL;
+  return &mapping->ctors[cache - region->caches.cache];
+}
+
+// construct objects in a slab that was created. objects are constructed
+// once, the constructed state is retained while objects are free
+nonnull_all
+static never_inline void construct_slab(
+  region_t *region, const struct cache *cache, const struct slab *slab)
+{
+  const struct region_ctor *ctor = cache_ctor(region, cache);
+  if (!ctor || !ctor->ctor)
+    return;
+  for (size_t index = 0; index < cache->object_count; index++)
+    ctor->ctor(region, (intptr_t)(slab->objects + index * cache->aligned_size), ctor->arg);
+}
+
+// destroy objects in a slab that is returned to the region, all objects
+// are free and therefore in their constructed state
+nonnull_all
+static never_inline void destruct_slab(
+  region_t *region, const struct cache *cache, const struct slab *slab)
+{
+  const struct region_ctor *ctor = cache_ctor(region, cache);
+  if (!ctor || !ctor->dtor)
+    return;
+  for (size_t index = 0; index < cache->object_count; index++)
+    ctor->dtor(region, (intptr_t)(slab->objects + index * cache->aligned_size), ctor->arg);
+}
+
+// allocate pages for a slab and initialize the header, the first size
+// bytes of the slab (which must cover the header) are cleared
+nonnull((1,2))
+static uintptr_t new_slab(region_t *region, struct cache *cache, size_t size)
+{
+  const size_t slab_size = cache->slab_pages * PAGE_SIZE;
+  uintptr_t slab_offset;
+  if (!(slab_offset = allocate_pages(region, cache->slab_pages)))
+    return 0;
+
+  const size_t bit = slab_offset / PAGE_SIZE;
+  const size_t id = (size_t)(cache - region->caches.cache);
+  const uint8_t descriptor = (uint8_t)(id << PAGE_CACHE_SHIFT);
+  use_page(region, bit, descriptor | PAGE_SLAB);
+  for (size_t index = 1; index < cache->slab_pages; index++)
+    use_page(region, bit + index, descriptor | PAGE_SLAB_TAIL);
+  mark_pages(region, slab_offset, slab_size);
+
+  struct slab *slab = swizzle(region, slab_offset);
+  assert(size >= sizeof(struct slab) && size <= slab_size);
+  memset((uint8_t *)slab + sizeof(uintptr_t), 0, size - sizeof(uintptr_t));
+
+  // slab, move objects towards the header by color, colors are a multiple
+  // of a cache line (and the alignment)
+  slab->cache = unswizzle(region, cache);
+  slab->color = cache->color;
+  // slab may have been released in the snapshot and still be referenced
+  // from the list of updated slabs, never link it in twice
+  if (in_transaction(region))
+    slab->epoch = region->dirty.epoch;
+  slab->objects = slab_offset + (slab_size - (cache->object_count * cache->aligned_size)) - slab->color;
+  const size_t step = cache->alignment > CACHE_LINE ? cache->alignment : CACHE_LINE;
+  cache->color += step;
+  if (cache->color > cache->max_color)
+    cache->color = 0;
+  STAT_ADD(cache->stats.slabs_created, 1);
+  return slab_offset;
+}
+
+nonnull((1,2))
+static uintptr_t allocate_slab(region_t *region, struct cache *cache)
+{
+  const uintptr_t slab_offset =
+    new_slab(region, cache, cache->slab_pages * PAGE_SIZE);
+  if (!slab_offset)
+    return 0;
+
+  struct slab *slab = swizzle(region, slab_offset);
+  slab->free_objects.list = slab->objects;
+  slab->free_objects.count = cache->object_count;
+
+  // objects
+  uintptr_t object = slab->objects + (cache->object_count * cache->aligned_size);
+  uintptr_t next_object = 0u;
+  while (object > slab->objects) {
+    object -= cache->aligned_size;
+    memcpy(swizzle(region, object + cache->link), &next_object, sizeof(object));
+    next_object = object;
+  }
+
+  assert(object == slab->objects);
+  if (unlikely(cache->link))
+    construct_slab(region, cache, slab);
+
+  // cache
+  push_slab(region, &cache->free_slabs, slab_offset);
+  return slab_offset;
+}
+
+// no partially allocated slabs, take a free slab (allocate one if there are
+// none) and make it partial. kept out of line so that the common case of
+// allocating from a partial slab can be inlined
+nonnull_all
+static never_inline uintptr_t refill_cache(region_t *region, struct cache *cache)
+{
+  if (unlikely(is_sealed(region)))
+    return 0;
+  if (!cache->free_slabs.list && !allocate_slab(region, cache))
+    return 0;
+  assert(cache->free_slabs.count && cache->free_slabs.list);
+  const uintptr_t slab_offset = cache->free_slabs.list;
+  move_slab(region, &cache->partial_slabs, slab_offset);
+  return slab_offset;
+}
+
+// offset of slab an object in a cache page belongs to. the first page of a
+// slab is flagged, the slab header is found within MAX_SLAB_PAGES - 1
+// descriptors (one cache line) otherwise
+nonnull_all
+static always_inline uintptr_t object_slab(
+  const region_t *region, uintptr_t object)
+{
+  const uint8_t *descriptors = swizzle(region, (intptr_t)region->descriptors.entries);
+  size_t bit = object / PAGE_SIZE;
+
+  assert(bit < region->descriptors.limit);
+  assert(descriptors[bit] & PAGE_SLAB);
+  while ((descriptors[bit] & PAGE_TYPE) == PAGE_SLAB_TAIL)
+    bit--;
+  assert((descriptors[bit] & PAGE_TYPE) == PAGE_SLAB);
+  assert(object / PAGE_SIZE - bit < MAX_SLAB_PAGES);
+  return bit * PAGE_SIZE;
+}
+
+// index of object in slab. offsets within a slab are small enough for
+// multiplication by the reciprocal to be exact
+nonnull_all
+static always_inline size_t object_index(
+  const struct cache *cache, const struct slab *slab, uintptr_t object)
+{
+  assert(object >= slab->objects);
+  const size_t index =
+    (size_t)(((object - slab->objects) * cache->reciprocal) >> 32);
+  assert(index == (object - slab->objects) / cache->aligned_size);
+  return index;
+}
+
+// objects released in a snapshot are scattered over slabs more often than
+// not, the head of the list of partial slabs is likely untouched. each
+// cache maintains a list of slabs objects were released to in the current
+// snapshot, linked through the slab headers (which are updated anyway) so
+// that no other slabs are touched. slabs are not unlinked as they are
+// moved or returned to the region, instead the list is cut short at the
+// first slab that is not (the first page of) a slab of the cache updated
+// in the current snapshot. slabs that are no longer partial are skipped
+nonnull_all
+static never_inline uintptr_t dirty_slab(
+  region_t *region, struct cache *cache, uintptr_t slab_offset)
+{
+  const size_t id = (size_t)(cache - region->caches.cache);
+  const uint8_t descriptor =
+    (uint8_t)((id << PAGE_CACHE_SHIFT) | PAGE_SLAB | PAGE_DIRTY);
+  const uintptr_t partial_slabs = unswizzle(region, &cache->partial_slabs);
+  uintptr_t offset = cache->dirty_slabs;
+
+  while (offset >= region->pages && offset < region_limit(region) &&
+         (offset & PAGE_MASK) == offset &&
+         *page_descriptor(region, offset / PAGE_SIZE) == descriptor)
+  {
+    struct slab *slab = swizzle(region, offset);
+    if (slab->epoch != region->dirty.epoch)
+      break;
+    if (slab->list == partial_slabs &&
+        (!slab->prev || is_dirty_page(region, slab->prev / PAGE_SIZE)) &&
+        (!slab->next || is_dirty_page(region, slab->next / PAGE_SIZE)))
+    {
+      cache->dirty_slabs = offset;
+      return offset;
+    }
+    offset = slab->next_dirty;
+    slab->epoch = 0;
+  }
+
+  cache->dirty_slabs = 0;
+  return slab_offset;
+}
+
+// take an object from the free list of a slab that is partial
+nonnull_all
+static always_inline intptr_t slab_alloc(
+  region_t *region, struct cache *cache, uintptr_t slab_offset)
+{
+  struct slab *slab = swizzle(region, slab_offset);
+  uintptr_t object_offset;
+
+  mark_page(region, slab_offset);
+  assert(slab->free_objects.count);
+  slab->free_objects.count--;
+  object_offset = slab->free_objects.list;
+  // slab and object reside in the same page for single page slabs
+  if (cache->slab_pages > 1)
+    mark_pages(region, object_offset, cache->object_size);
+  memcpy(&slab->free_objects.list,
+         swizzle(region, object_offset + cache->link), sizeof(uintptr_t));
+  const size_t bit = object_index(cache, slab, object_offset);
+  assert(!(slab->used[bit / 64] & (1llu << (bit & 63))));
+  slab->used[bit / 64] |= 1llu << (bit & 63);
+
+  // move to full slabs if depleted
+  if (!slab->free_objects.count)
+    move_slab(region, &cache->full_slabs, slab_offset);
+
+  STAT_ADD(cache->stats.allocs, 1);
+  return (intptr_t)object_offset;
+}
+
+// regions that are filled in one go (e.g. a zone transfer) see few
+// releases, if any. in load mode, objects are handed out in order from a
+// slab per cache by bumping a pointer, the slab is on none of the lists and
+// has no free list. the objects in use and the free list of objects that
+// are left are recorded once the slab is sealed, i.e. when it is depleted,
+// when an object is released to it or when the load is sealed. caches of
+// constructed objects are not loaded
+
+// make slab that is being loaded a regular slab
+nonnull_all
+static never_inline void seal_slab(region_t *region, struct cache *cache)
+{
+  const uintptr_t slab_offset = cache->load.slab;
+  struct slab *slab = swizzle(region, slab_offset);
+  assert(slab_offset && !slab->list);
+  assert(cache->load.end == slab->objects + cache->object_count * cache->aligned_size);
+  const size_t used = (cache->load.next - slab->objects) / cache->aligned_size;
+  assert(used <= cache->object_count);
+
+  // pages were marked updated as the slab was allocated, the bitmap was
+  // cleared
+  memset(slab->used, 0xff, (used / 64) * sizeof(uint64_t));
+  if (used & 63)
+    slab->used[used / 64] = (1llu << (used & 63)) - 1;
+
+  uintptr_t object = cache->load.end, next_object = 0;
+  while (object > cache->load.next) {
+    object -= cache->aligned_size;
+    memcpy(swizzle(region, object + cache->link), &next_object, sizeof(object));
+    next_object = object;
+  }
+  slab->free_objects.list = next_object;
+  slab->free_objects.count = cache->object_count - used;
+
+  struct slab_list *list = &cache->partial_slabs;
+  if (!slab->free_objects.count)
+    list = &cache->full_slabs;
+  else if (!used)
+    list = &cache->free_slabs;
+  push_slab(region, list, slab_offset);
+
+  STAT_STORE(cache->load.slab, 0);
+  cache->load.next = cache->load.end = 0;
+}
+
+// seal slab that is depleted and allocate a slab to load. only the header
+// is initialized, objects are not touched until they are handed out
+nonnull_all
+static never_inline uintptr_t load_slab(region_t *region, struct cache *cache)
+{
+  if (cache->load.slab)
+    seal_slab(region, cache);
+
+  const size_t header =
+    sizeof(struct slab) + ((cache->object_count + 63) / 64) * sizeof(uint64_t);
+  const uintptr_t slab_offset = new_slab(region, cache, header);
+  if (!slab_offset)
+    return 0;
+
+  const struct slab *slab = swizzle(region, slab_offset);
+  STAT_STORE(cache->load.slab, slab_offset);
+  cache->load.next = slab->objects;
+  cache->load.end = slab->objects + cache->object_count * cache->aligned_size;
+  return slab->objects;
+}
+
+nonnull_all
+static always_inline intptr_t load_alloc(region_t *region, struct cache *cache)
+{
+  uintptr_t object = cache->load.next;
+  if (unlikely(object == cache->load.end) && !(object = load_slab(region, cache)))
+    return 0;
+  cache->load.next = object + cache->aligned_size;
+  STAT_ADD(cache->stats.allocs, 1);
+  return (intptr_t)object;
+}
+
+nonnull((1))
+static always_inline intptr_t cache_alloc(region_t *region, size_t index)
+{
+  assert(region);
+  assert(index < region->caches.count);
+
+  struct cache *cache = &region->caches.cache[index];
+  uintptr_t slab_offset;
+
+  // partial slabs of sealed regions are read-only too
+  if (unlikely(is_sealed(region)))
+    return 0;
+  if (unlikely(region->caches.load) && likely(!cache->link))
+    return load_alloc(region, cache);
+
+  if (unlikely(!(slab_offset = cache->partial_slabs.list)) &&
+      !(slab_offset = refill_cache(region, cache)))
+    return 0;
+  if (unlikely(in_transaction(region)) &&
+      !is_dirty_page(region, slab_offset / PAGE_SIZE))
+    slab_offset = dirty_slab(region, cache, slab_offset);
+
+  return slab_alloc(region, cache, slab_offset);
+}
+
+// number of pages on either side of the page of the hint that are
+// considered for hinted allocations, the descriptors span two cache lines
+// at most
+#define NEAR_PAGES (MAX_SLAB_PAGES)
+
+// partial slab of cache that starts at page bit, 0 if there is none
+nonnull_all
+static always_inline uintptr_t partial_slab_at(
+  region_t *region, struct cache *cache, size_t bit)
+{
+  const size_t id = (size_t)(cache - region->caches.cache);
+  const uint8_t descriptor = (uint8_t)((id << PAGE_CACHE_SHIFT) | PAGE_SLAB);
+  if ((*page_descriptor(region, bit) & ~PAGE_DIRTY) != descriptor)
+    return 0;
+  const struct slab *slab = swizzle(region, bit * PAGE_SIZE);
+  if (slab->list != (uintptr_t)unswizzle(region, &cache->partial_slabs))
+    return 0;
+  assert(slab->free_objects.count);
+  return bit * PAGE_SIZE;
+}
+
+// allocate from the slab the hint belongs to, or the nearest slab within
+// NEAR_PAGES pages of the hint, if that slab is partial. slabs that are
+// free are not taken from the list of free slabs so that these can be
+// returned to the region. allocates as usual otherwise
+nonnull((1))
+static intptr_t cache_alloc_near(region_t *region, size_t index, intptr_t hint)
+{
+  assert(index < region->caches.count);
+
+  struct cache *cache = &region->caches.cache[index];
+  const uint8_t *descriptors = swizzle(region, (intptr_t)region->descriptors.entries);
+  const size_t first = region->pages / PAGE_SIZE;
+  const size_t limit = region->descriptors.limit;
+  const size_t bit = (uintptr_t)hint / PAGE_SIZE;
+  uintptr_t slab_offset = 0;
+
+  // objects are loaded in order, i.e. close to the previous object
+  if (hint <= 0 || bit < first || bit >= limit || region->caches.load ||
+      is_sealed(region))
+    return cache_alloc(region, index);
+
+  // hint may reside in any page of a slab
+  if ((descriptors[bit] & PAGE_SLAB) && PAGE_CACHE(descriptors[bit]) == index)
+    slab_offset =
+      partial_slab_at(region, cache, object_slab(region, (uintptr_t)hint) / PAGE_SIZE);
+
+  for (size_t distance = 1; !slab_offset && distance <= NEAR_PAGES; distance++) {
+    if (bit - first >= distance)
+      slab_offset = partial_slab_at(region, cache, bit - distance);
+    if (!slab_offset && bit + distance < limit)
+      slab_offset = partial_slab_at(region, cache, bit + distance);
+  }
+
+  if (!slab_offset)
+    return cache_alloc(region, index);
+  return slab_alloc(region, cache, slab_offset);
+}
+
+// return slab to the region and release the memory backing it
+nonnull_all
+static never_inline void free_slab(region_t *region, uintptr_t slab_offset)
+{
+  const struct slab *slab = swizzle(region, slab_offset);
+  struct cache *cache = swizzle(region, slab->cache);
+  const size_t bit = slab_offset / PAGE_SIZE, count = cache->slab_pages;
+
+  remove_slab(region, slab_offset);
+  STAT_ADD(cache->stats.slabs_released, 1);
+  if (unlikely(cache->link))
+    destruct_slab(region, cache, slab);
+  for (size_t index = 0; index < count; index++)
+    release_page(region, bit + index);
+  // snapshots retain private copies for reuse, released pages are
+  // discarded from the region on commit
+  if (!in_transaction(region))
+    region_discard(region, slab_offset, count * PAGE_SIZE);
+}
+
+// return object to the free list of the slab it belongs to, lists are not
+// updated. returns false if the object is not in use
+nonnull_all
+static always_inline bool release_object(
+  region_t *region, struct cache *cache, struct slab *slab, intptr_t object)
+{
+  const size_t uintptr_size = sizeof(object);
+
+  // object must be the start of an object in use
+  if (REGION_CHECK_FREE && unlikely((uintptr_t)object < slab->objects)) {
+    assert(!"object precedes objects in slab");
+    return false;
+  }
+
+  const size_t bit = object_index(cache, slab, (uintptr_t)object);
+  const uint64_t mask = 1llu << (bit & 63);
+
+  if (REGION_CHECK_FREE) {
+    const uintptr_t start = slab->objects + bit * cache->aligned_size;
+    if (unlikely(start != (uintptr_t)object)) {
+      assert(!"object is not the start of an object");
+      return false;
+    }
+    if (unlikely(!(slab->used[bit / 64] & mask))) {
+      assert(!"object is not in use (double free)");
+      return false;
+    }
+  }
+
+  assert(slab->used[bit / 64] & mask);
+  mark_page(region, (uintptr_t)object + cache->link);
+  slab->used[bit / 64] &= ~mask;
+  memcpy(swizzle(region, object + cache->link), &slab->free_objects.list, uintptr_size);
+  slab->free_objects.list = object;
+  slab->free_objects.count++;
+  STAT_ADD(cache->stats.frees, 1);
+  return true;
+}
+
+// move slab to the list that matches the number of free objects after
+// objects were released
+nonnull_all
+static always_inline void release_slab(
+  region_t *region, struct cache *cache, uintptr_t slab_offset, size_t free_count)
+{
+  struct slab *slab = swizzle(region, slab_offset);
+
+  if (slab->free_objects.count == free_count)
+    return;
+  if (slab->free_objects.count == cache->object_count) {
+    if (cache->free_slabs.count < cache->retain)
+      move_slab(region, &cache->free_slabs, slab_offset);
+    else
+      free_slab(region, slab_offset);
+    return;
+  }
+  if (free_count == 0)
+    move_slab(region, &cache->partial_slabs, slab_offset);
+  // slab header is updated, link slab in with updated slabs (see dirty_slab)
+  if (unlikely(in_transaction(region)) && slab->epoch != region->dirty.epoch) {
+    slab->epoch = region->dirty.epoch;
+    slab->next_dirty = cache->dirty_slabs;
+    cache->dirty_slabs = slab_offset;
+  }
+}
+
+nonnull((1))
+static always_inline void
+cache_free(region_t *region, size_t index, intptr_t object)
+{
+  assert(region);
+  assert(index < region->caches.count);
+
+  const uintptr_t slab_offset = object_slab(region, (uintptr_t)object);
+  struct slab *slab = swizzle(region, slab_offset);
+  struct cache *cache = &region->caches.cache[index];
+  assert((uintptr_t)swizzle(region, slab->cache) == (uintptr_t)cache);
+
+  // slabs that are being loaded are on no list
+  if (unlikely(!slab->list)) {
+    assert(cache->load.slab == slab_offset);
+    seal_slab(region, cache);
+  }
+  const size_t free_count = slab->free_objects.count;
+  mark_page(region, slab_offset);
+  if (release_object(region, cache, slab, object))
+    release_slab(region, cache, slab_offset, free_count);
+}
+
+// take up to count objects from the free lists of partial slabs, each slab
+// is moved at most once
+nonnull_all
+static size_t cache_alloc_bulk(
+  region_t *region, size_t index, size_t count, intptr_t *objects)
+{
+  assert(index < region->caches.count);
+
+  struct cache *cache = &region->caches.cache[index];
+  size_t done = 0;
+
+  if (unlikely(is_sealed(region)))
+    return 0;
+  if (unlikely(region->caches.load) && !cache->link) {
+    for (; done < count; done++)
+      if (!(objects[done] = load_alloc(region, cache)))
+        break;
+    return done;
+  }
+
+  while (done < count) {
+    uintptr_t slab_offset;
+    if (!(slab_offset = cache->partial_slabs.list) &&
+        !(slab_offset = refill_cache(region, cache)))
+      break;
+    if (in_transaction(region) && !is_dirty_page(region, slab_offset / PAGE_SIZE))
+      slab_offset = dirty_slab(region, cache, slab_offset);
+
+    struct slab *slab = swizzle(region, slab_offset);
+    mark_page(region, slab_offset);
+    size_t take = slab->free_objects.count;
+    if (take > count - done)
+      take = count - done;
+    assert(take);
+
+    uintptr_t object = slab->free_objects.list;
+    for (size_t round = 0; round < take; round++) {
+      const size_t bit = object_index(cache, slab, object);
+      assert(!(slab->used[bit / 64] & (1llu << (bit & 63))));
+      slab->used[bit / 64] |= 1llu << (bit & 63);
+      if (cache->slab_pages > 1)
+        mark_pages(region, object, cache->object_size);
+      objects[done++] = (intptr_t)object;
+      memcpy(&object, swizzle(region, (intptr_t)(object + cache->link)), sizeof(object));
+    }
+
+    slab->free_objects.list = object;
+    slab->free_objects.count -= take;
+    STAT_ADD(cache->stats.allocs, take);
+    if (!slab->free_objects.count)
+      move_slab(region, &cache->full_slabs, slab_offset);
+  }
+
+  return done;
+}
+
+nonnull((1))
+static always_inline bool is_heap_object(
+  const region_t *region, intptr_t object)
+{
+  return is_heap_page(region, (uintptr_t)object / PAGE_SIZE);
+}
+
+// first page or other page of a slab
+nonnull((1))
+static always_inline bool is_cache_object(
+  const region_t *region, intptr_t object)
+{
+  return (*page_descriptor(region, (uintptr_t)object / PAGE_SIZE) & PAGE_SLAB) != 0;
+}
+
+nonnull((1))
+bool is_object(const region_t *region, intptr_t object)
+{
+  assert(region);
+  if (object <= (intptr_t)region->pages || object >= (intptr_t)region_limit(region))
+    return false;
+  // objects are aligned to 8 bytes
+  if (object & 0x7u)
+    return false;
+  // object page must be allocated to cache or heap
+  if (!is_cache_object(region, object) && !is_heap_object(region, object))
+    return false;
+  return true;
+}
+
+nonnull((1))
+static always_inline intptr_t object_cache(
+  const region_t *region, intptr_t object)
+{
+  assert(is_cache_object(region, object));
+  return (intptr_t)PAGE_CACHE(*page_descriptor(region, (uintptr_t)object / PAGE_SIZE));
+}
+
+// non-caching allocation routines use object caches internally for object
+// sizes ranging from 8 bytes to 256 bytes in roughly 10-20% increments. a
+// best-fit heap allocator is used for large objects.
+
+static always_inline bool is_small_object_size(size_t size)
+{
+  return size <= 256;
+}
+
+// floor(log2(size)), i.e. the size class a free block is listed in
+static always_inline size_t heap_class(uint64_t size)
+{
+  assert(size);
+  return 63 - (size_t)__builtin_clzll(size);
+}
+
+nonnull_all
+static always_inline uint64_t *block_footer(
+  region_t *region, uintptr_t block, uint64_t size)
+{
+  return swizzle(region, block + size - sizeof(uint64_t));
+}
+
+nonnull_all
+static void insert_block(region_t *region, uintptr_t offset, uint64_t size)
+{
+  struct large_object *block = swizzle(region, offset);
+  const size_t index = heap_class(size);
+
+  mark_page(region, offset);
+  block->prev = 0;
+  block->next = region->heap.free[index];
+  if (block->next) {
+    struct large_object *next = swizzle(region, block->next);
+    next->prev = offset;
+    mark_page(region, block->next);
+  }
+  region->heap.free[index] = offset;
+  STAT_STORE(region->heap.classes, region->heap.classes | (1llu << index));
+  STAT_ADD(region->heap.stats.free, size);
+  STAT_ADD(region->heap.stats.free_blocks, 1);
+}
+
+nonnull_all
+static void remove_block(region_t *region, uintptr_t offset, uint64_t size)
+{
+  struct large_object *block = swizzle(region, offset);
+  const size_t index = heap_class(size);
+
+  if (block->prev) {
+    struct large_object *prev = swizzle(region, block->prev);
+    prev->next = block->next;
+    mark_page(region, block->prev);
+  } else {
+    assert(region->heap.free[index] == offset);
+    region->heap.free[index] = block->next;
+    if (!block->next)
+      STAT_STORE(region->heap.classes, region->heap.classes & ~(1llu << index));
+  }
+  if (block->next) {
+    struct large_object *next = swizzle(region, block->next);
+    next->prev = block->prev;
+    mark_page(region, block->next);
+  }
+  STAT_SUB(region->heap.stats.free, size);
+  STAT_SUB(region->heap.stats.free_blocks, 1);
+}
+
+// release a block and coalesce it with the blocks preceding and following it
+// if those are free. returns the offset of the (coalesced) free block
+nonnull_all
+static uintptr_t release_block(region_t *region, uintptr_t offset)
+{
+  struct large_object *block = swizzle(region, offset);
+  uint64_t size = block->tag & ~TAG_FLAGS;
+
+  assert(block->tag & IN_USE);
+
+  if (!(block->tag & PREV_IN_USE)) {
+    const uint64_t prev_size = *(uint64_t *)swizzle(region, offset - sizeof(uint64_t));
+    offset -= prev_size;
+    size += prev_size;
+    remove_block(region, offset, prev_size);
+    block = swizzle(region, offset);
+    assert(!(block->tag & IN_USE) && (block->tag & PREV_IN_USE));
+  }
+
+  struct large_object *next = swizzle(region, offset + size);
+  if (!(next->tag & IN_USE)) {
+    const uint64_t next_size = next->tag & ~TAG_FLAGS;
+    remove_block(region, offset + size, next_size);
+    size += next_size;
+    next = swizzle(region, offset + size);
+  }
+
+  // blocks are coalesced, i.e. the next block is always in use
+  assert(next->tag & IN_USE);
+  next->tag &= ~PREV_IN_USE;
+  mark_page(region, offset + size);
+  // the preceding block is always in use too
+  block->tag = size | PREV_IN_USE;
+  *block_footer(region, offset, size) = size;
+  mark_page(region, offset);
+  mark_page(region, offset + size - sizeof(uint64_t));
+  insert_block(region, offset, size);
+  return offset;
+}
+
+// extend the heap with a run of pages from the tail that is large enough to
+// hold a block of the given size. the run is merged with the segment(s) it
+// borders on. returns the offset of the resulting free block
+nonnull_all
+static uintptr_t grow_heap(region_t *region, uint64_t size)
+{
+  if (unlikely(is_sealed(region)))
+    return 0;
+
+  // account for the fence
+  size_t count = (size + sizeof(uint64_t) + (PAGE_SIZE - 1)) / PAGE_SIZE;
+  uintptr_t page = 0;
+
+  // extend the segment the heap was last grown with downwards if the first
+  // block is free and sufficiently many pages below it are free too
+  const uintptr_t low = region->heap.free_page;
+  if (low > region->pages && low < region_limit(region) &&
+      is_heap_page(region, low / PAGE_SIZE) &&
+      !is_heap_page(region, low / PAGE_SIZE - 1))
+  {
+    const struct large_object *block = swizzle(region, low);
+    const uint64_t free_size = block->tag & ~TAG_FLAGS;
+    if (!(block->tag & IN_USE) && free_size < size) {
+      const size_t extend = (size - free_size + (PAGE_SIZE - 1)) / PAGE_SIZE;
+      if ((low - region->pages) / PAGE_SIZE >= extend) {
+        size_t index = 1;
+        for (; index <= extend && is_free_page(region, low - index * PAGE_SIZE); index++) ;
+        if (index > extend) {
+          page = low - extend * PAGE_SIZE;
+          count = extend;
+        }
+      }
+    }
+  }
+
+  if (!page && !(page = find_free_pages(region, region->heap.free_page, count)))
+    return 0;
+
+  const uintptr_t end = page + count * PAGE_SIZE;
+  const size_t bit = page / PAGE_SIZE;
+  uintptr_t start = page, stop = end - sizeof(uint64_t);
+  uint64_t flags = IN_USE | PREV_IN_USE;
+
+  // merge with segment that ends where the run starts, the fence becomes the
+  // tag of the new block
+  if (is_heap_page(region, bit - 1)) {
+    const struct large_object *fence = swizzle(region, page - sizeof(uint64_t));
+    assert(fence->tag & IN_USE);
+    assert(!(fence->tag & ~TAG_FLAGS));
+    start = page - sizeof(uint64_t);
+    flags = IN_USE | (fence->tag & PREV_IN_USE);
+  }
+
+  // merge with segment that starts where the run ends
+  if (end < region_limit(region) && is_heap_page(region, end / PAGE_SIZE))
+  {
+    stop = end;
+  } else {
+    struct large_object *fence = swizzle(region, stop);
+    fence->tag = IN_USE | PREV_IN_USE;
+    mark_page(region, stop);
+  }
+
+  for (size_t index = 0; index < count; index++)
+    use_page(region, bit + index, PAGE_HEAP);
+  STAT_ADD(region->heap.stats.pages, count);
+  if (end == region->heap.free_page)
+    region->heap.free_page = page;
+
+  struct large_object *block = swizzle(region, start);
+  block->tag = (stop - start) | flags;
+  mark_page(region, start);
+  return release_block(region, start);
+}
+
+// best fit, blocks in the size class for the current power of two may be
+// sufficiently large too. the heap is only grown if none of those fit
+nonnull_all
+static uintptr_t fit_block(region_t *region, uint64_t size)
+{
+  const size_t index = heap_class(size);
+  uintptr_t offset = region->heap.free[index], best = 0;
+  uint64_t best_size = 0;
+
+  while (offset) {
+    const struct large_object *block = swizzle(region, offset);
+    const uint64_t block_size = block->tag & ~TAG_FLAGS;
+    if (block_size >= size && (!best || block_size < best_size)) {
+      best = offset;
+      best_size = block_size;
+      if (block_size == size)
+        break;
+    }
+    offset = block->next;
+  }
+
+  return best;
+}
+
+// the heap will grow from the tail in our case. large objects are uncommon
+// in dns, but in theory, an RR may contain as much as 65535 bytes of data.
+nonnull((1))
+static intptr_t heap_alloc(region_t *region, size_t size)
+{
+  assert(!is_small_object_size(size));
+
+  // free blocks of sealed regions are read-only too
+  if (size >= region->size || is_sealed(region))
+    return 0;
+
+  // reserve space for the tag, at least align on 8 bytes
+  const uint64_t block_size = (size + sizeof(uint64_t) + 7) & ~7llu;
+  assert(block_size >= MIN_BLOCK_SIZE);
+
+  // instant fit, any block in the size class for the next power of two is
+  // sufficiently large enough
+  const size_t index = heap_class(block_size) + !!(block_size & (block_size - 1));
+  const uint64_t classes =
+    index < HEAP_CLASSES ? region->heap.classes & ((uint64_t)-1 << index) : 0;
+
+  uintptr_t offset;
+  if (classes)
+    offset = region->heap.free[ __builtin_ctzll(classes) ];
+  else if (!(offset = fit_block(region, block_size)) &&
+           !(offset = grow_heap(region, block_size)))
+    return 0;
+
+  struct large_object *block = swizzle(region, offset);
+  uint64_t free_size = block->tag & ~TAG_FLAGS;
+  assert(!(block->tag & IN_USE) && (block->tag & PREV_IN_USE));
+  assert(free_size >= block_size);
+  remove_block(region, offset, free_size);
+
+  if (free_size - block_size >= MIN_BLOCK_SIZE) {
+    // split, the block following the remainder is already flagged as
+    // preceded by a free block
+    const uintptr_t remainder = offset + block_size;
+    const uint64_t remainder_size = free_size - block_size;
+    struct large_object *next = swizzle(region, remainder);
+    next->tag = remainder_size | PREV_IN_USE;
+    *block_footer(region, remainder, remainder_size) = remainder_size;
+    mark_page(region, remainder + remainder_size - sizeof(uint64_t));
+    insert_block(region, remainder, remainder_size);
+    free_size = block_size;
+  } else {
+    struct large_object *next = swizzle(region, offset + free_size);
+    next->tag |= PREV_IN_USE;
+    mark_page(region, offset + free_size);
+  }
+
+  // block is considered modified in its entirety on allocation
+  block->tag = free_size | IN_USE | PREV_IN_USE;
+  mark_pages(region, offset, free_size);
+  STAT_ADD(region->heap.stats.allocs, 1);
+  STAT_ADD(region->heap.stats.requested, size);
+  STAT_ADD(region->heap.stats.allocated, free_size);
+  STAT_ADD(region->heap.stats.in_use, free_size);
+  return (intptr_t)(offset + sizeof(uint64_t));
+}
+
+// release memory backing a free block. a block that spans a segment in its
+// entirety, i.e. starts a segment and is followed by the fence, is returned
+// to the region. memory backing the pages in between the tag (and links)
+// and the footer of other blocks is released to the operating system.
+// snapshots retain private copies for reuse, like slabs, pages returned to
+// the region are discarded on commit
+nonnull_all
+static void trim_block(region_t *region, uintptr_t offset)
+{
+  const struct large_object *block = swizzle(region, offset);
+  const uint64_t size = block->tag & ~TAG_FLAGS;
+  const struct large_object *next = swizzle(region, offset + size);
+  const uintptr_t end = offset + size + sizeof(uint64_t);
+  assert(!(block->tag & IN_USE));
+
+  if ((offset & PAGE_MASK) == offset && !is_heap_page(region, offset / PAGE_SIZE - 1) &&
+      !(next->tag & ~TAG_FLAGS) && (end & PAGE_MASK) == end)
+  {
+    const size_t bit = offset / PAGE_SIZE, count = (end - offset) / PAGE_SIZE;
+    remove_block(region, offset, size);
+    for (size_t index = 0; index < count; index++)
+      release_page(region, bit + index);
+    STAT_SUB(region->heap.stats.pages, count);
+    if (!in_transaction(region))
+      region_discard(region, offset, count * PAGE_SIZE);
+    return;
+  }
 
+  if (in_transaction(region))
+    return;
+  const uintptr_t first =
+    (offset + sizeof(*block) + (PAGE_SIZE - 1)) & PAGE_MASK;
+  const uintptr_t last = (offset + size - sizeof(uint64_t)) & PAGE_MASK;
+  if (first < last)
+    region_discard(region, first, last - first);
+}
+
+// in-use blocks have no footer, the tag of the block that follows mirrors
+// the in-use flag instead. an offset into a block (or a stale offset) is
+// unlikely to pass, the blocks it would otherwise corrupt are left alone
+nonnull_all
+static bool is_block(const region_t *region, uintptr_t offset)
+{
+  const struct large_object *block = swizzle(region, offset);
+  const uint64_t size = block->tag & ~TAG_FLAGS;
+  if (!(block->tag & IN_USE) || size < MIN_BLOCK_SIZE ||
+      size >= region_limit(region) - offset)
+    return false;
+  const struct large_object *next = swizzle(region, offset + size);
+  return (next->tag & PREV_IN_USE) != 0;
+}
+
+nonnull((1))
+static void heap_free(region_t *region, intptr_t object)
+{
+  const uintptr_t offset = (uintptr_t)object - sizeof(uint64_t);
+  const struct large_object *block = swizzle(region, offset);
+
+  // detect double free and offsets that do not refer to a block
+  assert(is_block(region, offset));
+  if (!is_block(region, offset))
+    return;
+
+  STAT_ADD(region->heap.stats.frees, 1);
+  STAT_SUB(region->heap.stats.in_use, block->tag & ~TAG_FLAGS);
+  trim_block(region, release_block(region, offset));
+}
+
+// objects have a minimum size of sizeof(void*) bytes. an object is opaque
+// when allocated, but contains a pointer to the next free object otherwise.
+// the last available object in a slab is zeroed to indicate the slab is
+// depleted
+
+static always_inline size_t small_object_cache(size_t size)
+{
+  assert(size <= 256);
+  return alloc_size_index[ (size - 1) >> 3 ];
+}
+
+intptr_t region_size_cache(size_t size)
+{
+  if (!size || !is_small_object_size(size))
+    return -1;
+  return (intptr_t)small_object_cache(size);
+}
+
+intptr_t region_alloc(region_t *region, size_t size)
+{
+  assert(region);
+
+  intptr_t object;
   if (is_small_object_size(size)) {
     if (size == 0)
       return 0;
     const size_t index = small_object_cache(size);
-    return cache_alloc(region, index, size);
-#if 0
+    object = cache_alloc(region, index);
+    if (likely(object))
+      STAT_ADD(region->caches.cache[index].stats.requested, size);
   } else {
-    return heap_alloc(region, size);
-#endif
+    object = heap_alloc(region, size);
   }
+
+  region_trace(&region->mapping, REGION_TRACE_ALLOC, (uint64_t)object, size, -1);
+  return object;
+}
+
+intptr_t region_alloc_near(region_t *region, size_t size, intptr_t hint)
+{
+  assert(region);
+
+  // large objects are not placed by proximity
+  if (!is_small_object_size(size) || size == 0)
+    return region_alloc(region, size);
+
+  const size_t index = small_object_cache(size);
+  const intptr_t object = cache_alloc_near(region, index, hint);
+  if (likely(object))
+    STAT_ADD(region->caches.cache[index].stats.requested, size);
+
+  region_trace(&region->mapping, REGION_TRACE_ALLOC, (uint64_t)object, size, -1);
+  return object;
 }
 
 void region_free(region_t *region, intptr_t object)
 {
   assert(region);
 
-  if (object <= region->pages || object >= region->size)
+  if (unlikely(is_sealed(region)))
+    return;
+  if (object <= (intptr_t)region->pages || object >= (intptr_t)region_limit(region))
     return;
   if (object & 0x7u)
     return;
 
-  if (is_cache_object(region, object))
-    cache_free(region, object_cache(region, object), object);
-#if 0
-  else if (is_heap_object(region, object))
+  region_trace(&region->mapping, REGION_TRACE_FREE, (uint64_t)object, 0, -1);
+  // the descriptor classifies the object and identifies the cache
+  const uint8_t descriptor = *page_descriptor(region, (uintptr_t)object / PAGE_SIZE);
+  if (descriptor & PAGE_SLAB)
+    cache_free(region, PAGE_CACHE(descriptor), object);
+  else if ((descriptor & PAGE_TYPE) == PAGE_HEAP)
     heap_free(region, object);
-#endif
 }
 
-#if 0
-region_cache_init()
+size_t region_alloc_bulk(
+  region_t *region, size_t size, size_t count, intptr_t *objects)
+{
+  assert(region);
+  assert(!count || objects);
+
+  if (!size)
+    return 0;
+
+  size_t done = 0;
+  if (is_small_object_size(size)) {
+    const size_t index = small_object_cache(size);
+    done = cache_alloc_bulk(region, index, count, objects);
+    STAT_ADD(region->caches.cache[index].stats.requested, done * size);
+  } else {
+    for (; done < count; done++) {
+      if (!(objects[done] = heap_alloc(region, size)))
+        break;
+    }
+  }
+
+  // traced as individual allocations
+  for (size_t index = 0; index < done; index++)
+    region_trace(&region->mapping, REGION_TRACE_ALLOC, (uint64_t)objects[index], size, -1);
+  return done;
+}
+
+size_t region_cache_alloc_bulk(
+  region_t *region, intptr_t cache, size_t count, intptr_t *objects)
+{
+  assert(region);
+  assert(cache >= 0 && (size_t)cache < region->caches.count);
+  assert(!count || objects);
+
+  if (unlikely((uintptr_t)cache >= region->caches.count))
+    return 0;
+  struct cache *ptr = &region->caches.cache[cache];
+  const size_t done = cache_alloc_bulk(region, (size_t)cache, count, objects);
+  STAT_ADD(ptr->stats.requested, done * ptr->object_size);
+
+  // traced as individual allocations
+  for (size_t index = 0; index < done; index++)
+    region_trace(&region->mapping, REGION_TRACE_CACHE_ALLOC,
+                 (uint64_t)objects[index], ptr->object_size, cache);
+  return done;
+}
+
+void region_free_bulk(region_t *region, const intptr_t *objects, size_t count)
+{
+  assert(region);
+  assert(!count || objects);
+
+  if (unlikely(is_sealed(region)))
+    return;
+
+  for (size_t index = 0; index < count; ) {
+    const intptr_t object = objects[index++];
+
+    if (object <= (intptr_t)region->pages || object >= (intptr_t)region_limit(region))
+      continue;
+    if (object & 0x7u)
+      continue;
+    region_trace(&region->mapping, REGION_TRACE_FREE, (uint64_t)object, 0, -1);
+    const uint8_t descriptor = *page_descriptor(region, (uintptr_t)object / PAGE_SIZE);
+    if (!(descriptor & PAGE_SLAB)) {
+      if ((descriptor & PAGE_TYPE) == PAGE_HEAP)
+        heap_free(region, object);
+      continue;
+    }
+
+    const uintptr_t slab_offset = object_slab(region, (uintptr_t)object);
+    struct slab *slab = swizzle(region, slab_offset);
+    struct cache *cache = &region->caches.cache[PAGE_CACHE(descriptor)];
+    assert((uintptr_t)swizzle(region, slab->cache) == (uintptr_t)cache);
+    const uintptr_t slab_end = slab_offset + cache->slab_pages * PAGE_SIZE;
+    if (unlikely(!slab->list)) {
+      assert(cache->load.slab == slab_offset);
+      seal_slab(region, cache);
+    }
+    const size_t free_count = slab->free_objects.count;
+
+    mark_page(region, slab_offset);
+    (void)release_object(region, cache, slab, object);
+    // objects that follow and belong to the same slab are released before
+    // the slab is moved
+    for (; index < count; index++) {
+      const intptr_t next = objects[index];
+      if ((uintptr_t)next < slab_offset || (uintptr_t)next >= slab_end || (next & 0x7u))
+        break;
+      region_trace(&region->mapping, REGION_TRACE_FREE, (uint64_t)next, 0, -1);
+      (void)release_object(region, cache, slab, next);
+    }
+    release_slab(region, cache, slab_offset, free_count);
+  }
+}
+
+void region_load(region_t *region)
+{
+  assert(region);
+  mark_administration(region);
+  region->caches.load = true;
+}
+
+void region_seal(region_t *region)
+{
+  assert(region);
+
+  for (size_t index = 0; index < region->caches.count; index++) {
+    struct cache *cache = &region->caches.cache[index];
+    if (cache->load.slab)
+      seal_slab(region, cache);
+  }
+  if (region->caches.load)
+    mark_administration(region);
+  region->caches.load = false;
+}
+
+void region_dirty(region_t *region, intptr_t object, size_t size)
+{
+  assert(region);
+
+  if (!size || is_sealed(region))
+    return;
+  if (object <= (intptr_t)region->pages || (uintptr_t)object >= region_limit(region))
+    return;
+  if (size > region_limit(region) - (uintptr_t)object)
+    size = region_limit(region) - (uintptr_t)object;
+
+  mark_pages(region, (uintptr_t)object, size);
+}
+
+void region_mark(region_t *region, uintptr_t offset, size_t size)
+{
+  assert(region);
+
+  if (!size || offset >= region->size)
+    return;
+  if (size > region->size - offset)
+    size = region->size - offset;
+
+  mark_pages(region, offset, size);
+}
+
+struct mapping *region_mapping(region_t *region)
+{
+  assert(region);
+  return &region->mapping;
+}
+
+size_t region_size(const region_t *region)
+{
+  assert(region);
+  return region->size;
+}
+
+void region_stats(const region_t *region, struct region_stats *stats)
+{
+  assert(region);
+  assert(stats);
+
+  memset(stats, 0, sizeof(*stats));
+  // pages beyond the limit are reserved for bitmaps
+  const size_t limit = region_limit(region);
+  stats->size = region->size;
+  stats->pages = stats->size / PAGE_SIZE;
+  stats->admin_pages = region->pages / PAGE_SIZE;
+  if (stats->size > limit)
+    stats->admin_pages += (stats->size - limit) / PAGE_SIZE;
+  stats->dirty_pages = STAT_LOAD(region->dirty.count);
+
+  const size_t count = __atomic_load_n(&region->caches.count, __ATOMIC_ACQUIRE);
+  for (size_t index = 0; index < count; index++) {
+    const struct cache *cache = &region->caches.cache[index];
+    // slab that is being loaded is on no list
+    const size_t slabs = STAT_LOAD(cache->full_slabs.count) +
+                         STAT_LOAD(cache->partial_slabs.count) +
+                         STAT_LOAD(cache->free_slabs.count) +
+                         (STAT_LOAD(cache->load.slab) != 0);
+    stats->cache_pages += slabs * cache->slab_pages;
+    stats->cache_allocs += STAT_LOAD(cache->stats.allocs);
+    stats->cache_frees += STAT_LOAD(cache->stats.frees);
+  }
+
+  stats->heap_pages = STAT_LOAD(region->heap.stats.pages);
+  stats->heap_allocs = STAT_LOAD(region->heap.stats.allocs);
+  stats->heap_frees = STAT_LOAD(region->heap.stats.frees);
+  stats->heap_requested = STAT_LOAD(region->heap.stats.requested);
+  stats->heap_allocated = STAT_LOAD(region->heap.stats.allocated);
+  stats->heap_in_use = STAT_LOAD(region->heap.stats.in_use);
+  stats->heap_free = STAT_LOAD(region->heap.stats.free);
+  stats->heap_free_blocks = STAT_LOAD(region->heap.stats.free_blocks);
+  // free lists are not walked, the largest free block is at least the
+  // lower bound of the highest size class that holds a block
+  const uint64_t classes = STAT_LOAD(region->heap.classes);
+  if (classes)
+    stats->heap_largest_free = 1llu << heap_class(classes);
+
+  const size_t used =
+    stats->admin_pages + stats->cache_pages + stats->heap_pages;
+  stats->free_pages = used < stats->pages ? stats->pages - used : 0;
+}
+
+int region_cache_stats(
+  const region_t *region, intptr_t cache, struct region_cache_stats *stats)
+{
+  assert(region);
+  assert(stats);
+
+  if ((uintptr_t)cache >= __atomic_load_n(&region->caches.count, __ATOMIC_ACQUIRE))
+    return -1;
+
+  const struct cache *ptr = &region->caches.cache[cache];
+  memset(stats, 0, sizeof(*stats));
+  memcpy(stats->name, ptr->name, sizeof(stats->name));
+  stats->object_size = ptr->object_size;
+  stats->alignment = ptr->alignment;
+  stats->aligned_size = ptr->aligned_size;
+  stats->slab_pages = ptr->slab_pages;
+  stats->slab_objects = ptr->object_count;
+  stats->full_slabs = STAT_LOAD(ptr->full_slabs.count);
+  // slab that is being loaded is partial as far as statistics go
+  stats->partial_slabs = STAT_LOAD(ptr->partial_slabs.count) +
+                         (STAT_LOAD(ptr->load.slab) != 0);
+  stats->free_slabs = STAT_LOAD(ptr->free_slabs.count);
+  stats->allocs = STAT_LOAD(ptr->stats.allocs);
+  stats->frees = STAT_LOAD(ptr->stats.frees);
+  stats->slabs_created = STAT_LOAD(ptr->stats.slabs_created);
+  stats->slabs_released = STAT_LOAD(ptr->stats.slabs_released);
+  stats->requested = STAT_LOAD(ptr->stats.requested);
+  stats->allocated = stats->allocs * ptr->aligned_size;
+  stats->in_use = stats->allocs - stats->frees;
+  return 0;
+}
+
+static always_inline uint64_t rotate(uint64_t word, unsigned int bits)
+{
+  return (word << bits) | (word >> (64 - bits));
+}
+
+// checksums detect pages that were not written back completely or were
+// corrupted at rest, not tampering. four independent multiply-rotate lanes
+// over 64-bit words (xxHash) keep up with memory bandwidth. 0 is reserved
+// for pages without a checksum
+static const uint64_t primes[] = {
+  0x9e3779b185ebca87llu, 0xc2b2ae3d27d4eb4fllu,
+  0x165667b19e3779f9llu, 0x85ebca77c2b2ae63llu };
+
+// words are distributed over the lanes round-robin, count is a multiple of
+// four for pages and any number of words otherwise
+static always_inline void hash_words(
+  uint64_t lanes[4], const uint64_t *words, size_t count)
+{
+  for (size_t index = 0; index < count; index++)
+    lanes[index & 3] =
+      rotate(lanes[index & 3] + words[index] * primes[1], 31) * primes[0];
+}
+
+static always_inline uint64_t hash_lanes(const uint64_t lanes[4])
 {
-  // * align must be a multiple of 8
+  uint64_t hash = rotate(lanes[0], 1) + rotate(lanes[1], 7) +
+                  rotate(lanes[2], 12) + rotate(lanes[3], 18);
+  hash ^= hash >> 33;
+  hash *= primes[1];
+  hash ^= hash >> 29;
+  return hash ^ (hash >> 32);
+}
+
+static uint32_t page_checksum(const void *page)
+{
+  uint64_t lanes[4] = { primes[0], primes[1], primes[2], primes[3] };
+  hash_words(lanes, page, PAGE_SIZE / sizeof(uint64_t));
+  const uint32_t checksum = (uint32_t)hash_lanes(lanes);
+  return checksum ? checksum : 1;
+}
+
+// the administration is written back in multiple pages, a commit that was
+// interrupted may leave a mix of pages. the header (but for the process
+// local mapping information and the checksum itself), descriptors, summary
+// and checksums of data pages are covered, the index is rebuilt on open
+static uint64_t administration_checksum(const region_t *region)
+{
+  const uint8_t *base = (const uint8_t *)region;
+  const size_t mapping = offsetof(struct region, mapping);
+  const size_t after = mapping + sizeof(struct mapping);
+  const size_t checksum = offsetof(struct region, checksums.administration);
+  const size_t end = sizeof(struct region);
+  _Static_assert(offsetof(struct region, mapping) % 8 == 0 &&
+                 offsetof(struct region, checksums.administration) % 8 == 0 &&
+                 sizeof(struct region) % 8 == 0 &&
+                 sizeof(struct mapping) % 8 == 0,
+                 "administration must be hashed in words");
+
+  uint64_t lanes[4] = { primes[0], primes[1], primes[2], primes[3] };
+  hash_words(lanes, (const uint64_t *)base, mapping / 8);
+  hash_words(lanes, (const uint64_t *)(base + after), (checksum - after) / 8);
+  hash_words(lanes, (const uint64_t *)(base + checksum + 8),
+             (end - checksum - 8) / 8);
+  // descriptors, summary and checksums are stored consecutively
+  const uintptr_t bitmaps = region->descriptors.entries;
+  hash_words(lanes, (const uint64_t *)(base + bitmaps),
+             (region->used[0].bits - bitmaps) / 8);
+  const uint64_t hash = hash_lanes(lanes);
+  return hash ? hash : 1;
+}
+
+// compute checksums for updated data pages before they are copied back.
+// pages that were released no longer have a checksum
+nonnull_all
+static void update_checksums(region_t *region)
+{
+  uint32_t *checksums = swizzle(region, region->checksums.checksums);
+  const size_t first = region->pages / PAGE_SIZE;
+  const size_t limit = region->descriptors.limit;
+
+  for (size_t bit = find_dirty_page(region, first);
+       bit < limit;
+       bit = find_dirty_page(region, bit + 1))
+  {
+    const uintptr_t page = bit * PAGE_SIZE;
+    if (is_free_page(region, page))
+      checksums[bit] = 0;
+    else
+      checksums[bit] = page_checksum(swizzle(region, (intptr_t)page));
+    mark_page(region, region->checksums.checksums + bit * sizeof(uint32_t));
+  }
+}
+
+int region_check_page(const region_t *region, size_t page)
+{
+  assert(region);
+
+  // administration and bitmaps are validated on open
+  if (page < region->pages / PAGE_SIZE || page >= region->descriptors.limit)
+    return 0;
+  // pages updated since the last commit have no valid checksum
+  if (is_dirty_page(region, page))
+    return 0;
+  const uint32_t *checksums = swizzle(region, region->checksums.checksums);
+  const uint32_t checksum = checksums[page];
+  if (!checksum)
+    return 0;
+  return page_checksum(swizzle(region, (intptr_t)(page * PAGE_SIZE))) == checksum ? 0 : -1;
+}
+
+// estimates scale the memory required by the transfer that was last
+// committed by the number of records and octets, whichever requires more.
+// regions that never committed a transfer fall back to a rule of thumb.
+// the estimate has a margin added, which is larger for the rule of thumb.
+// larger mappings cost address space and administration, pages that are
+// never touched cost no memory
+#define ESTIMATE_MARGIN (8) // 1/8
+#define ESTIMATE_DEFAULT_MARGIN (2) // 1/2
+#define ESTIMATE_OCTET_BYTES (2)
+#define ESTIMATE_RECORD_BYTES (64)
+
+// record what the transfer an estimate was made for allocated
+nonnull_all
+static void learn_estimate(region_t *region)
+{
+  if (!region->estimate.records && !region->estimate.octets)
+    return;
+
+  for (size_t index = 0; index < region->caches.count; index++) {
+    struct cache *cache = &region->caches.cache[index];
+    cache->estimate.objects = cache->stats.allocs - cache->estimate.allocs;
+    cache->estimate.allocs = 0;
+  }
+  region->estimate.profile.records = region->estimate.records;
+  region->estimate.profile.octets = region->estimate.octets;
+  // blocks may leave remainders too small to be reused, the heap then takes
+  // more pages from the region than the bytes handed out suggest
+  const uint64_t bytes =
+    region->heap.stats.allocated - region->estimate.heap_allocated;
+  uint64_t pages = 0;
+  if (region->heap.stats.pages > region->estimate.heap_pages)
+    pages = (region->heap.stats.pages - region->estimate.heap_pages) * PAGE_SIZE;
+  region->estimate.profile.heap_bytes = bytes > pages ? bytes : pages;
+  region->estimate.records = 0;
+  region->estimate.octets = 0;
+  region->estimate.heap_allocated = 0;
+  region->estimate.heap_pages = 0;
+}
+
+// amount of the transfer that was last committed scaled to the transfer of
+// records and octets
+nonnull_all
+static uint64_t scale_estimate(
+  const region_t *region, uint64_t amount, uint64_t records, uint64_t octets)
+{
+  const uint64_t profile_records = region->estimate.profile.records;
+  const uint64_t profile_octets = region->estimate.profile.octets;
+  uint64_t by_records = 0, by_octets = 0;
+  if (profile_records)
+    by_records = (amount * records + profile_records - 1) / profile_records;
+  if (profile_octets)
+    by_octets = (amount * octets + profile_octets - 1) / profile_octets;
+  return by_records > by_octets ? by_records : by_octets;
+}
+
+size_t region_estimate(region_t *region, size_t octets, size_t records)
+{
+  assert(region);
+
+  uint64_t pages = 0;
+  size_t margin = ESTIMATE_MARGIN;
+  const bool learned =
+    region->estimate.profile.records || region->estimate.profile.octets;
+
+  if (learned) {
+    // objects that fit the slabs of a cache require no pages
+    for (size_t index = 0; index < region->caches.count; index++) {
+      const struct cache *cache = &region->caches.cache[index];
+      if (!cache->estimate.objects)
+        continue;
+      const uint64_t objects =
+        scale_estimate(region, cache->estimate.objects, records, octets);
+      const uint64_t slabs = cache->full_slabs.count +
+                             cache->partial_slabs.count +
+                             cache->free_slabs.count +
+                             (cache->load.slab != 0);
+      const uint64_t in_use = cache->stats.allocs - cache->stats.frees;
+      const uint64_t available = slabs * cache->object_count - in_use;
+      if (objects <= available)
+        continue;
+      const uint64_t count = objects - available;
+      pages += ((count + cache->object_count - 1) / cache->object_count) *
+               cache->slab_pages;
+    }
+    // free blocks are not accounted for, these may be too small
+    const uint64_t bytes =
+      scale_estimate(region, region->estimate.profile.heap_bytes, records, octets);
+    pages += (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+  } else {
+    const uint64_t bytes = (uint64_t)octets * ESTIMATE_OCTET_BYTES +
+                           (uint64_t)records * ESTIMATE_RECORD_BYTES;
+    pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    margin = ESTIMATE_DEFAULT_MARGIN;
+  }
+
+  pages += (pages + margin - 1) / margin;
+
+  // record the transfer to learn what it requires on commit
+  mark_administration(region);
+  region->estimate.records = records;
+  region->estimate.octets = octets;
+  region->estimate.heap_allocated = region->heap.stats.allocated;
+  region->estimate.heap_pages = region->heap.stats.pages;
+  for (size_t index = 0; index < region->caches.count; index++) {
+    struct cache *cache = &region->caches.cache[index];
+    cache->estimate.allocs = cache->stats.allocs;
+  }
+
+  struct region_stats stats;
+  region_stats(region, &stats);
+  if (pages <= stats.free_pages)
+    return region->size;
+  return region->size + (size_t)(pages - stats.free_pages) * PAGE_SIZE;
+}
+
+int region_copy_begin(region_t *region, region_t *copy)
+{
+  assert(region);
+  assert(copy);
+
+  if (region->pages != copy->pages || region->size > copy->size)
+    return -1;
+
+  // slabs that are being loaded are committed as regular slabs
+  region_seal(copy);
+  learn_estimate(copy);
+  if (region->mapping.flags & MAPPING_FILE)
+    update_checksums(copy);
+  return 0;
+}
+
+size_t region_copy_next(
+  const region_t *copy, size_t page, size_t *count, bool *discard)
+{
+  assert(copy);
+  assert(count);
+  assert(discard);
+
+  const size_t size = copy->descriptors.size;
+  const size_t first = copy->pages / PAGE_SIZE;
+  const size_t bit = find_dirty_page(copy, page > first ? page : first);
+
+  *count = 0;
+  if (bit >= size)
+    return size;
+
+  // consecutive updated pages are copied in one go. pages that were
+  // returned to the region hold no data, these are discarded instead
+  *discard = is_released_page(copy, bit);
+  size_t last = bit + 1;
+  while (last < size &&
+         is_dirty_page(copy, last) &&
+         is_released_page(copy, last) == *discard)
+    last++;
+  *count = last - bit;
+  return bit;
+}
+
+int region_copy_end(region_t *region, region_t *copy)
+{
+  assert(region);
+  assert(copy);
+
+  // mapping information is process local and is left alone
+  const size_t mapping = offsetof(struct region, mapping);
+  const size_t after = mapping + sizeof(struct mapping);
+  memcpy(region, copy, mapping);
+  memcpy((uint8_t *)region + after, (const uint8_t *)copy + after, copy->pages - after);
+
+  // the checksum covers the administration as it is written back, i.e.
+  // without pages flagged as updated
+  clear_dirty(region);
+  int result = 0;
+  if (region->mapping.flags & MAPPING_FILE) {
+    region->checksums.administration = administration_checksum(region);
+    region_flush(region, 0, copy->pages);
+    result = region_barrier(region);
+  }
+
+  clear_dirty(copy);
+  return result;
+}
+
+int region_copy(region_t *region, region_t *copy)
+{
+  assert(region);
+  assert(copy);
+
+  if (region == copy)
+    return 0;
+  if (region_copy_begin(region, copy) == -1)
+    return -1;
+
+  size_t count;
+  bool discard;
+  for (size_t bit = region_copy_next(copy, 0, &count, &discard);
+       count;
+       bit = region_copy_next(copy, bit + count, &count, &discard))
+  {
+    if (discard) {
+      region_discard(region, bit * PAGE_SIZE, count * PAGE_SIZE);
+    } else {
+      memcpy(swizzle(region, bit * PAGE_SIZE),
+             swizzle(copy, bit * PAGE_SIZE),
+             count * PAGE_SIZE);
+      region_flush(region, bit * PAGE_SIZE, count * PAGE_SIZE);
+    }
+  }
+
+  // region administration last. for regions mapped from a file, data pages
+  // are written back before the administration that references them. the
+  // region is updated in memory even if the file cannot be written
+  int result = region_barrier(region);
+  if (region_copy_end(region, copy) == -1)
+    result = -1;
+  return result;
+}
+
+void region_clone(void *address, const region_t *region)
+{
+  assert(address);
+  assert(region);
+
+  const size_t first = region->pages / PAGE_SIZE;
+  const size_t limit = region->descriptors.limit;
+  uint8_t *pages = address;
+
+  memcpy(pages, region, region->pages);
+  // copy consecutive pages in use in one go, free pages hold no data
+  for (size_t bit = first; bit < limit; ) {
+    if (is_free_page(region, bit * PAGE_SIZE)) {
+      bit++;
+      continue;
+    }
+    size_t last = bit + 1;
+    while (last < limit && !is_free_page(region, last * PAGE_SIZE))
+      last++;
+    memcpy(pages + bit * PAGE_SIZE,
+           swizzle(region, bit * PAGE_SIZE),
+           (last - bit) * PAGE_SIZE);
+    bit = last;
+  }
+
+  // pages reserved for administration from the tail
+  if (region->size > limit * PAGE_SIZE)
+    memcpy(pages + limit * PAGE_SIZE,
+           swizzle(region, limit * PAGE_SIZE),
+           region->size - limit * PAGE_SIZE);
+}
+
+intptr_t region_cache_create(
+  region_t *region, const char *name, size_t object_size, size_t object_align)
+{
+  assert(region);
+  assert(name);
+  return region_cache_init(region, name, object_size, object_align, false);
+}
+
+intptr_t region_cache_init(
+  region_t *region,
+  const char *name,
+  size_t object_size,
+  size_t object_align,
+  bool constructed)
+{
+  assert(region);
+  assert(name);
+  const size_t count = region->caches.count;
+  const intptr_t cache =
+    cache_init(region, name, object_size, object_align, constructed);
+  if (region->caches.count != count)
+    mark_administration(region);
+  if (cache != -1)
+    region_trace(&region->mapping, REGION_TRACE_CACHE_CREATE,
+                 region->caches.cache[cache].alignment, object_size, cache);
+  return cache;
 }
 
 intptr_t region_cache_alloc(region_t *region, intptr_t cache)
+{
+  assert(region);
+  assert(cache >= 0 && (size_t)cache < region->caches.count);
+
+  if (unlikely((uintptr_t)cache >= region->caches.count))
+    return 0;
+  struct cache *ptr = &region->caches.cache[cache];
+  const intptr_t object = cache_alloc(region, (size_t)cache);
+  if (likely(object))
+    STAT_ADD(ptr->stats.requested, ptr->object_size);
+  region_trace(&region->mapping, REGION_TRACE_CACHE_ALLOC,
+               (uint64_t)object, ptr->object_size, cache);
+  return object;
+}
+
+intptr_t region_cache_alloc_near(region_t *region, intptr_t cache, intptr_t hint)
+{
+  assert(region);
+  assert(cache >= 0 && (size_t)cache < region->caches.count);
+
+  if (unlikely((uintptr_t)cache >= region->caches.count))
+    return 0;
+  struct cache *ptr = &region->caches.cache[cache];
+  const intptr_t object = cache_alloc_near(region, (size_t)cache, hint);
+  if (likely(object))
+    STAT_ADD(ptr->stats.requested, ptr->object_size);
+  region_trace(&region->mapping, REGION_TRACE_CACHE_ALLOC,
+               (uint64_t)object, ptr->object_size, cache);
+  return object;
+}
+
+int region_cache_retain(region_t *region, intptr_t cache, size_t slabs)
 {
   assert(region);
 
-  //if (cache >= sizeof(region->caches.cache / region->caches.cache[0]))
-  //  return -1; // invalid cache
-  //if (cache >= region->caches.count)
-  //  return -1; // invalid cache
+  if ((uintptr_t)cache >= region->caches.count || is_sealed(region))
+    return -1;
 
-  return cache_alloc(region, cache, 0);
+  struct cache *ptr = &region->caches.cache[cache];
+  mark_administration(region);
+  ptr->retain = slabs;
+  while (ptr->free_slabs.count > slabs)
+    free_slab(region, ptr->free_slabs.list);
+  return 0;
 }
 
 void region_cache_free(region_t *region, intptr_t cache, intptr_t object)
 {
   assert(region);
-  // * check cache is valid
-  // * check object resides in region
+  assert(cache >= 0 && (size_t)cache < region->caches.count);
+  assert(is_object(region, object) && is_cache_object(region, object));
+  assert(object_cache(region, object) == cache);
+
+  // objects released to a cache they were not allocated from are left alone
+  if (unlikely((uintptr_t)cache >= region->caches.count || is_sealed(region)))
+    return;
+  if (unlikely(!is_object(region, object) || !is_cache_object(region, object) ||
+               object_cache(region, object) != cache))
+    return;
+
+  region_trace(&region->mapping, REGION_TRACE_CACHE_FREE, (uint64_t)object, 0, cache);
+  cache_free(region, (size_t)cache, object);
+}
+
+// least occupied partial slab, provided the objects in use fit in the other
+// partial slabs. returns 0 if there is none
+nonnull_all
+static uintptr_t evacuable_slab(const region_t *region, const struct cache *cache)
+{
+  uintptr_t victim = 0;
+  size_t free_count = 0, victim_free = 0;
+
+  for (uintptr_t slab_offset = cache->partial_slabs.list; slab_offset; ) {
+    const struct slab *slab = swizzle(region, slab_offset);
+    free_count += slab->free_objects.count;
+    if (slab->free_objects.count > victim_free) {
+      victim = slab_offset;
+      victim_free = slab->free_objects.count;
+    }
+    slab_offset = slab->next;
+  }
+
+  if (!victim || free_count - victim_free < cache->object_count - victim_free)
+    return 0;
+  return victim;
+}
+
+// move objects out of slab until the slab is released or budget objects
+// are moved. pinned is set if the owner refuses to move an object
+nonnull_all
+static size_t evacuate_slab(
+  region_t *region,
+  size_t index,
+  uintptr_t slab_offset,
+  const struct region_move *move,
+  size_t budget,
+  bool *pinned)
+{
+  struct cache *cache = &region->caches.cache[index];
+  const struct slab *slab = swizzle(region, slab_offset);
+  size_t moved = 0;
+
+  // park slab with the full slabs so that objects are not moved into it.
+  // released objects do not move it back as it has free objects already
+  move_slab(region, &cache->full_slabs, slab_offset);
+
+  for (size_t bit = 0; bit < cache->object_count && moved < budget; bit++) {
+    if (!(slab->used[bit / 64] & (1llu << (bit & 63))))
+      continue;
+    // the owner may allocate objects from other partial slabs
+    if (!cache->partial_slabs.list)
+      break;
+
+    const intptr_t object = (intptr_t)(slab->objects + bit * cache->aligned_size);
+    const intptr_t new_object = cache_alloc(region, index);
+    if (!new_object)
+      break;
+    memcpy(swizzle(region, new_object), swizzle(region, object), cache->object_size);
+    mark_pages(region, (uintptr_t)new_object, cache->object_size);
+    if (move->move(region, object, new_object, cache->object_size, move->arg) != 0) {
+      cache_free(region, index, new_object);
+      *pinned = true;
+      break;
+    }
+
+    region_trace(&region->mapping, REGION_TRACE_CACHE_ALLOC,
+                 (uint64_t)new_object, cache->object_size, (intptr_t)index);
+    region_trace(&region->mapping, REGION_TRACE_CACHE_FREE,
+                 (uint64_t)object, 0, (intptr_t)index);
+    moved++;
+    // slab is released with the last object
+    const bool last = slab->free_objects.count + 1 == cache->object_count;
+    cache_free(region, index, object);
+    if (last)
+      return moved;
+  }
+
+  // slab was not emptied, allow objects to be allocated from it again
+  move_slab(region, &cache->partial_slabs, slab_offset);
+  return moved;
+}
+
+size_t region_compact(region_t *region, size_t budget)
+{
+  assert(region);
+
+  // callbacks are registered with the region snapshots are taken of
+  const struct mapping *mapping = &region->mapping;
+  if (mapping->origin)
+    mapping = region_mapping(mapping->origin);
+  const struct region_move *moves = mapping->moves;
+  // slabs objects are loaded into are on no list
+  if (!moves || is_sealed(region) || region->caches.load)
+    return 0;
+
+  size_t moved = 0;
+  for (size_t index = 0; index < region->caches.count && moved < budget; index++) {
+    if (!moves[index].move)
+      continue;
+    struct cache *cache = &region->caches.cache[index];
+    bool pinned = false;
+    uintptr_t slab_offset;
+    while (!pinned && moved < budget &&
+           (slab_offset = evacuable_slab(region, cache)))
+      moved += evacuate_slab(
+        region, index, slab_offset, &moves[index], budget - moved, &pinned);
+  }
+
+  return moved;
 }
-#endif
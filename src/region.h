@@ -19,16 +19,20 @@
 // databases reside in mmaped regions. the region allocator is designed to
 // manage a single mmaped region to support copy-on-write regions. as
 // relative addressing is used to access objects, modified pages can be
-// copied back to persist changes. the region allocator cannot resize
-// the region and does not manage synchronization.
+// copied back to persist changes. the region allocator can grow the region
+// (it never shrinks) and does not manage synchronization.
 
 // in context:
 //   when a zone transfer comes in, mmap a copy-on-write (MAP_PRIVATE) region.
 //   the allocator is automatically cloned because the same physical pages are
-//   used. decide if the mapping must be larger initially. start applying
-//   changes, if it turns out the region is not sufficiently large enough,
-//   discard the changes, map a larger region and try again. as the allocator
-//   is embedded in the region, unmapping the region releases all resources.
+//   used. decide if the mapping must be larger initially (region_estimate).
+//   start applying changes, if it turns out the region is not sufficiently
+//   large enough, discard the changes, map a larger region and try again.
+//   as the allocator is embedded in the region, unmapping the region
+//   releases all resources. i.e. region_snapshot, apply changes,
+//   region_commit and region_abort, or region_abort and region_snapshot with
+//   a larger size on failure. to avoid replaying changes, region_grow the
+//   snapshot instead.
 
 //
 // * Bonwick, Jeff: "The Slab Allocator: An Object-Caching Kernel Memory
@@ -73,12 +77,23 @@ static always_inline intptr_t unswizzle(const region_t *region, void *pointer)
 // * require a minimum size of sizeof(region_t)
 // * require a page-aligened address
 // * require at least ... pages for caches
+// * memory is not owned by the allocator, map memory aligned on a 2 MiB
+//   boundary and madvise MADV_HUGEPAGE (or back it by hugetlbfs) for huge
+//   pages
 region_t *region_init(void *address, size_t size);
 
 nonnull((1))
 warn_unused_result
 intptr_t region_alloc(region_t *region, size_t size);
 
+// allocate an object of size close to the object at hint, e.g. a node
+// close to its parent so that a lookup touches fewer pages. the slab hint
+// belongs to is tried first, slabs on neighbouring pages next. falls back
+// to region_alloc if none of those have room, or if the object is large.
+nonnull((1))
+warn_unused_result
+intptr_t region_alloc_near(region_t *region, size_t size, intptr_t hint);
+
 // kmem_free requires size to be specified, see:
 // https://docs.oracle.com/cd/E36784_01/html/E36886/kmem-free-9f.html
 // nsd does to, see:
@@ -86,14 +101,241 @@ intptr_t region_alloc(region_t *region, size_t size);
 nonnull((1))
 void region_free(region_t *region, intptr_t object);
 
-#if 0
+// allocate count objects of size in one go, objects are stored in objects.
+// small objects are taken from slabs a free list at a time. returns the
+// number of objects allocated, which is less than count if the region is
+// exhausted.
+nonnull((1))
+warn_unused_result
+size_t region_alloc_bulk(
+  region_t *region, size_t size, size_t count, intptr_t *objects);
+
+// release count objects. consecutive objects that belong to the same slab
+// are released before the slab is updated, release objects in the order
+// they were allocated (or sorted) for best performance.
+nonnull((1))
+void region_free_bulk(region_t *region, const intptr_t *objects, size_t count);
+
+// load mode for filling a region in one go, e.g. on a full zone transfer.
+// small objects are handed out in order from fresh slabs by bumping a
+// pointer, objects are not taken from free lists and slabs are not moved
+// between lists. objects can be released, but load mode is meant for
+// workloads that release few objects, if any, releasing an object closes
+// the slab it belongs to for loading. load mode ends with region_seal.
+nonnull_all
+void region_load(region_t *region);
+
+// end load mode. slabs that were being loaded are turned into regular
+// slabs, free lists are created for the objects that were not handed out.
+// snapshots are sealed on commit and regions are sealed on publication.
+// not to be confused with the seals applied by region_publish.
+nonnull_all
+void region_seal(region_t *region);
+
+// back region by transparent huge pages (madvise), requires shmem_enabled
+// in /sys/kernel/mm/transparent_hugepage to be advise (or always). the
+// region is aligned on a huge page boundary, falls back to regular pages
+// if transparent huge pages are not enabled.
+#define REGION_HUGE_PAGES (1u<<0)
+// back region by huge pages from the hugetlb pool (vm.nr_hugepages),
+// creating the region fails if the pool holds insufficient pages.
+// snapshots take copies of modified huge pages.
+#define REGION_HUGETLB (1u<<1)
+// interleave pages across the NUMA nodes the process may allocate memory
+// from, page by page. spreads memory bandwidth and latency evenly for
+// regions that are read by threads on every node.
+#define REGION_NUMA_INTERLEAVE (1u<<2)
+// bind pages to the NUMA node specified with REGION_NUMA_NODE, e.g.
+// REGION_NUMA_BIND | REGION_NUMA_NODE(1). creating the region fails if the
+// node does not exist. snapshots and regions that grow are placed likewise.
+// pages of regions created without either flag are allocated on the node
+// of the thread that first touches them (first touch), i.e. the region is
+// local to the node the loader thread runs on.
+#define REGION_NUMA_BIND (1u<<3)
+#define REGION_NUMA_NODE(node) (((uint32_t)(node) & 0xffu) << 24)
+
+// create a region in shared memory owned by the library. regions must be
+// created by region_create for snapshots to be taken. specify 0 for flags
+// to use regular pages. regions backed by huge pages are sized in multiples
+// of 2 MiB and return memory to the operating system a huge page at a time.
+warn_unused_result
+region_t *region_create(size_t size, uint32_t flags);
+
+nonnull_all
+void region_destroy(region_t *region);
+
+// adopt a region previously initialized at (a mapping of) the same memory,
+// e.g. a region mapped from a file. the region header (magic, version and
+// page size) and the bookkeeping are validated, the contents of objects
+// are not. the administration of regions mapped from a file is
+// checksummed on commit and verified before the bookkeeping is, unless
+// the region was updated in place since. size is the size of the memory,
+// which may exceed the size of the region. returns NULL if memory does not
+// hold a valid region. contract as region_init, memory is not owned by the
+// allocator.
+warn_unused_result
+region_t *region_open(void *address, size_t size);
+
+// map region from a file. the region is created with size if the file is
+// empty (or does not exist) and is opened with region_open otherwise,
+// which takes time proportional to the number of pages (bitmaps are
+// scanned), not objects. snapshots are committed by writing back updated
+// pages, then the administration, with a barrier (fdatasync) in between
+// and after. updates are ordered, not atomic, a region that was being
+// committed when the system crashed may fail to open. changes applied to
+// the region itself must be marked with region_dirty. REGION_HUGETLB is
+// not supported.
+nonnull_all
+warn_unused_result
+region_t *region_map_file(const char *path, size_t size, uint32_t flags);
+
+// share a finished region with other processes without copying it. the
+// shared memory object backing the region is sealed (F_SEAL_WRITE,
+// F_SEAL_GROW and F_SEAL_SHRINK) and the region becomes read-only, it can
+// no longer be updated, grown or snapshotted. allocations fail and objects
+// that are released are left alone. returns a new file descriptor
+// for the shared memory object to be passed to other processes, e.g. over
+// a unix socket (SCM_RIGHTS), -1 on failure. only regions created with
+// region_create can be published, REGION_HUGETLB is not supported.
+// publishing fails if the region has outstanding snapshots.
+nonnull_all
+warn_unused_result
+int region_publish(region_t *region);
+
+// map a published region read-only. pages are shared by all processes that
+// attach to the region, except for the first page that holds process local
+// information and the index of free pages, which is rebuilt. the region
+// takes ownership of fd on success, destroy the region with region_destroy.
+// returns NULL if fd is not sealed or does not hold a valid region.
+warn_unused_result
+region_t *region_attach(int fd);
+
+// copies of a published region, one per NUMA node, so that readers do not
+// pay for cross-node accesses. replicas are sealed (see region_publish)
+// and bound to their node, offsets are valid for every replica. take
+// replicas once a version is final, i.e. commit, publish, replicate.
+typedef struct region_replicas region_replicas_t;
+
+// copy published region to every NUMA node the process may allocate memory
+// from. only pages in use are copied. returns NULL if region is not
+// published or on failure.
+nonnull_all
+warn_unused_result
+region_replicas_t *region_replicate(region_t *region);
+
+// destroy replicas, the region replicas were taken of is not destroyed.
+nonnull_all
+void region_replicas_destroy(region_replicas_t *replicas);
+
+// replica local to the node the calling thread runs on. returns the region
+// replicas were taken of if the node holds no replica.
+nonnull_all
+region_t *region_replica(const region_replicas_t *replicas);
+
+// pages of regions mapped from a file are checksummed on commit. pages a
+// range of objects resides in are verified on first use rather than when
+// the region is opened. pages updated since the last commit cannot be
+// verified and pass. returns 0 on success, -1 if a page is corrupt or the
+// range is out of bounds.
+nonnull_all
+warn_unused_result
+int region_verify(region_t *region, intptr_t object, size_t size);
+
+// pages that are updated are tracked so that a copy-on-write copy can be
+// committed by copying back only the pages that were actually modified.
+// objects are considered modified on allocation, modifications to existing
+// objects must be marked explicitly.
+nonnull((1))
+void region_dirty(region_t *region, intptr_t object, size_t size);
+
+// create a private copy-on-write view of region. pages are shared with the
+// region until updated. the snapshot may be larger than the region if the
+// changes to be applied are expected to require more space, specify 0 to
+// match the size of the region. allocations in a snapshot prefer slabs and
+// pages that were updated in the snapshot to limit the number of pages
+// copied.
+nonnull_all
+warn_unused_result
+region_t *region_snapshot(region_t *region, size_t size);
+
+// publish changes in snapshot to the region it was taken from by copying
+// back updated pages. the region is extended if the snapshot is larger,
+// which may move it if no other snapshots of the region are outstanding
+// (commit fails if the region cannot be extended in place otherwise).
+// returns the region on success, NULL on failure. the
+// snapshot remains valid and in sync with the region until it is dropped.
+// commit fails for regions mapped from a file if updates cannot be written
+// to the file, the region is updated in memory regardless.
+nonnull_all
+warn_unused_result
+region_t *region_commit(region_t *snapshot);
+
+// grow region (or snapshot) to size without discarding changes. the shared
+// memory object is extended and the pages that are added are mapped right
+// after the region if possible, the region is remapped otherwise, which
+// moves it. as relative addressing is used, offsets remain valid. snapshots
+// reference the region they were taken of, a region with outstanding
+// snapshots is only grown in place and growing fails if it would have to
+// move. returns the region on success, NULL on failure.
+nonnull_all
+warn_unused_result
+region_t *region_grow(region_t *region, size_t size);
+
+// drop snapshot and any changes not committed.
+nonnull_all
+void region_abort(region_t *snapshot);
+
+// commit snapshots of regions mapped from a file without waiting for the
+// updates to reach stable storage. a writer thread writes updated pages
+// from the snapshot to the file (io_uring, or pwritev if unavailable), then
+// the administration, with a barrier in between and after. full pages are
+// written, pages of the file are not faulted in or read. commits are
+// processed in order.
+typedef struct region_writer region_writer_t;
+
+// invoked on the writer thread once the commit is done. region is the
+// region the snapshot was committed to, which may have moved. result is 0
+// on success, -1 if updates could not be written to the file, the region
+// is updated in memory regardless.
+typedef void (*region_written_t)(
+  region_t *region, region_t *snapshot, int result, void *arg);
+
+warn_unused_result
+region_writer_t *region_writer_create(void);
+
+// wait for outstanding commits and release the writer.
+nonnull_all
+void region_writer_destroy(region_writer_t *writer);
+
+// wait for outstanding commits.
+nonnull_all
+void region_writer_wait(region_writer_t *writer);
+
+// region_commit counterpart. the region is extended if need be before the
+// call returns, the snapshot must not be updated or dropped and the region
+// must not be updated, snapshotted, grown or committed until the callback
+// is invoked. objects in the region can be read meanwhile, pages are
+// updated as they are written. snapshots of regions that are not mapped
+// from a file are committed right away and the callback is invoked before
+// the call returns. returns 0 on success, -1 if the snapshot cannot be
+// committed, the callback is not invoked in that case.
+nonnull((1,2))
+warn_unused_result
+int region_commit_async(
+  region_writer_t *writer,
+  region_t *snapshot,
+  region_written_t callback,
+  void *arg);
+
 // a given cache is valid inside a given region and can only be used in
 // conjunction with that region, never without. the maximum number of caches
 // is hard coded because space is reserved in the region. the returned value
-// is an identifier for the cache.
-//
-// * constructor/destruction interfaces may prove to be unnecessary
-// * move interface in the second paper is likely useful
+// is an identifier for the cache, -1 if the cache cannot be created. caches
+// are identified by name (truncated to 15 characters), creating a cache
+// that exists returns the existing identifier if object size and alignment
+// match. alignment must be a power of two, a multiple of 8 and no larger
+// than a page (4096), specify 0 for the default (8). slabs span 1 to 16
+// pages depending on object size, objects must fit in a slab of 16 pages.
 //
 // caches for nsd_region_cache_alloc (5):
 // * node4, takes 48 bytes   (16 + 4 + (4*8), keys fit cache)
@@ -102,26 +344,440 @@ void region_free(region_t *region, intptr_t object);
 // * node48
 // * node256, takes more than 2k.
 //
-nonnull((1))
+nonnull((1,2))
+warn_unused_result
 intptr_t region_cache_create(
+  region_t *region,
+  const char *name,
+  size_t object_size,
+  size_t object_align);
+
+// object caching (Bonwick). objects in caches created with a constructor
+// are constructed when the slab is created and retain their constructed
+// state while free, i.e. objects are allocated in the state they were
+// released in. objects must be returned to their constructed state before
+// they are released. the destructor is invoked for every object when the
+// slab is returned to the region. constructor and destructor must not
+// allocate or release objects. objects take 8 bytes more as the free list
+// is linked past the object. like move callbacks, constructors are process
+// local and are shared with snapshots, create the cache again to register
+// them after a region is opened. creating a cache that exists fails if it
+// was created without a constructor or vice versa.
+typedef void (*region_ctor_t)(region_t *region, intptr_t object, void *arg);
+typedef void (*region_dtor_t)(region_t *region, intptr_t object, void *arg);
+
+nonnull((1,2,5))
+warn_unused_result
+intptr_t region_cache_create_ctor(
   region_t *region,
   const char *name,
   size_t object_size,
   size_t object_align,
-  void(*constructor)(void *, size_t),
-  void(*destructor)(void *, size_t));
+  region_ctor_t ctor,
+  region_dtor_t dtor,
+  void *arg);
 
 nonnull((1))
-void region_cache_destroy(
+warn_unused_result
+intptr_t region_cache_alloc(
   region_t *region, intptr_t cache);
 
+// allocate an object from cache close to the object at hint, see
+// region_alloc_near. hint need not be allocated from the same cache.
 nonnull((1))
-intptr_t region_cache_alloc(
-  region_t *region, intptr_t cache);
+warn_unused_result
+intptr_t region_cache_alloc_near(
+  region_t *region, intptr_t cache, intptr_t hint);
 
+// allocate count objects from cache in one go, see region_alloc_bulk.
+// release objects with region_free_bulk. returns the number of objects
+// allocated, 0 if the cache does not exist.
+nonnull((1))
+warn_unused_result
+size_t region_cache_alloc_bulk(
+  region_t *region, intptr_t cache, size_t count, intptr_t *objects);
+
+// number of free slabs a cache retains, two by default. surplus slabs are
+// returned to the region as soon as they become free so that the pages can
+// be used by other caches or the heap, and the memory backing them is
+// released if the region is created by region_create. returns 0 on success,
+// -1 if the cache does not exist.
+nonnull((1))
+int region_cache_retain(
+  region_t *region, intptr_t cache, size_t slabs);
+
+// object must have been allocated from cache, objects that were not (and
+// caches that do not exist) are ignored. objects allocated from a cache
+// may be released with region_free too.
 nonnull((1))
 void region_cache_free(
   region_t *region, intptr_t cache, intptr_t object);
+
+// compact references for regions bounded in size, e.g. for fan-out arrays
+// in tree nodes. a reference is the offset of an object shifted right by
+// REGION_REF32_SHIFT bits. objects are aligned on at least 8 bytes, define
+// REGION_REF32_SHIFT as 3 to address up to 32 GiB rather than 4 GiB. 0 is
+// the null reference. allocation functions that return a reference fail if
+// the object does not fit a reference, the object is released then.
+#if !defined(REGION_REF32_SHIFT)
+# define REGION_REF32_SHIFT (0)
 #endif
 
+_Static_assert(REGION_REF32_SHIFT >= 0 && REGION_REF32_SHIFT <= 3,
+               "objects are aligned on 8 bytes");
+
+typedef uint32_t region_ref32_t;
+
+// largest offset that can be referenced
+#define REGION_REF32_MAX ((uintptr_t)UINT32_MAX << REGION_REF32_SHIFT)
+
+static always_inline bool is_ref32(intptr_t object)
+{
+  return (uintptr_t)object <= REGION_REF32_MAX &&
+         !((uintptr_t)object & ((1u << REGION_REF32_SHIFT) - 1));
+}
+
+static always_inline region_ref32_t region_ref32(intptr_t object)
+{
+  assert(is_ref32(object));
+  return (region_ref32_t)((uintptr_t)object >> REGION_REF32_SHIFT);
+}
+
+static always_inline intptr_t region_unref32(region_ref32_t ref)
+{
+  return (intptr_t)((uintptr_t)ref << REGION_REF32_SHIFT);
+}
+
+nonnull((1))
+static always_inline void *swizzle32(const region_t *region, region_ref32_t ref)
+{
+  return swizzle(region, region_unref32(ref));
+}
+
+nonnull((1))
+static always_inline region_ref32_t unswizzle32(
+  const region_t *region, void *pointer)
+{
+  return region_ref32(unswizzle(region, pointer));
+}
+
+nonnull((1))
+warn_unused_result
+static always_inline region_ref32_t region_alloc32(
+  region_t *region, size_t size)
+{
+  const intptr_t object = region_alloc(region, size);
+  if (likely(is_ref32(object)))
+    return region_ref32(object);
+  region_free(region, object);
+  return 0;
+}
+
+nonnull((1))
+warn_unused_result
+static always_inline region_ref32_t region_cache_alloc32(
+  region_t *region, intptr_t cache)
+{
+  const intptr_t object = region_cache_alloc(region, cache);
+  if (likely(is_ref32(object)))
+    return region_ref32(object);
+  region_cache_free(region, cache, object);
+  return 0;
+}
+
+nonnull((1))
+static always_inline void region_free32(region_t *region, region_ref32_t ref)
+{
+  region_free(region, region_unref32(ref));
+}
+
+nonnull((1))
+static always_inline void region_cache_free32(
+  region_t *region, intptr_t cache, region_ref32_t ref)
+{
+  region_cache_free(region, cache, region_unref32(ref));
+}
+
+// objects can be relocated to consolidate sparsely populated slabs (move
+// interface, Bonwick & Adams). the callback is invoked after the object is
+// copied to new_object, the owner updates references to the object (and
+// marks them updated with region_dirty) and returns 0, or returns -1 if
+// the object cannot be moved at this time, the copy is released then. the
+// callback may allocate and release objects, but must not release object.
+typedef int (*region_move_t)(
+  region_t *region, intptr_t object, intptr_t new_object, size_t size,
+  void *arg);
+
+// register a move callback for cache, specify NULL to unregister. callbacks
+// are process local, registered with the region snapshots are taken of
+// and apply to both. returns 0 on success, -1 if the cache does not exist
+// or on failure.
+nonnull((1))
+int region_cache_move(
+  region_t *region, intptr_t cache, region_move_t move, void *arg);
+
+// move up to budget objects out of the least occupied partial slabs of
+// caches with a move callback into other partial slabs. slabs are only
+// evacuated if the other partial slabs can hold the objects, slabs that
+// are emptied are returned to the region (surplus to retained free slabs,
+// see region_cache_retain). compaction is incremental, the region is
+// consistent between calls. returns the number of objects moved, 0 if
+// there is nothing to compact (or objects cannot be moved at this time).
+// regions in load mode (see region_load) are not compacted.
+nonnull((1))
+size_t region_compact(region_t *region, size_t budget);
+
+// statistics are maintained by the allocator and can be read by other
+// threads (or processes that map the region) while the region is updated.
+// counters are read individually, i.e. a snapshot is not atomic as a whole
+// and counters may be slightly out of sync with each other. counts of
+// allocations and releases are cumulative, objects cached in magazines are
+// allocated as far as the region is concerned.
+struct region_stats {
+  /** Size of the region in bytes. */
+  size_t size;
+  /** Number of pages in the region. */
+  size_t pages;
+  /** Number of pages reserved for region administration and bitmaps. */
+  size_t admin_pages;
+  /** Number of pages allocated to caches. */
+  size_t cache_pages;
+  /** Number of pages allocated to the heap. */
+  size_t heap_pages;
+  /** Number of pages available to caches and the heap. */
+  size_t free_pages;
+  /** Number of pages updated since the last commit. */
+  size_t dirty_pages;
+  /** Number of objects allocated from and released to caches. */
+  uint64_t cache_allocs;
+  uint64_t cache_frees;
+  /** Number of large objects allocated from and released to the heap. */
+  uint64_t heap_allocs;
+  uint64_t heap_frees;
+  /** Number of bytes requested from and handed out by the heap. */
+  uint64_t heap_requested;
+  uint64_t heap_allocated;
+  /** Number of bytes in heap blocks in use (including tags). */
+  uint64_t heap_in_use;
+  /** Number of bytes in free heap blocks and the number of free blocks. */
+  uint64_t heap_free;
+  uint64_t heap_free_blocks;
+  /** Lower bound (power of two) of the largest free heap block. */
+  uint64_t heap_largest_free;
+};
+
+struct region_cache_stats {
+  char name[16];
+  size_t object_size;
+  size_t alignment;
+  /** Object size including padding for alignment. */
+  size_t aligned_size;
+  size_t slab_pages;
+  /** Number of objects per slab. */
+  size_t slab_objects;
+  size_t full_slabs;
+  size_t partial_slabs;
+  size_t free_slabs;
+  uint64_t allocs;
+  uint64_t frees;
+  /** Number of objects in use (allocs - frees). */
+  uint64_t in_use;
+  uint64_t slabs_created;
+  /** Number of slabs returned to the region. */
+  uint64_t slabs_released;
+  /** Number of bytes requested and handed out (aligned size). */
+  uint64_t requested;
+  uint64_t allocated;
+};
+
+// heap fragmentation can be estimated from the ratio of the largest free
+// block to free space, internal fragmentation from the ratio of bytes
+// requested to bytes handed out.
+nonnull_all
+void region_stats(const region_t *region, struct region_stats *stats);
+
+// returns 0 on success, -1 if the cache does not exist.
+nonnull_all
+int region_cache_stats(
+  const region_t *region, intptr_t cache, struct region_cache_stats *stats);
+
+// recommended size of a snapshot to apply a transfer of records (resource
+// records) totalling octets to, i.e. region_snapshot(region, size). the
+// objects per cache and the heap memory (bytes allocated or pages taken,
+// whichever is more) of the transfer that was last committed are scaled
+// by records and octets, whichever requires more, slabs with free objects
+// and free pages are taken into account and a margin of 1/8 is added.
+// regions that never committed a transfer use 2 bytes per octet plus 64
+// bytes per record with a margin of 1/2. the transfer is recorded, the
+// statistics of the snapshot taken after are learned from on commit. pages
+// that are never touched cost no memory, only address space and
+// administration.
+nonnull_all
+size_t region_estimate(region_t *region, size_t octets, size_t records);
+
+// allocations and releases can be traced to capture (production) workloads
+// and replay them later, e.g. to tune size classes. tracing is compiled in
+// if REGION_TRACE is defined as 1 and has no cost otherwise. records are
+// written to a ring buffer per region, the oldest records are overwritten
+// if the buffer is not flushed in time. snapshots record to the ring buffer
+// of the region they are taken of, snapshot, commit and abort are recorded
+// too. a trace starts with a record of the region size and all caches.
+#define REGION_TRACE_START (0)
+#define REGION_TRACE_ALLOC (1)
+#define REGION_TRACE_FREE (2)
+#define REGION_TRACE_CACHE_CREATE (3)
+#define REGION_TRACE_CACHE_ALLOC (4)
+#define REGION_TRACE_CACHE_FREE (5)
+#define REGION_TRACE_SNAPSHOT (6)
+#define REGION_TRACE_COMMIT (7)
+#define REGION_TRACE_ABORT (8)
+#define REGION_TRACE_GROW (9)
+
+struct region_trace_record {
+  /** Nanoseconds since the trace was started. */
+  uint64_t time;
+  /** Object, alignment (cache create) or size (start, snapshot, grow). */
+  uint64_t offset;
+  /** Object size (if applicable). */
+  uint32_t size;
+  /** Cache identifier (if applicable). */
+  uint16_t cache;
+  uint16_t op;
+};
+
+// trace files are a sequence of chunks, one per flush. each chunk consists
+// of a header followed by count records in host byte order.
+#define REGION_TRACE_MAGIC "rgntrace"
+#define REGION_TRACE_VERSION (1)
+
+struct region_trace_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+  /** Number of records overwritten before the chunk was flushed. */
+  uint64_t dropped;
+};
+
+// start tracing with room for the given number of records. returns 0 on
+// success, -1 on failure, if region is a snapshot or if tracing is not
+// compiled in.
+nonnull_all
+int region_trace_start(region_t *region, size_t records);
+
+// write records to fd and empty the ring buffer (of the region a snapshot
+// was taken of for snapshots). returns 0 on success, -1 on failure.
+nonnull_all
+int region_trace_flush(region_t *region, int fd);
+
+// stop tracing and release the ring buffer, records not flushed are lost.
+// the region owns the ring buffer, stopping a snapshot has no effect.
+// snapshots must be dropped before the region is stopped.
+nonnull_all
+void region_trace_stop(region_t *region);
+
+// the region allocator does not manage synchronization. magazines allow
+// multiple threads to allocate from and release to the same region
+// concurrently. objects are cached per thread (Bonwick & Adams), the depot
+// exchanges full and empty magazines between threads and is the only layer
+// that interacts with the allocator, with a lock held. create one depot per
+// region and one set of magazines per thread. objects in magazines are
+// allocated as far as the region is concerned, destroy the magazines of all
+// threads and the depot before the region is committed, grown or destroyed.
+// caches must be created up front.
+typedef struct region_depot region_depot_t;
+typedef struct region_magazines region_magazines_t;
+
+// create depot for region with the given number of objects per magazine,
+// specify 0 for the default (64).
+nonnull_all
+warn_unused_result
+region_depot_t *region_depot_create(region_t *region, size_t rounds);
+
+// return cached objects to the region and release the depot.
+nonnull_all
+void region_depot_destroy(region_depot_t *depot);
+
+nonnull_all
+warn_unused_result
+region_magazines_t *region_magazines_create(region_depot_t *depot);
+
+// return cached objects to the region and release the magazines.
+nonnull_all
+void region_magazines_destroy(region_magazines_t *magazines);
+
+// region_alloc and region_free counterparts, size is required on release to
+// find the cache without consulting the region. large objects are not
+// cached, these are allocated and released with the depot lock held.
+nonnull_all
+warn_unused_result
+intptr_t region_magazine_alloc(region_magazines_t *magazines, size_t size);
+
+nonnull((1))
+void region_magazine_free(
+  region_magazines_t *magazines, intptr_t object, size_t size);
+
+// region_cache_alloc and region_cache_free counterparts.
+nonnull_all
+warn_unused_result
+intptr_t region_magazine_cache_alloc(
+  region_magazines_t *magazines, intptr_t cache);
+
+nonnull((1))
+void region_magazine_cache_free(
+  region_magazines_t *magazines, intptr_t cache, intptr_t object);
+
+// readers can keep reading the current version of a region while a writer
+// applies changes to a snapshot and commits it (epoch based reclamation).
+// readers never take a lock and only write a cache line of their own. the
+// writer publishes the snapshot while updated pages are copied back to the
+// region and publishes the region again once the commit is done, waiting
+// for readers of the previous version to leave each time. the snapshot is
+// dropped once the last reader has left. readers must not hold a version
+// across read sections, read sections cannot be nested and keep the writer
+// waiting, so keep them short. a single writer is supported.
+typedef struct region_readers region_readers_t;
+typedef struct region_reader region_reader_t;
+
+// create administration for up to the given number of readers of region.
+nonnull_all
+warn_unused_result
+region_readers_t *region_readers_create(region_t *region, size_t readers);
+
+// readers must be destroyed first, the current region is not destroyed.
+nonnull_all
+void region_readers_destroy(region_readers_t *readers);
+
+// register a reader (typically one per thread), returns NULL if the
+// maximum number of readers is registered.
+nonnull_all
+warn_unused_result
+region_reader_t *region_reader_create(region_readers_t *readers);
+
+nonnull_all
+void region_reader_destroy(region_reader_t *reader);
+
+// enter read section, the version returned is valid until the section is
+// left. offsets are valid for every version.
+nonnull_all
+region_t *region_read_begin(region_reader_t *reader);
+
+nonnull_all
+void region_read_end(region_reader_t *reader);
+
+// version readers currently use.
+nonnull_all
+region_t *region_readers_current(const region_readers_t *readers);
+
+// wait until readers that may have observed a previous version left.
+nonnull_all
+void region_synchronize(region_readers_t *readers);
+
+// commit snapshot of the current version without disturbing readers, see
+// above. returns the region on success (which may have moved, see
+// region_grow). returns NULL on failure, readers use the region then and
+// the snapshot is retained.
+nonnull_all
+warn_unused_result
+region_t *region_readers_commit(region_readers_t *readers, region_t *snapshot);
+
 #endif // REGION_H
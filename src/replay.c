@@ -0,0 +1,399 @@
+/*
+ * replay.c - replay allocation traces
+ *
+ * Copyright (c) 2024, NLnet Labs. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "region.h"
+
+// replay drives a fresh region with a trace recorded by region_trace_start.
+// replays are deterministic, records are applied in order and timestamps
+// are ignored. the trace is replayed twice, once to measure time and once
+// to sample statistics after every record, so that sampling does not skew
+// the measurement. offsets in the trace are translated to offsets in the
+// region the trace is replayed to.
+
+static void error(const char *message)
+{
+  fprintf(stderr, "%s\n", message);
+  exit(1);
+}
+
+static uint64_t now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000llu + (uint64_t)ts.tv_nsec;
+}
+
+// recorded offset to replayed offset, open addressing with linear probing
+struct entry {
+  uint64_t key;
+  intptr_t object;
+};
+
+struct table {
+  struct entry *entries;
+  size_t count;
+  size_t size;
+};
+
+static always_inline size_t hash(uint64_t key, size_t size)
+{
+  // offsets are multiples of 8, fibonacci hashing spreads them
+  return (size_t)((key * 11400714819323198485llu) >> 32) & (size - 1);
+}
+
+static void resize_table(struct table *table, size_t size)
+{
+  struct entry *entries = calloc(size, sizeof(*entries));
+  if (!entries)
+    error("cannot allocate table");
+  for (size_t index = 0; index < table->size; index++) {
+    const struct entry *entry = &table->entries[index];
+    if (!entry->key)
+      continue;
+    size_t slot = hash(entry->key, size);
+    while (entries[slot].key)
+      slot = (slot + 1) & (size - 1);
+    entries[slot] = *entry;
+  }
+  free(table->entries);
+  table->entries = entries;
+  table->size = size;
+}
+
+static void insert(struct table *table, uint64_t key, intptr_t object)
+{
+  assert(key);
+  if ((table->count + 1) * 4 > table->size * 3)
+    resize_table(table, table->size ? table->size * 2 : 1024);
+  size_t slot = hash(key, table->size);
+  while (table->entries[slot].key && table->entries[slot].key != key)
+    slot = (slot + 1) & (table->size - 1);
+  if (!table->entries[slot].key)
+    table->count++;
+  table->entries[slot].key = key;
+  table->entries[slot].object = object;
+}
+
+// remove key, returns the replayed offset or 0 if key is not in the table
+static intptr_t remove_key(struct table *table, uint64_t key)
+{
+  if (!table->count)
+    return 0;
+  size_t slot = hash(key, table->size);
+  while (table->entries[slot].key != key) {
+    if (!table->entries[slot].key)
+      return 0;
+    slot = (slot + 1) & (table->size - 1);
+  }
+
+  const intptr_t object = table->entries[slot].object;
+  table->count--;
+  // shift entries back so that probe sequences remain intact
+  size_t hole = slot;
+  for (size_t next = (slot + 1) & (table->size - 1);
+       table->entries[next].key;
+       next = (next + 1) & (table->size - 1))
+  {
+    const size_t home = hash(table->entries[next].key, table->size);
+    // entry stays if its home lies cyclically in (hole, next]
+    if (hole <= next ? (home > hole && home <= next) : (home > hole || home <= next))
+      continue;
+    table->entries[hole] = table->entries[next];
+    hole = next;
+  }
+  table->entries[hole].key = 0;
+  return object;
+}
+
+static void copy_table(struct table *copy, const struct table *table)
+{
+  free(copy->entries);
+  copy->entries = NULL;
+  copy->count = table->count;
+  copy->size = table->size;
+  if (!table->size)
+    return;
+  if (!(copy->entries = malloc(table->size * sizeof(*table->entries))))
+    error("cannot allocate table");
+  memcpy(copy->entries, table->entries, table->size * sizeof(*table->entries));
+}
+
+struct trace {
+  struct region_trace_record *records;
+  size_t count;
+  uint64_t dropped;
+};
+
+static void load_trace(struct trace *trace, const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    error("cannot open trace");
+
+  size_t size = 0;
+  struct region_trace_header header;
+  memset(trace, 0, sizeof(*trace));
+  while (fread(&header, sizeof(header), 1, file) == 1) {
+    if (memcmp(header.magic, REGION_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != REGION_TRACE_VERSION)
+      error("invalid trace");
+    if (trace->count + header.count > size) {
+      size = (trace->count + header.count) * 2;
+      trace->records = realloc(trace->records, size * sizeof(*trace->records));
+      if (!trace->records)
+        error("cannot allocate records");
+    }
+    if (fread(trace->records + trace->count, sizeof(*trace->records),
+              header.count, file) != header.count)
+      error("truncated trace");
+    trace->count += header.count;
+    trace->dropped += header.dropped;
+  }
+  if (!feof(file))
+    error("cannot read trace");
+  fclose(file);
+}
+
+struct replay {
+  region_t *region;
+  region_t *snapshot;
+  struct table objects;
+  // objects at the time the snapshot was taken, restored on abort
+  struct table saved;
+  intptr_t caches[1u << 16];
+  // records that could not be replayed (unknown objects and caches or
+  // allocations that failed)
+  size_t skipped;
+};
+
+// recorded caches are mapped to caches in the region, caches created
+// with every region exist under the same identifier
+static void create_cache(
+  struct replay *replay, const struct region_trace_record *record)
+{
+  region_t *region = replay->snapshot ? replay->snapshot : replay->region;
+  struct region_cache_stats stats;
+  if (region_cache_stats(region, record->cache, &stats) == 0 &&
+      stats.object_size == record->size && stats.alignment == record->offset)
+  {
+    replay->caches[record->cache] = record->cache;
+    return;
+  }
+
+  char name[16];
+  snprintf(name, sizeof(name), "replay-%u", (unsigned)record->cache);
+  const intptr_t cache =
+    region_cache_create(region, name, record->size, (size_t)record->offset);
+  if (cache == -1)
+    replay->skipped++;
+  replay->caches[record->cache] = cache;
+}
+
+static void replay_record(
+  struct replay *replay, const struct region_trace_record *record)
+{
+  region_t *region = replay->snapshot ? replay->snapshot : replay->region;
+  intptr_t object, cache;
+
+  switch (record->op) {
+    case REGION_TRACE_START:
+      break;
+    case REGION_TRACE_ALLOC:
+      object = region_alloc(region, record->size);
+      if (!object) {
+        replay->skipped += record->offset != 0;
+        break;
+      }
+      if (record->offset)
+        insert(&replay->objects, record->offset, object);
+      else
+        region_free(region, object);
+      break;
+    case REGION_TRACE_FREE:
+      if ((object = remove_key(&replay->objects, record->offset)))
+        region_free(region, object);
+      else
+        replay->skipped++;
+      break;
+    case REGION_TRACE_CACHE_CREATE:
+      create_cache(replay, record);
+      break;
+    case REGION_TRACE_CACHE_ALLOC:
+      if ((cache = replay->caches[record->cache]) == -1) {
+        replay->skipped++;
+        break;
+      }
+      object = region_cache_alloc(region, cache);
+      if (!object) {
+        replay->skipped += record->offset != 0;
+        break;
+      }
+      if (record->offset)
+        insert(&replay->objects, record->offset, object);
+      else
+        region_cache_free(region, cache, object);
+      break;
+    case REGION_TRACE_CACHE_FREE:
+      cache = replay->caches[record->cache];
+      if (cache != -1 && (object = remove_key(&replay->objects, record->offset)))
+        region_cache_free(region, cache, object);
+      else
+        replay->skipped++;
+      break;
+    case REGION_TRACE_SNAPSHOT:
+      // one snapshot at a time, records apply to the snapshot meanwhile
+      if (replay->snapshot)
+        error("cannot replay concurrent snapshots");
+      if (!(replay->snapshot = region_snapshot(replay->region, (size_t)record->offset)))
+        error("cannot take snapshot");
+      copy_table(&replay->saved, &replay->objects);
+      break;
+    case REGION_TRACE_COMMIT:
+      if (!replay->snapshot)
+        error("cannot commit without snapshot");
+      if (!(replay->region = region_commit(replay->snapshot)))
+        error("cannot commit snapshot");
+      copy_table(&replay->saved, &replay->objects);
+      break;
+    case REGION_TRACE_ABORT:
+      if (!replay->snapshot)
+        error("cannot abort without snapshot");
+      region_abort(replay->snapshot);
+      replay->snapshot = NULL;
+      copy_table(&replay->objects, &replay->saved);
+      break;
+    case REGION_TRACE_GROW:
+      if (!(region = region_grow(region, (size_t)record->offset)))
+        error("cannot grow region");
+      if (replay->snapshot)
+        replay->snapshot = region;
+      else
+        replay->region = region;
+      break;
+    default:
+      error("invalid record");
+  }
+}
+
+static void start_replay(
+  struct replay *replay, const struct trace *trace, size_t size)
+{
+  memset(replay, 0, sizeof(*replay));
+  for (size_t index = 0; index < sizeof(replay->caches) / sizeof(replay->caches[0]); index++)
+    replay->caches[index] = -1;
+
+  // replay to a region of the recorded size unless specified
+  if (!size && trace->count && trace->records[0].op == REGION_TRACE_START)
+    size = (size_t)trace->records[0].offset;
+  if (!size)
+    error("region size unknown, specify with -s");
+  if (!(replay->region = region_create(size, 0)))
+    error("cannot create region");
+}
+
+static void stop_replay(struct replay *replay)
+{
+  if (replay->snapshot)
+    region_abort(replay->snapshot);
+  region_destroy(replay->region);
+  free(replay->objects.entries);
+  free(replay->saved.entries);
+}
+
+static void print_stats(const char *what, const struct region_stats *stats)
+{
+  const uint64_t free_bytes = stats->heap_free;
+  // fraction of free heap space not in the largest (lower bound) block
+  const double fragmentation = free_bytes && stats->heap_largest_free <= free_bytes
+    ? 1.0 - (double)stats->heap_largest_free / (double)free_bytes : 0.0;
+  printf("%s: pages %zu (cache %zu, heap %zu, free %zu), heap free %llu bytes "
+         "in %llu blocks, heap fragmentation %.3f\n",
+         what, stats->cache_pages + stats->heap_pages, stats->cache_pages,
+         stats->heap_pages, stats->free_pages,
+         (unsigned long long)stats->heap_free,
+         (unsigned long long)stats->heap_free_blocks, fragmentation);
+}
+
+static void usage(const char *program)
+{
+  fprintf(stderr, "usage: %s [-s region-size-mb] trace\n", program);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  size_t size = 0;
+  int option;
+
+  while ((option = getopt(argc, argv, "s:h")) != -1) {
+    switch (option) {
+      case 's':
+        size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (optind + 1 != argc)
+    usage(argv[0]);
+
+  struct trace trace;
+  load_trace(&trace, argv[optind]);
+
+  static struct replay replay;
+  start_replay(&replay, &trace, size);
+  const uint64_t start = now();
+  for (size_t index = 0; index < trace.count; index++)
+    replay_record(&replay, &trace.records[index]);
+  const uint64_t elapsed = now() - start;
+  stop_replay(&replay);
+
+  // replay again to sample statistics after every record
+  struct region_stats stats, peak = { 0 };
+  start_replay(&replay, &trace, size);
+  for (size_t index = 0; index < trace.count; index++) {
+    replay_record(&replay, &trace.records[index]);
+    region_stats(replay.snapshot ? replay.snapshot : replay.region, &stats);
+    if (stats.cache_pages + stats.heap_pages > peak.cache_pages + peak.heap_pages)
+      peak = stats;
+  }
+
+  printf("records %zu (dropped %llu, skipped %zu), replayed in %.3f ms "
+         "(%.1f ns per record)\n",
+         trace.count, (unsigned long long)trace.dropped, replay.skipped,
+         (double)elapsed / 1e6,
+         trace.count ? (double)elapsed / (double)trace.count : 0.0);
+  print_stats("peak", &peak);
+  print_stats("final", &stats);
+
+  region_t *region = replay.snapshot ? replay.snapshot : replay.region;
+  struct region_cache_stats cache_stats;
+  for (intptr_t cache = 0; region_cache_stats(region, cache, &cache_stats) == 0; cache++) {
+    if (!cache_stats.allocs)
+      continue;
+    printf("cache %-15s slabs %zu/%zu/%zu (full/partial/free), objects %llu, "
+           "requested %llu of %llu bytes\n",
+           cache_stats.name, cache_stats.full_slabs, cache_stats.partial_slabs,
+           cache_stats.free_slabs, (unsigned long long)cache_stats.in_use,
+           (unsigned long long)cache_stats.requested,
+           (unsigned long long)cache_stats.allocated);
+  }
+
+  stop_replay(&replay);
+  free(trace.records);
+  return 0;
+}
@@ -0,0 +1,1332 @@
+/*
+ * test.c - region allocator regression tests
+ *
+ * Copyright (c) 2024, NLnet Labs. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "region.h"
+
+// tests exercise the public interface only and run in a few seconds. each
+// test aborts the run on the first failure. build with -fsanitize=thread
+// to check the magazine and reader tests for data races.
+
+#define MEGABYTE (1024llu * 1024llu)
+#define PAGE_SIZE (4096llu)
+
+static const char *running;
+
+#define check(condition) \
+  do { \
+    if (!(condition)) { \
+      fprintf(stderr, "%s: %s:%d: %s\n", running, __FILE__, __LINE__, \
+              #condition); \
+      exit(1); \
+    } \
+  } while (0)
+
+// xorshift, runs must be reproducible
+static always_inline uint64_t random64(uint64_t *seed)
+{
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 7;
+  *seed ^= *seed << 17;
+  return *seed;
+}
+
+// create a temporary file, tests remove the file once they are done
+static void temporary(char path[static 32])
+{
+  strcpy(path, "/tmp/region-test-XXXXXX");
+  int fd = mkstemp(path);
+  check(fd != -1);
+  close(fd);
+}
+
+static void flip(const char *path, size_t offset)
+{
+  int fd = open(path, O_RDWR);
+  check(fd != -1);
+  uint8_t octet;
+  check(pread(fd, &octet, 1, (off_t)offset) == 1);
+  octet ^= 0x10;
+  check(pwrite(fd, &octet, 1, (off_t)offset) == 1);
+  close(fd);
+}
+
+// commit an empty snapshot, the administration of regions mapped from a
+// file is checksummed on commit
+static region_t *checksummed(region_t *region)
+{
+  region_t *snapshot = region_snapshot(region, 0);
+  check(snapshot);
+  region = region_commit(snapshot);
+  check(region);
+  region_abort(snapshot);
+  return region;
+}
+
+// reopen region mapped from path, the administration must be intact
+static region_t *reopen(region_t *region, const char *path)
+{
+  region_destroy(region);
+  region = region_map_file(path, 0, 0);
+  check(region);
+  return region;
+}
+
+// snapshots share pages with the region they were taken of. a region with
+// outstanding snapshots is only grown in place so that snapshots can still
+// be committed and dropped
+static void test_snapshots(void)
+{
+  region_t *region = region_create(8 * MEGABYTE, 0);
+  check(region);
+  const intptr_t original = region_alloc(region, 64);
+  check(original);
+  strcpy(swizzle(region, original), "original");
+
+  region_t *snapshot = region_snapshot(region, 0);
+  check(snapshot);
+  const intptr_t added = region_alloc(snapshot, 64);
+  check(added);
+  strcpy(swizzle(snapshot, added), "added");
+  region_dirty(snapshot, original, 64);
+  strcpy(swizzle(snapshot, original), "updated");
+  check(strcmp(swizzle(region, original), "original") == 0);
+
+#if defined(MAP_FIXED_NOREPLACE)
+  // reserve the pages right after the region so that it cannot grow in
+  // place (the address range may be taken already)
+  const int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE;
+  void *blocked = mmap(
+    (uint8_t *)region + 8 * MEGABYTE, MEGABYTE, PROT_NONE, flags, -1, 0);
+#else
+  void *blocked = MAP_FAILED;
+#endif
+  region_t *grown = region_grow(region, 32 * MEGABYTE);
+  check(!grown || grown == region);
+  check(blocked == MAP_FAILED || !grown);
+
+  region = region_commit(snapshot);
+  check(region);
+  check(strcmp(swizzle(region, original), "updated") == 0);
+  check(strcmp(swizzle(region, added), "added") == 0);
+  region_abort(snapshot);
+
+  // without snapshots the region may move
+  grown = region_grow(region, 64 * MEGABYTE);
+  check(grown);
+  region = grown;
+  check(strcmp(swizzle(region, added), "added") == 0);
+  if (blocked != MAP_FAILED)
+    munmap(blocked, MEGABYTE);
+
+  // published regions cannot have snapshots outstanding
+  snapshot = region_snapshot(region, 0);
+  check(snapshot);
+  check(region_publish(region) == -1);
+  region_abort(snapshot);
+  region_destroy(region);
+}
+
+// snapshots larger than the region share the pages that back them, dropping
+// one must not release pages another snapshot still uses
+static void test_abort(void)
+{
+  region_t *region = region_create(MEGABYTE, 0);
+  check(region);
+  region_t *first = region_snapshot(region, 4 * MEGABYTE);
+  check(first);
+  region_t *second = region_snapshot(region, 4 * MEGABYTE);
+  check(second);
+  region_abort(second);
+
+  static intptr_t blocks[512];
+  for (size_t count = 0; count < 512; count++) {
+    check((blocks[count] = region_alloc(first, 4000)));
+    memset(swizzle(first, blocks[count]), 0xff, 4000);
+  }
+  region = region_commit(first);
+  check(region);
+  region_abort(first);
+
+  for (size_t count = 0; count < 512; count++) {
+    const uint8_t *octets = swizzle(region, blocks[count]);
+    check(octets[0] == 0xff && octets[3999] == 0xff);
+  }
+  struct region_stats stats;
+  region_stats(region, &stats);
+  check(stats.size >= 4 * MEGABYTE);
+  region_destroy(region);
+}
+
+// alignment is bounded by the page size
+static void test_alignment(void)
+{
+  region_t *region = region_create(16 * MEGABYTE, 0);
+  check(region);
+  check(region_cache_create(region, "page8k", 100, 2 * PAGE_SIZE) == -1);
+  check(region_cache_create(region, "page12", 100, 12) == -1);
+  const intptr_t cache = region_cache_create(region, "page", 100, PAGE_SIZE);
+  check(cache >= 0);
+  for (size_t count = 0; count < 64; count++) {
+    const intptr_t object = region_cache_alloc(region, cache);
+    check(object && object % PAGE_SIZE == 0);
+  }
+  region_destroy(region);
+}
+
+// small objects are allocated from the smallest of 13 size classes that
+// fits, at most a quarter of an object is wasted above 64 bytes
+static void test_size_classes(void)
+{
+  static const size_t classes[] = {
+    8, 16, 24, 32, 48, 64, 80, 96, 128, 160, 192, 224, 256 };
+  const size_t count = sizeof(classes) / sizeof(classes[0]);
+  region_t *region = region_create(16 * MEGABYTE, 0);
+  check(region);
+
+  struct region_cache_stats cache_stats;
+  for (size_t index = 0; index < count; index++) {
+    check(region_cache_stats(region, (intptr_t)index, &cache_stats) == 0);
+    check(cache_stats.object_size == classes[index]);
+  }
+  check(region_cache_stats(region, (intptr_t)count, &cache_stats) == -1);
+
+  size_t class = 0;
+  for (size_t size = 1; size <= 256; size++) {
+    if (size > classes[class])
+      class++;
+    check(size <= 64 || (classes[class] - size) * 4 < classes[class]);
+    const intptr_t object = region_alloc(region, size);
+    check(object && object % 8 == 0);
+    check(region_cache_stats(region, (intptr_t)class, &cache_stats) == 0);
+    check(cache_stats.in_use == 1 && cache_stats.requested >= size);
+    region_free(region, object);
+    check(region_cache_stats(region, (intptr_t)class, &cache_stats) == 0);
+    check(cache_stats.in_use == 0);
+  }
+
+  // larger objects are allocated from the heap
+  struct region_stats stats;
+  const intptr_t object = region_alloc(region, 257);
+  check(object);
+  region_stats(region, &stats);
+  check(stats.cache_allocs == 256 && stats.heap_allocs == 1);
+  region_free(region, object);
+  region_destroy(region);
+}
+
+// release an object twice in a child process, the second release must be
+// rejected, i.e. ignored or reported with an assertion in debug builds
+static bool rejected(size_t size)
+{
+  const pid_t pid = fork();
+  check(pid != -1);
+  if (pid == 0) {
+    check(freopen("/dev/null", "w", stderr));
+    region_t *region = region_create(4 * MEGABYTE, 0);
+    check(region);
+    const intptr_t object = region_alloc(region, size);
+    check(object);
+    region_free(region, object);
+    region_free(region, object);
+    // objects released twice are handed out twice
+    const intptr_t first = region_alloc(region, size);
+    const intptr_t second = region_alloc(region, size);
+    _exit(first && second && first != second ? 0 : 1);
+  }
+
+  int status;
+  check(waitpid(pid, &status, 0) == pid);
+  return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ||
+         (WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+
+// double frees are detected in constant time. small objects are checked in
+// debug builds by default (REGION_CHECK_FREE), heap blocks always
+static void test_double_free(void)
+{
+  check(rejected(5000));
+#if !defined(NDEBUG)
+  check(rejected(40));
+  check(rejected(200));
+#endif
+}
+
+#define BLOCKS (2000)
+
+// released heap blocks are returned to the region (outside transactions)
+static void test_heap(void)
+{
+  region_t *region = region_create(64 * MEGABYTE, 0);
+  check(region);
+  static intptr_t blocks[BLOCKS];
+  struct region_stats stats;
+  uint64_t seed = 1;
+
+  for (size_t round = 0; round < 4; round++) {
+    for (size_t index = 0; index < BLOCKS; index++) {
+      const size_t size = 5000 + random64(&seed) % 20000;
+      blocks[index] = region_alloc(region, size);
+      check(blocks[index]);
+      memset(swizzle(region, blocks[index]), (int)round, size);
+    }
+    region_stats(region, &stats);
+    check(stats.heap_pages);
+    for (size_t index = 0; index < BLOCKS; index++) {
+      const size_t other = random64(&seed) % BLOCKS;
+      const intptr_t block = blocks[index];
+      blocks[index] = blocks[other];
+      blocks[other] = block;
+    }
+    for (size_t index = 0; index < BLOCKS; index++)
+      region_free(region, blocks[index]);
+    region_stats(region, &stats);
+    check(stats.heap_pages == 0 && stats.heap_in_use == 0);
+  }
+
+  region_destroy(region);
+}
+
+#define THREADS (4)
+#define OPERATIONS (100000)
+#define LIVE (1024)
+
+struct worker {
+  region_depot_t *depot;
+  region_t *region;
+  intptr_t cache;
+  uint64_t seed;
+  intptr_t live[LIVE];
+  size_t sizes[LIVE];
+};
+
+// objects are filled with a pattern derived from the slot they occupy,
+// objects handed out twice are overwritten by another thread
+static void *magazine_worker(void *arg)
+{
+  struct worker *worker = arg;
+  region_magazines_t *magazines = region_magazines_create(worker->depot);
+  check(magazines);
+  intptr_t *live = worker->live;
+  size_t *sizes = worker->sizes;
+
+  for (size_t operation = 0; operation < OPERATIONS; operation++) {
+    const size_t slot = random64(&worker->seed) % LIVE;
+    const uint8_t pattern = (uint8_t)(slot + (uintptr_t)worker);
+    if (live[slot]) {
+      const uint8_t *object = swizzle(worker->region, live[slot]);
+      for (size_t index = 0; index < sizes[slot]; index++)
+        check(object[index] == pattern);
+      if (slot & 1)
+        region_magazine_cache_free(magazines, worker->cache, live[slot]);
+      else
+        region_magazine_free(magazines, live[slot], sizes[slot]);
+      live[slot] = 0;
+    } else {
+      if (slot & 1) {
+        sizes[slot] = 32;
+        live[slot] = region_magazine_cache_alloc(magazines, worker->cache);
+      } else {
+        sizes[slot] = 8 + random64(&worker->seed) % 500;
+        live[slot] = region_magazine_alloc(magazines, sizes[slot]);
+      }
+      check(live[slot]);
+      memset(swizzle(worker->region, live[slot]), pattern, sizes[slot]);
+    }
+  }
+
+  for (size_t slot = 0; slot < LIVE; slot++) {
+    if (!live[slot])
+      continue;
+    if (slot & 1)
+      region_magazine_cache_free(magazines, worker->cache, live[slot]);
+    else
+      region_magazine_free(magazines, live[slot], sizes[slot]);
+  }
+
+  region_magazines_destroy(magazines);
+  return NULL;
+}
+
+// threads allocate from and release to the same region concurrently, every
+// object is returned to the region once magazines and depot are destroyed
+static void test_magazines(void)
+{
+  region_t *region = region_create(256 * MEGABYTE, 0);
+  check(region);
+  const intptr_t cache = region_cache_create(region, "objects", 32, 0);
+  check(cache >= 0);
+  region_depot_t *depot = region_depot_create(region, 0);
+  check(depot);
+
+  pthread_t threads[THREADS];
+  static struct worker workers[THREADS];
+  for (size_t thread = 0; thread < THREADS; thread++) {
+    workers[thread] =
+      (struct worker){ depot, region, cache, thread + 1, { 0 }, { 0 } };
+    check(!pthread_create(
+      &threads[thread], NULL, magazine_worker, &workers[thread]));
+  }
+  for (size_t thread = 0; thread < THREADS; thread++)
+    check(!pthread_join(threads[thread], NULL));
+  region_depot_destroy(depot);
+
+  struct region_stats stats;
+  region_stats(region, &stats);
+  check(stats.cache_allocs && stats.cache_allocs == stats.cache_frees);
+  check(stats.heap_allocs == stats.heap_frees);
+  struct region_cache_stats cache_stats;
+  check(region_cache_stats(region, cache, &cache_stats) == 0);
+  check(cache_stats.in_use == 0);
+  region_destroy(region);
+}
+
+#define BULK (5000)
+
+// objects allocated in bulk are distinct and are all returned to the
+// region when released in bulk, offsets that do not refer to objects are
+// ignored
+static void test_bulk(void)
+{
+  region_t *region = region_create(64 * MEGABYTE, 0);
+  check(region);
+  static intptr_t objects[BULK + 3];
+  static const size_t sizes[] = { 8, 100, 256, 3000 };
+  struct region_stats stats;
+
+  for (size_t index = 0; index < sizeof(sizes) / sizeof(sizes[0]); index++) {
+    const size_t size = sizes[index];
+    check(region_alloc_bulk(region, size, BULK, objects) == BULK);
+    for (size_t object = 0; object < BULK; object++) {
+      check(objects[object] && objects[object] % 8 == 0);
+      memset(swizzle(region, objects[object]), (int)object, size);
+    }
+    for (size_t object = 0; object < BULK; object++) {
+      const uint8_t *octets = swizzle(region, objects[object]);
+      check(octets[0] == (uint8_t)object && octets[size - 1] == (uint8_t)object);
+    }
+
+    objects[BULK] = 0;
+    objects[BULK + 1] = objects[0] + 4;
+    objects[BULK + 2] = (intptr_t)(128 * MEGABYTE);
+    region_free_bulk(region, objects, BULK + 3);
+    region_stats(region, &stats);
+    check(stats.cache_allocs == stats.cache_frees);
+    check(stats.heap_allocs == stats.heap_frees && stats.heap_in_use == 0);
+  }
+
+  // objects allocated from a cache in bulk are released in bulk
+  const intptr_t cache = region_cache_create(region, "bulk", 60, 0);
+  check(cache >= 0);
+  check(region_cache_alloc_bulk(region, cache, BULK, objects) == BULK);
+  struct region_cache_stats cache_stats;
+  check(region_cache_stats(region, cache, &cache_stats) == 0);
+  check(cache_stats.in_use == BULK);
+  region_free_bulk(region, objects, BULK);
+  check(region_cache_stats(region, cache, &cache_stats) == 0);
+  check(cache_stats.in_use == 0);
+
+  // allocation stops when the region is exhausted
+  check(region_alloc_bulk(region, 0, BULK, objects) == 0);
+  const size_t count = region_alloc_bulk(region, MEGABYTE, 100, objects);
+  check(count > 0 && count < 64);
+  region_free_bulk(region, objects, count);
+  region_destroy(region);
+}
+
+#define OBJECTS (1000)
+
+// page counts add up to the size of the region, counters follow
+// allocations and releases
+static void test_stats(void)
+{
+  region_t *region = region_create(16 * MEGABYTE, 0);
+  check(region);
+  struct region_stats stats;
+  region_stats(region, &stats);
+  check(stats.size == 16 * MEGABYTE && stats.pages == stats.size / PAGE_SIZE);
+  check(stats.admin_pages && stats.admin_pages + stats.free_pages == stats.pages);
+  check(!stats.cache_allocs && !stats.heap_allocs && !stats.heap_in_use);
+
+  const intptr_t cache = region_cache_create(region, "objects", 60, 0);
+  check(cache >= 0);
+  struct region_cache_stats cache_stats;
+  check(region_cache_stats(region, cache, &cache_stats) == 0);
+  check(strcmp(cache_stats.name, "objects") == 0);
+  check(cache_stats.object_size == 60 && cache_stats.alignment == 8);
+  check(cache_stats.aligned_size == 64 && cache_stats.slab_objects);
+  const size_t slab_objects = cache_stats.slab_objects;
+
+  static intptr_t objects[OBJECTS];
+  for (size_t index = 0; index < OBJECTS; index++)
+    check((objects[index] = region_cache_alloc(region, cache)));
+  const intptr_t block = region_alloc(region, 5000);
+  check(block);
+
+  const size_t slabs = (OBJECTS + slab_objects - 1) / slab_objects;
+  check(region_cache_stats(region, cache, &cache_stats) == 0);
+  check(cache_stats.allocs == OBJECTS && cache_stats.in_use == OBJECTS);
+  check(cache_stats.requested == OBJECTS * 60);
+  check(cache_stats.allocated == OBJECTS * 64);
+  check(cache_stats.slabs_created == slabs);
+  check(cache_stats.full_slabs + cache_stats.partial_slabs == slabs);
+  region_stats(region, &stats);
+  check(stats.cache_allocs == OBJECTS);
+  check(stats.cache_pages >= slabs * cache_stats.slab_pages);
+  check(stats.heap_allocs == 1 && stats.heap_pages);
+  check(stats.heap_requested == 5000 && stats.heap_allocated >= 5000);
+  check(stats.heap_in_use >= 5000);
+  check(stats.admin_pages + stats.cache_pages + stats.heap_pages +
+        stats.free_pages == stats.pages);
+
+  for (size_t index = 0; index < OBJECTS; index++)
+    region_cache_free(region, cache, objects[index]);
+  region_free(region, block);
+  check(region_cache_stats(region, cache, &cache_stats) == 0);
+  check(cache_stats.frees == OBJECTS && cache_stats.in_use == 0);
+  check(cache_stats.full_slabs == 0 && cache_stats.partial_slabs == 0);
+  check(cache_stats.free_slabs <= 2);
+  check(cache_stats.slabs_released == slabs - cache_stats.free_slabs);
+  region_stats(region, &stats);
+  check(stats.heap_frees == 1 && stats.heap_in_use == 0);
+
+  // pages updated in a snapshot are counted until committed
+  region_t *snapshot = region_snapshot(region, 0);
+  check(snapshot);
+  check(region_alloc(snapshot, 5000));
+  region_stats(snapshot, &stats);
+  check(stats.dirty_pages);
+  region_abort(snapshot);
+  region_destroy(region);
+}
+
+#define TRACED (64)
+
+// replayed offset of a recorded offset, offsets are reused once released
+static intptr_t replayed(
+  const uint64_t *recorded, const intptr_t *objects, size_t count,
+  uint64_t offset)
+{
+  for (size_t index = count; index > 0; index--)
+    if (recorded[index - 1] == offset)
+      return objects[index - 1];
+  check(!"offset was not recorded");
+  return 0;
+}
+
+// a trace replayed to a fresh region reproduces the objects in use. the
+// region owns the ring buffer, snapshots record to it. tracing is compiled
+// out by default, configure with -DREGION_TRACE=ON to run the test
+static void test_trace(void)
+{
+  region_t *region = region_create(8 * MEGABYTE, 0);
+  check(region);
+  if (region_trace_start(region, 1024) == -1) {
+    check(region_trace_flush(region, STDOUT_FILENO) == -1);
+    region_destroy(region);
+    return;
+  }
+
+  const intptr_t cache = region_cache_create(region, "objects", 72, 16);
+  check(cache >= 0);
+  intptr_t objects[TRACED];
+  for (size_t index = 0; index < TRACED / 2; index++) {
+    check((objects[index] = region_alloc(region, index % 4 ? 24 : 3000)));
+    check((objects[TRACED / 2 + index] = region_cache_alloc(region, cache)));
+  }
+  for (size_t index = 0; index < TRACED; index += 3)
+    region_free(region, objects[index]);
+
+  region_t *snapshot = region_snapshot(region, 0);
+  check(snapshot);
+  check(region_trace_start(snapshot, 1024) == -1);
+  region_trace_stop(snapshot);
+  check(region_alloc(snapshot, 40));
+  region = region_commit(snapshot);
+  check(region);
+  region_abort(snapshot);
+
+  char path[32];
+  temporary(path);
+  int fd = open(path, O_WRONLY);
+  check(fd != -1);
+  check(region_trace_flush(region, fd) == 0);
+  close(fd);
+  struct region_stats stats;
+  region_stats(region, &stats);
+  region_trace_stop(region);
+  region_destroy(region);
+
+  FILE *file = fopen(path, "rb");
+  check(file);
+  struct region_trace_header header;
+  check(fread(&header, sizeof(header), 1, file) == 1);
+  check(memcmp(header.magic, REGION_TRACE_MAGIC, sizeof(header.magic)) == 0);
+  check(header.version == REGION_TRACE_VERSION && !header.dropped);
+
+  uint64_t recorded[2 * TRACED];
+  intptr_t replays[2 * TRACED];
+  size_t count = 0, snapshots = 0, commits = 0;
+  for (uint32_t index = 0; index < header.count; index++) {
+    struct region_trace_record record;
+    check(fread(&record, sizeof(record), 1, file) == 1);
+    switch (record.op) {
+      case REGION_TRACE_START:
+        check(index == 0);
+        check((region = region_create(record.offset, 0)));
+        break;
+      case REGION_TRACE_CACHE_CREATE:
+        if (record.cache == cache)
+          check(region_cache_create(region, "objects", record.size, record.offset) == cache);
+        break;
+      case REGION_TRACE_ALLOC:
+      case REGION_TRACE_CACHE_ALLOC:
+        check(count < 2 * TRACED);
+        recorded[count] = record.offset;
+        replays[count] = record.op == REGION_TRACE_ALLOC
+          ? region_alloc(region, record.size)
+          : region_cache_alloc(region, record.cache);
+        check(replays[count++]);
+        break;
+      case REGION_TRACE_FREE:
+        region_free(
+          region, replayed(recorded, replays, count, record.offset));
+        break;
+      case REGION_TRACE_CACHE_FREE:
+        region_cache_free(region, record.cache,
+                          replayed(recorded, replays, count, record.offset));
+        break;
+      case REGION_TRACE_SNAPSHOT:
+        snapshots++;
+        break;
+      case REGION_TRACE_COMMIT:
+        commits++;
+        break;
+    }
+  }
+  check(fgetc(file) == EOF);
+  fclose(file);
+  unlink(path);
+
+  check(count == TRACED + 1 && snapshots == 1 && commits == 1);
+  struct region_stats replay_stats;
+  region_stats(region, &replay_stats);
+  check(replay_stats.cache_allocs - replay_stats.cache_frees ==
+        stats.cache_allocs - stats.cache_frees);
+  check(replay_stats.heap_in_use == stats.heap_in_use);
+  region_destroy(region);
+}
+
+// regions mapped from a file are opened instantly, files that do not hold
+// a valid region are rejected and corrupt pages fail verification
+static void test_open(void)
+{
+  char path[32];
+  temporary(path);
+  region_t *region = region_map_file(path, 4 * MEGABYTE, 0);
+  check(region);
+  region_t *snapshot = region_snapshot(region, 0);
+  check(snapshot);
+  const intptr_t object = region_alloc(snapshot, 5000);
+  check(object);
+  strcpy(swizzle(snapshot, object), "object");
+  region = region_commit(snapshot);
+  check(region);
+  region_abort(snapshot);
+  region_destroy(region);
+
+  // memory that holds a region is adopted as is
+  const int fd = open(path, O_RDONLY);
+  check(fd != -1);
+  void *address = mmap(
+    NULL, 4 * MEGABYTE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  check(address != MAP_FAILED);
+  check(!region_open((uint8_t *)address + 8, 4 * MEGABYTE - PAGE_SIZE));
+  check(!region_open(address, PAGE_SIZE));
+  check(!region_open(address, 2 * MEGABYTE));
+  region = region_open(address, 4 * MEGABYTE);
+  check(region == address);
+  check(strcmp(swizzle(region, object), "object") == 0);
+  *(uint8_t *)address ^= 0x10;
+  check(!region_open(address, 4 * MEGABYTE));
+  munmap(address, 4 * MEGABYTE);
+
+  // objects are verified on first use
+  flip(path, (size_t)object + 2);
+  region = region_map_file(path, 0, 0);
+  check(region);
+  check(region_verify(region, object, 5000) == -1);
+  check(region_verify(region, object, 4 * MEGABYTE) == -1);
+  region_destroy(region);
+
+  // header (magic) and truncated files
+  flip(path, 0);
+  check(!region_map_file(path, 0, 0));
+  flip(path, 0);
+  check(truncate(path, 2 * MEGABYTE) == 0);
+  check(!region_map_file(path, 0, 0));
+  unlink(path);
+}
+
+// updates that change the header only are marked like other updates, the
+// checksum no longer applies and the file remains valid
+static void test_header(void)
+{
+  char path[32];
+  temporary(path);
+  region_t *region = region_map_file(path, 4 * MEGABYTE, 0);
+  check(region);
+
+  // every update is applied to a region that was just committed
+  region = reopen(checksummed(region), path);
+  check(region_cache_retain(region, 0, 5) == 0);
+  region = reopen(region, path);
+  region = reopen(checksummed(region), path);
+  check(region_cache_create(region, "header", 72, 0) >= 0);
+  region = reopen(region, path);
+  region = reopen(checksummed(region), path);
+  region_load(region);
+  region = reopen(region, path);
+  region_destroy(region);
+  unlink(path);
+}
+
+// objects hold their index in references, references are updated as
+// objects are moved
+static int move(
+  region_t *region, intptr_t object, intptr_t new_object, size_t size,
+  void *arg)
+{
+  intptr_t *references = arg;
+  const uint64_t index = *(const uint64_t *)swizzle(region, new_object);
+  check(size == 64 && references[index] == object);
+  references[index] = new_object;
+  return 0;
+}
+
+static int pin(
+  region_t *region, intptr_t object, intptr_t new_object, size_t size,
+  void *arg)
+{
+  (void)region; (void)object; (void)new_object; (void)size; (void)arg;
+  return -1;
+}
+
+// sparsely populated slabs are evacuated into other slabs and returned to
+// the region, objects that are pinned stay where they are
+static void test_compact(void)
+{
+  region_t *region = region_create(16 * MEGABYTE, 0);
+  check(region);
+  const intptr_t cache = region_cache_create(region, "objects", 64, 0);
+  check(cache >= 0);
+  check(region_cache_retain(region, cache, 0) == 0);
+  static intptr_t references[OBJECTS];
+  for (size_t index = 0; index < OBJECTS; index++) {
+    check((references[index] = region_cache_alloc(region, cache)));
+    *(uint64_t *)swizzle(region, references[index]) = index;
+  }
+  // leave a quarter of the objects in every slab
+  for (size_t index = 0; index < OBJECTS; index++) {
+    if (index % 4 == 0)
+      continue;
+    region_cache_free(region, cache, references[index]);
+    references[index] = 0;
+  }
+
+  struct region_cache_stats before, after;
+  check(region_cache_stats(region, cache, &before) == 0);
+  check(before.partial_slabs > 2);
+
+  // nothing is moved without a callback, or if objects are pinned
+  check(region_compact(region, OBJECTS) == 0);
+  check(region_cache_move(region, cache, pin, NULL) == 0);
+  check(region_compact(region, OBJECTS) == 0);
+  // or while the region is loaded
+  check(region_cache_move(region, cache, move, references) == 0);
+  region_load(region);
+  check(region_compact(region, OBJECTS) == 0);
+  region_seal(region);
+
+  // compaction is incremental
+  check(region_compact(region, 1) == 1);
+  size_t moved = 1, count;
+  while ((count = region_compact(region, 16)))
+    moved += count;
+  check(moved > 1);
+  check(region_cache_stats(region, cache, &after) == 0);
+  check(after.in_use == before.in_use);
+  check(after.full_slabs + after.partial_slabs <
+        before.full_slabs + before.partial_slabs);
+  check(after.slabs_released > before.slabs_released);
+  // objects in the least occupied slab may not fit the free objects in the
+  // other slabs, which leaves at most one slab more than required
+  const size_t slabs =
+    (after.in_use + after.slab_objects - 1) / after.slab_objects;
+  check(after.full_slabs + after.partial_slabs <= slabs + 1);
+
+  for (size_t index = 0; index < OBJECTS; index += 4)
+    check(*(uint64_t *)swizzle(region, references[index]) == index);
+  for (size_t index = 0; index < OBJECTS; index += 4)
+    region_cache_free(region, cache, references[index]);
+  check(region_cache_stats(region, cache, &after) == 0);
+  check(after.in_use == 0);
+  region_destroy(region);
+}
+
+// hinted allocations are served from the slab the hint resides in, or a
+// slab on a neighbouring page, rather than the first partial slab
+static void test_near(void)
+{
+  region_t *region = region_create(16 * MEGABYTE, 0);
+  check(region);
+  const intptr_t cache = region_cache_create(region, "objects", 48, 0);
+  check(cache >= 0);
+  struct region_cache_stats cache_stats;
+  check(region_cache_stats(region, cache, &cache_stats) == 0);
+  const size_t slab_objects = cache_stats.slab_objects;
+
+  // fill a slab, then a slab of another cache next to it, then leave a far
+  // away slab partially filled
+  static intptr_t objects[OBJECTS];
+  check(2 * slab_objects < OBJECTS);
+  for (size_t index = 0; index < slab_objects; index++)
+    check((objects[index] = region_cache_alloc(region, cache)));
+  const intptr_t neighbour = region_alloc(region, 64);
+  check(neighbour);
+  const intptr_t block = region_alloc(region, 100000);
+  check(block);
+  for (size_t index = slab_objects; index < 2 * slab_objects + 1; index++)
+    check((objects[index] = region_cache_alloc(region, cache)));
+
+  // room in the slab of the hint
+  region_cache_free(region, cache, objects[10]);
+  check(region_cache_alloc_near(region, cache, objects[20]) == objects[10]);
+  // room in a slab next to the hint
+  region_cache_free(region, cache, objects[10]);
+  check(region_cache_alloc_near(region, cache, neighbour) == objects[10]);
+  region_free(region, objects[10]);
+  check(region_alloc_near(region, 48, objects[20]) != objects[10]);
+  const intptr_t near = region_alloc_near(region, 64, neighbour);
+  check(near && near / PAGE_SIZE == neighbour / PAGE_SIZE);
+
+  // hints that are not objects and large objects fall back
+  check(region_cache_alloc_near(region, cache, 0));
+  check(region_cache_alloc_near(region, cache, (intptr_t)(64 * MEGABYTE)));
+  check(region_alloc_near(region, 5000, neighbour));
+  region_destroy(region);
+}
+
+// 32-bit references convert to and from offsets and pointers, offsets up to
+// REGION_REF32_MAX can be referenced
+static void test_ref32(void)
+{
+  region_t *region = region_create(16 * MEGABYTE, 0);
+  check(region);
+  const intptr_t cache = region_cache_create(region, "objects", 40, 0);
+  check(cache >= 0);
+
+  check(region_ref32(0) == 0 && region_unref32(0) == 0);
+  check(is_ref32((intptr_t)REGION_REF32_MAX));
+  check(!is_ref32((intptr_t)REGION_REF32_MAX + 8));
+  check(region_unref32(region_ref32((intptr_t)REGION_REF32_MAX)) ==
+        (intptr_t)REGION_REF32_MAX);
+
+  const region_ref32_t small = region_alloc32(region, 40);
+  const region_ref32_t large = region_alloc32(region, 5000);
+  const region_ref32_t object = region_cache_alloc32(region, cache);
+  check(small && large && object);
+  check(small != large && small != object && large != object);
+  strcpy(swizzle32(region, large), "large");
+  check(strcmp(swizzle(region, region_unref32(large)), "large") == 0);
+  check(unswizzle32(region, swizzle32(region, object)) == object);
+  check(region_ref32(unswizzle(region, swizzle32(region, small))) == small);
+
+  region_free32(region, small);
+  region_free32(region, large);
+  region_cache_free32(region, cache, object);
+  struct region_stats stats;
+  region_stats(region, &stats);
+  check(stats.cache_allocs == stats.cache_frees);
+  check(stats.heap_allocs == stats.heap_frees);
+  region_destroy(region);
+}
+
+#define CONSTRUCTED (0x636f6e7374727563llu)
+
+struct constructed {
+  uint64_t magic;
+  uint64_t uses;
+};
+
+struct constructors {
+  size_t ctors;
+  size_t dtors;
+};
+
+static void construct(region_t *region, intptr_t object, void *arg)
+{
+  struct constructed *constructed = swizzle(region, object);
+  struct constructors *constructors = arg;
+  constructed->magic = CONSTRUCTED;
+  constructed->uses = 0;
+  constructors->ctors++;
+}
+
+static void destruct(region_t *region, intptr_t object, void *arg)
+{
+  const struct constructed *constructed = swizzle(region, object);
+  struct constructors *constructors = arg;
+  check(constructed->magic == CONSTRUCTED);
+  constructors->dtors++;
+}
+
+// objects are constructed once per slab and retain their state while free,
+// objects are destructed when the slab is returned to the region
+static void test_constructors(void)
+{
+  region_t *region = region_create(16 * MEGABYTE, 0);
+  check(region);
+  struct constructors constructors = { 0, 0 };
+  const intptr_t cache = region_cache_create_ctor(
+    region, "constructed", sizeof(struct constructed), 0, construct,
+    destruct, &constructors);
+  check(cache >= 0);
+  check(region_cache_create(
+    region, "constructed", sizeof(struct constructed), 0) == -1);
+  check(region_cache_create_ctor(
+    region, "constructed", sizeof(struct constructed), 0, construct,
+    destruct, &constructors) == cache);
+  check(region_cache_retain(region, cache, OBJECTS) == 0);
+
+  // fill slabs so that every object is handed out every round
+  struct region_cache_stats cache_stats;
+  check(region_cache_stats(region, cache, &cache_stats) == 0);
+  const size_t count = 4 * cache_stats.slab_objects;
+  static intptr_t objects[OBJECTS];
+  check(count <= OBJECTS);
+
+  for (size_t round = 0; round < 3; round++) {
+    for (size_t index = 0; index < count; index++) {
+      check((objects[index] = region_cache_alloc(region, cache)));
+      struct constructed *constructed = swizzle(region, objects[index]);
+      check(constructed->magic == CONSTRUCTED && constructed->uses == round);
+      constructed->uses++;
+    }
+    check(region_cache_stats(region, cache, &cache_stats) == 0);
+    check(cache_stats.slabs_created == 4);
+    check(constructors.ctors == count && !constructors.dtors);
+    for (size_t index = 0; index < count; index++)
+      region_cache_free(region, cache, objects[index]);
+  }
+
+  check(region_cache_retain(region, cache, 0) == 0);
+  check(constructors.dtors == count);
+  region_destroy(region);
+}
+
+#define WORDS (4096)
+#define VERSIONS (200)
+
+struct reader {
+  region_readers_t *readers;
+  intptr_t array;
+  volatile int *stop;
+  size_t torn;
+};
+
+// a version is either observed in its entirety or not at all
+static void *reader_worker(void *arg)
+{
+  struct reader *reader = arg;
+  region_reader_t *self = region_reader_create(reader->readers);
+  check(self);
+
+  while (!__atomic_load_n(reader->stop, __ATOMIC_ACQUIRE)) {
+    region_t *region = region_read_begin(self);
+    const uint64_t *words = swizzle(region, reader->array);
+    const uint64_t version = words[0];
+    for (size_t index = 1; index < WORDS; index += 61)
+      if (words[index] != version)
+        reader->torn++;
+    region_read_end(self);
+  }
+
+  region_reader_destroy(self);
+  return NULL;
+}
+
+// readers keep reading while snapshots are committed, some of which grow
+// (and possibly move) the region
+static void test_readers(void)
+{
+  region_t *region = region_create(8 * MEGABYTE, 0);
+  check(region);
+  const intptr_t array = region_alloc(region, WORDS * sizeof(uint64_t));
+  check(array);
+  memset(swizzle(region, array), 0, WORDS * sizeof(uint64_t));
+  region_readers_t *readers = region_readers_create(region, THREADS);
+  check(readers);
+
+  volatile int stop = 0;
+  pthread_t threads[THREADS];
+  struct reader workers[THREADS];
+  for (size_t thread = 0; thread < THREADS; thread++) {
+    workers[thread] = (struct reader){ readers, array, &stop, 0 };
+    check(!pthread_create(
+      &threads[thread], NULL, reader_worker, &workers[thread]));
+  }
+
+  for (uint64_t version = 1; version <= VERSIONS; version++) {
+    region_t *current = region_readers_current(readers);
+    struct region_stats stats;
+    region_stats(current, &stats);
+    const size_t size = version % 50 ? 0 : stats.size + MEGABYTE;
+    region_t *snapshot = region_snapshot(current, size);
+    check(snapshot);
+    uint64_t *words = swizzle(snapshot, array);
+    for (size_t index = 0; index < WORDS; index++)
+      words[index] = version;
+    region_dirty(snapshot, array, WORDS * sizeof(uint64_t));
+    for (size_t count = 0; count < 20; count++)
+      check(region_alloc(snapshot, 64));
+    region = region_readers_commit(readers, snapshot);
+    check(region);
+  }
+
+  __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+  for (size_t thread = 0; thread < THREADS; thread++) {
+    check(!pthread_join(threads[thread], NULL));
+    check(!workers[thread].torn);
+  }
+
+  check(*(uint64_t *)swizzle(region, array) == VERSIONS);
+  region_readers_destroy(readers);
+  region_destroy(region);
+}
+
+// allocations from a published region fail, releases are ignored
+static void test_publish(void)
+{
+  region_t *region = region_create(4 * MEGABYTE, 0);
+  check(region);
+  const intptr_t cache = region_cache_create(region, "objects", 48, 0);
+  check(cache >= 0);
+  const intptr_t small = region_alloc(region, 40);
+  const intptr_t large = region_alloc(region, 5000);
+  const intptr_t object = region_cache_alloc(region, cache);
+  check(small && large && object);
+  strcpy(swizzle(region, large), "large");
+
+  const int fd = region_publish(region);
+  check(fd != -1);
+  intptr_t objects[8];
+  check(!region_alloc(region, 40));
+  check(!region_alloc(region, 200));
+  check(!region_alloc(region, 5000));
+  check(!region_alloc_near(region, 40, small));
+  check(!region_cache_alloc(region, cache));
+  check(region_alloc_bulk(region, 40, 8, objects) == 0);
+  check(region_alloc_bulk(region, 3000, 8, objects) == 0);
+  region_free(region, small);
+  region_free(region, large);
+  region_cache_free(region, cache, object);
+  check(strcmp(swizzle(region, large), "large") == 0);
+
+  region_t *attached = region_attach(fd);
+  check(attached);
+  check(strcmp(swizzle(attached, large), "large") == 0);
+  check(!region_alloc(attached, 40));
+  region_destroy(attached);
+  region_destroy(region);
+}
+
+// objects are handed out in order while loading. sealing turns the slabs
+// that were being loaded into regular slabs, objects that were released or
+// not handed out are allocated from after
+static void test_load(void)
+{
+  region_t *region = region_create(MEGABYTE, 0);
+  check(region);
+  const intptr_t cache = region_cache_create(region, "objects", 48, 0);
+  check(cache >= 0);
+  struct region_cache_stats cache_stats;
+  check(region_cache_stats(region, cache, &cache_stats) == 0);
+  const size_t slab_size = cache_stats.slab_pages * PAGE_SIZE;
+
+  region_load(region);
+  static intptr_t objects[OBJECTS];
+  for (size_t index = 0; index < OBJECTS; index++) {
+    check((objects[index] = region_cache_alloc(region, cache)));
+    if (index && objects[index] / slab_size == objects[index - 1] / slab_size)
+      check(objects[index] == objects[index - 1] + 48);
+  }
+  // releasing an object closes the slab for loading
+  region_cache_free(region, cache, objects[OBJECTS - 1]);
+  const intptr_t next = region_cache_alloc(region, cache);
+  check(next && next / slab_size != objects[OBJECTS - 1] / slab_size);
+  check(region_cache_stats(region, cache, &cache_stats) == 0);
+  check(cache_stats.in_use == OBJECTS);
+
+  // allocations fail once the region is exhausted
+  size_t count = 0;
+  while (region_cache_alloc(region, cache))
+    count++;
+  check(count);
+  check(region_cache_stats(region, cache, &cache_stats) == 0);
+  check(cache_stats.in_use == OBJECTS + count);
+  check(region_compact(region, OBJECTS) == 0);
+
+  region_seal(region);
+  check(region_cache_stats(region, cache, &cache_stats) == 0);
+  check(cache_stats.in_use == OBJECTS + count);
+  check(region_cache_alloc(region, cache) == objects[OBJECTS - 1]);
+  for (size_t index = 0; index < OBJECTS - 1; index++)
+    region_cache_free(region, cache, objects[index]);
+  for (size_t index = 0; index < OBJECTS - 1; index++)
+    check(region_cache_alloc(region, cache));
+  check(region_cache_stats(region, cache, &cache_stats) == 0);
+  check(cache_stats.in_use == OBJECTS + count + 1);
+  region_destroy(region);
+
+  // snapshots are sealed on commit
+  region = region_create(4 * MEGABYTE, 0);
+  check(region);
+  region_t *snapshot = region_snapshot(region, 0);
+  check(snapshot);
+  region_load(snapshot);
+  for (size_t index = 0; index < OBJECTS; index++)
+    check((objects[index] = region_alloc(snapshot, 100)));
+  region = region_commit(snapshot);
+  check(region);
+  region_abort(snapshot);
+  for (size_t index = 0; index < OBJECTS; index++)
+    region_free(region, objects[index]);
+  struct region_stats stats;
+  region_stats(region, &stats);
+  check(stats.cache_allocs == OBJECTS && stats.cache_frees == OBJECTS);
+  check(region_alloc(region, 100));
+  region_destroy(region);
+}
+
+#define RECORDS (20000)
+
+// apply a transfer of records to a snapshot of the estimated size, each
+// record takes a small object, every hundredth record a large one too
+static region_t *transfer(region_t *region, size_t octets, size_t records)
+{
+  const size_t size = region_estimate(region, octets, records);
+  struct region_stats stats;
+  region_stats(region, &stats);
+  check(size >= stats.size && size % PAGE_SIZE == 0);
+  region_t *snapshot = region_snapshot(region, size);
+  check(snapshot);
+  for (size_t record = 0; record < records; record++) {
+    check(region_alloc(snapshot, 48));
+    if (record % 100 == 0)
+      check(region_alloc(snapshot, 5000));
+  }
+  region = region_commit(snapshot);
+  check(region);
+  region_abort(snapshot);
+  return region;
+}
+
+// snapshots sized by estimate hold the transfer. estimates fall back to a
+// rule of thumb, then learn from the transfer that was committed
+static void test_estimate(void)
+{
+  region_t *region = region_create(MEGABYTE, 0);
+  check(region);
+  struct region_stats stats;
+  region_stats(region, &stats);
+  check(region_estimate(region, 0, 0) == stats.size);
+  const size_t guess = region_estimate(region, 40 * RECORDS, RECORDS);
+  check(guess >= stats.size + (2 * 40 + 64) * RECORDS -
+                 stats.free_pages * PAGE_SIZE);
+
+  region = transfer(region, 40 * RECORDS, RECORDS);
+  region = transfer(region, 40 * RECORDS, RECORDS);
+  region_stats(region, &stats);
+  const size_t size = region_estimate(region, 40 * RECORDS, RECORDS);
+  check(size > stats.size);
+  // requirements scale with records or octets, whichever requires more
+  const size_t larger = region_estimate(region, 40 * RECORDS, 2 * RECORDS);
+  check(larger > size);
+  check(region_estimate(region, 80 * RECORDS, RECORDS) == larger);
+  check(region_estimate(region, 80 * RECORDS, 2 * RECORDS) == larger);
+  region = transfer(region, 80 * RECORDS, 2 * RECORDS);
+  region_destroy(region);
+
+  // estimates are made for the region itself, which may be mapped from a
+  // file that must remain valid
+  char path[32];
+  temporary(path);
+  region = region_map_file(path, MEGABYTE, 0);
+  check(region);
+  region = transfer(reopen(checksummed(region), path), 40 * RECORDS, RECORDS);
+  region = reopen(region, path);
+  check(region_estimate(region, 40 * RECORDS, RECORDS) > MEGABYTE);
+  region = reopen(region, path);
+  region_destroy(region);
+  unlink(path);
+}
+
+#define ROUNDS (3)
+
+struct written {
+  region_t *region;
+  int result;
+  int calls;
+};
+
+static void written(region_t *region, region_t *snapshot, int result, void *arg)
+{
+  struct written *written = arg;
+  (void)snapshot;
+  written->region = region;
+  written->result = result;
+  written->calls++;
+}
+
+// snapshots of a region mapped from a file are committed asynchronously,
+// one of which grows the region. the file holds every committed object
+// once the writer is done and the administration is verified on open
+static void test_writeback(void)
+{
+  char path[32];
+  temporary(path);
+  region_writer_t *writer = region_writer_create();
+  check(writer);
+  region_t *region = region_map_file(path, 4 * MEGABYTE, 0);
+  check(region);
+
+  static intptr_t objects[ROUNDS * OBJECTS];
+  struct written done = { NULL, 0, 0 };
+  size_t count = 0;
+  for (size_t round = 0; round < ROUNDS; round++) {
+    const size_t size = round == 1 ? 32 * MEGABYTE : 0;
+    region_t *snapshot = region_snapshot(region, size);
+    check(snapshot);
+    for (size_t index = 0; index < OBJECTS; index++, count++) {
+      objects[count] = region_alloc(snapshot, count % 3 ? 40 : 9000);
+      check(objects[count]);
+      sprintf(swizzle(snapshot, objects[count]), "object%zu", count);
+    }
+    for (size_t index = 0; round && index < count; index += 11) {
+      if (!objects[index])
+        continue;
+      region_free(snapshot, objects[index]);
+      objects[index] = 0;
+    }
+    check(region_commit_async(writer, snapshot, written, &done) == 0);
+    region_writer_wait(writer);
+    check(done.calls == (int)round + 1 && done.result == 0);
+    region = done.region;
+    region_abort(snapshot);
+  }
+
+  struct region_stats stats;
+  region_stats(region, &stats);
+  const size_t size = stats.size;
+  region_destroy(region);
+  region_writer_destroy(writer);
+
+  region = region_map_file(path, 0, 0);
+  check(region);
+  for (size_t index = 0; index < count; index++) {
+    char name[32];
+    if (!objects[index])
+      continue;
+    sprintf(name, "object%zu", index);
+    check(strcmp(swizzle(region, objects[index]), name) == 0);
+    check(region_verify(region, objects[index], strlen(name)) == 0);
+  }
+  // updates in place are not checksummed and do not prevent opening
+  check(region_alloc(region, 100));
+  region_destroy(region);
+  region = region_map_file(path, 0, 0);
+  check(region);
+  region_t *snapshot = region_snapshot(region, 0);
+  check(snapshot);
+  check(region_alloc(snapshot, 100));
+  region = region_commit(snapshot);
+  check(region);
+  region_abort(snapshot);
+  region_destroy(region);
+
+  // a corrupt administration is rejected before it is trusted
+  for (size_t offset = 128; offset < PAGE_SIZE; offset += 128) {
+    flip(path, offset);
+    region = region_map_file(path, 0, 0);
+    check(!region);
+    flip(path, offset);
+  }
+  region = region_map_file(path, 0, 0);
+  check(region);
+  region_stats(region, &stats);
+  check(stats.size == size);
+  region_destroy(region);
+  unlink(path);
+}
+
+static const struct {
+  const char *name;
+  void (*test)(void);
+} tests[] = {
+  { "snapshots", test_snapshots },
+  { "abort", test_abort },
+  { "alignment", test_alignment },
+  { "size_classes", test_size_classes },
+  { "double_free", test_double_free },
+  { "heap", test_heap },
+  { "magazines", test_magazines },
+  { "bulk", test_bulk },
+  { "stats", test_stats },
+  { "trace", test_trace },
+  { "open", test_open },
+  { "header", test_header },
+  { "compact", test_compact },
+  { "near", test_near },
+  { "ref32", test_ref32 },
+  { "constructors", test_constructors },
+  { "readers", test_readers },
+  { "publish", test_publish },
+  { "load", test_load },
+  { "estimate", test_estimate },
+  { "writeback", test_writeback },
+};
+
+// run all tests or the tests named on the command line
+int main(int argc, char *argv[])
+{
+  const size_t count = sizeof(tests) / sizeof(tests[0]);
+  for (size_t index = 0; index < count; index++) {
+    bool selected = argc < 2;
+    for (int arg = 1; arg < argc; arg++)
+      selected |= strcmp(argv[arg], tests[index].name) == 0;
+    if (!selected)
+      continue;
+    running = tests[index].name;
+    tests[index].test();
+    printf("%s: ok\n", running);
+  }
+  return 0;
+}
\ No newline at end of file
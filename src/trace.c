@@ -0,0 +1,161 @@
+/*
+ * trace.c - allocation tracing for regions
+ *
+ * Copyright (c) 2024, NLnet Labs. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "macros.h"
+#include "region.h"
+#include "internal.h"
+
+// records are written to a ring buffer that is flushed on demand. the
+// buffer is process local and is referenced from the mapping information
+// of the region, which is retained on commit. snapshots do not reference
+// the buffer, they resolve it through the region they were taken of (see
+// mapping_trace). the region is not synchronized, neither is the buffer
+
+struct region_trace {
+  /** Time the trace was started (nanoseconds). */
+  uint64_t start;
+  /** Number of records overwritten since the last flush. */
+  uint64_t dropped;
+  /** Index of oldest record. */
+  size_t first;
+  /** Number of records in the buffer. */
+  size_t count;
+  /** Number of records the buffer can hold. */
+  size_t size;
+  struct region_trace_record records[];
+};
+
+static always_inline uint64_t trace_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000llu + (uint64_t)ts.tv_nsec;
+}
+
+void region_trace_record(
+  struct region_trace *trace, uint16_t op, uint64_t offset, size_t size,
+  intptr_t cache)
+{
+  size_t index = trace->first + trace->count;
+  if (trace->count == trace->size) {
+    // overwrite oldest record
+    index = trace->first;
+    trace->first = (trace->first + 1) % trace->size;
+    trace->dropped++;
+  } else {
+    trace->count++;
+  }
+  if (index >= trace->size)
+    index -= trace->size;
+
+  struct region_trace_record *record = &trace->records[index];
+  record->time = trace_time() - trace->start;
+  record->offset = offset;
+  record->size = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+  record->cache = (uint16_t)cache;
+  record->op = op;
+}
+
+int region_trace_start(region_t *region, size_t records)
+{
+  assert(region);
+
+  struct mapping *mapping = region_mapping(region);
+  if (!REGION_TRACE || mapping->origin || mapping->trace || !records)
+    return -1;
+  // room for the caches that exist, chunks hold at most UINT32_MAX records
+  if (records < REGION_CACHES + 1)
+    records = REGION_CACHES + 1;
+  if (records > UINT32_MAX)
+    records = UINT32_MAX;
+
+  struct region_trace *trace = malloc(
+    sizeof(*trace) + records * sizeof(struct region_trace_record));
+  if (!trace)
+    return -1;
+
+  trace->start = trace_time();
+  trace->dropped = 0;
+  trace->first = 0;
+  trace->count = 0;
+  trace->size = records;
+  mapping->trace = trace;
+
+  // traces must be replayable from the start, record the region size and
+  // the caches that exist
+  region_trace_record(trace, REGION_TRACE_START, region_size(region), 0, -1);
+  struct region_cache_stats stats;
+  for (intptr_t cache = 0; region_cache_stats(region, cache, &stats) == 0; cache++)
+    region_trace_record(trace, REGION_TRACE_CACHE_CREATE, stats.alignment,
+                        stats.object_size, cache);
+  return 0;
+}
+
+static int write_all(int fd, const void *buffer, size_t size)
+{
+  const uint8_t *bytes = buffer;
+  while (size) {
+    const ssize_t count = write(fd, bytes, size);
+    if (count == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    bytes += count;
+    size -= (size_t)count;
+  }
+  return 0;
+}
+
+int region_trace_flush(region_t *region, int fd)
+{
+  assert(region);
+
+  struct region_trace *trace = mapping_trace(region_mapping(region));
+  if (!trace)
+    return -1;
+
+  struct region_trace_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, REGION_TRACE_MAGIC, sizeof(header.magic));
+  header.version = REGION_TRACE_VERSION;
+  header.count = (uint32_t)trace->count;
+  header.dropped = trace->dropped;
+  assert(trace->count <= UINT32_MAX);
+
+  // records wrap around the end of the buffer
+  const size_t tail = trace->size - trace->first;
+  const size_t first = trace->count < tail ? trace->count : tail;
+  const size_t record_size = sizeof(struct region_trace_record);
+  if (write_all(fd, &header, sizeof(header)) == -1 ||
+      write_all(fd, &trace->records[trace->first], first * record_size) == -1 ||
+      write_all(fd, &trace->records[0], (trace->count - first) * record_size) == -1)
+    return -1;
+
+  trace->first = 0;
+  trace->count = 0;
+  trace->dropped = 0;
+  return 0;
+}
+
+void region_trace_stop(region_t *region)
+{
+  assert(region);
+
+  // snapshots do not own the buffer
+  struct mapping *mapping = region_mapping(region);
+  free(mapping->trace);
+  mapping->trace = NULL;
+}
@@ -0,0 +1,480 @@
+/*
+ * writeback.c - asynchronous commits for regions mapped from a file
+ *
+ * Copyright (c) 2024, NLnet Labs. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#if defined(__linux__)
+# include <sys/syscall.h>
+#endif
+
+#include "macros.h"
+#include "region.h"
+#include "internal.h"
+
+// region_commit writes back updated pages by copying them to the shared
+// mapping of the file, which faults in every page (reading it from disk if
+// it is not cached) before it is overwritten, and then waits for the pages
+// to reach stable storage. the writer instead writes updated pages from the
+// snapshot to the file directly, full pages are written so that pages
+// need not be read, and does so on a thread of its own. the shared mapping
+// reflects the writes as both use the page cache.
+//
+// runs of consecutive updated pages are contiguous in the snapshot and are
+// written with a single vector each. runs are submitted in batches to an
+// io_uring instance, set up with the system calls directly (liburing is not
+// required), or written with pwritev if io_uring is unavailable. the
+// administration is copied after all data pages are written back, with a
+// barrier (fdatasync) in between and after, as region_commit does.
+//
+// commits are processed in order by a single thread. the barrier orders
+// writes per file and buffered writes are memory copies, more threads would
+// not write back any faster.
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup) && \
+     defined(__NR_io_uring_enter)
+#   include <linux/io_uring.h>
+#   define HAVE_IO_URING 1
+# endif
+#endif
+
+// number of runs submitted at once
+#define BATCH (64)
+
+struct job {
+  struct job *next;
+  region_t *region;
+  region_t *snapshot;
+  region_written_t callback;
+  void *arg;
+};
+
+#if defined(HAVE_IO_URING)
+struct ring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq, *cq;
+  size_t sq_size, cq_size, sqes_size;
+};
+#endif
+
+struct region_writer {
+  pthread_mutex_t lock;
+  /** Signalled if a job is queued or the writer is stopped. */
+  pthread_cond_t queued;
+  /** Signalled if the last job is done. */
+  pthread_cond_t idle;
+  pthread_t thread;
+  /** Jobs in order of submission. */
+  struct job *head, **tail;
+  /** Number of jobs queued or in progress. */
+  size_t pending;
+  bool stop;
+#if defined(HAVE_IO_URING)
+  struct ring ring;
+#endif
+};
+
+#if defined(HAVE_IO_URING)
+nonnull_all
+static void close_ring(struct ring *ring)
+{
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq && ring->cq != ring->sq)
+    munmap(ring->cq, ring->cq_size);
+  if (ring->sq)
+    munmap(ring->sq, ring->sq_size);
+  if (ring->fd != -1)
+    close(ring->fd);
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+nonnull_all
+static int open_ring(struct ring *ring)
+{
+  struct io_uring_params params;
+  memset(ring, 0, sizeof(*ring));
+  memset(&params, 0, sizeof(params));
+  ring->fd = (int)syscall(__NR_io_uring_setup, BATCH, &params);
+  if (ring->fd == -1)
+    return -1;
+
+  ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_size = params.cq_off.cqes +
+                  params.cq_entries * sizeof(struct io_uring_cqe);
+  // submission and completion queue share a mapping on 5.4 and later
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_size > ring->sq_size)
+      ring->sq_size = ring->cq_size;
+    ring->cq_size = ring->sq_size;
+  }
+
+  ring->sq = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq == MAP_FAILED)
+    goto error_sq;
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq = ring->sq;
+  } else {
+    ring->cq = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq == MAP_FAILED)
+      goto error_cq;
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto error_sqes;
+
+  uint8_t *sq = ring->sq, *cq = ring->cq;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return 0;
+error_sqes:
+  ring->sqes = NULL;
+error_cq:
+  if (ring->cq == MAP_FAILED)
+    ring->cq = NULL;
+error_sq:
+  if (ring->sq == MAP_FAILED)
+    ring->sq = NULL;
+  close_ring(ring);
+  return -1;
+}
+#endif
+
+// write run synchronously, short writes are continued
+nonnull_all
+static int write_run(int fd, struct iovec iov, off_t offset)
+{
+  while (iov.iov_len) {
+    const ssize_t count = pwritev(fd, &iov, 1, offset);
+    if (count == -1 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      return -1;
+    iov.iov_base = (uint8_t *)iov.iov_base + count;
+    iov.iov_len -= (size_t)count;
+    offset += count;
+  }
+  return 0;
+}
+
+// finish a run that was not (completely) written. the run is copied to the
+// mapping instead if it cannot be written so that the region in memory
+// reflects the snapshot regardless, as region_commit does
+nonnull_all
+static int finish_run(
+  region_t *region, int fd, struct iovec iov, off_t offset, size_t written)
+{
+  struct iovec rest = {
+    (uint8_t *)iov.iov_base + written, iov.iov_len - written };
+  if (write_run(fd, rest, offset + (off_t)written) == 0)
+    return 0;
+  memcpy(swizzle(region, (intptr_t)offset), iov.iov_base, iov.iov_len);
+  return -1;
+}
+
+#if defined(HAVE_IO_URING)
+// submit and reap a batch of runs. runs the ring does not take are written
+// synchronously
+nonnull_all
+static int write_ring(
+  struct ring *ring, region_t *region, int fd,
+  const struct iovec *iov, const off_t *offsets, size_t count)
+{
+  int result = 0;
+  const unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *ring->sq_tail;
+  assert(tail - head + count <= BATCH);
+  for (size_t index = 0; index < count; index++, tail++) {
+    const unsigned slot = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)&iov[index];
+    sqe->len = 1;
+    sqe->off = (uint64_t)offsets[index];
+    sqe->user_data = index;
+    ring->sq_array[slot] = slot;
+  }
+  // entries must be visible before the tail is
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+  size_t submitted = 0;
+  while (submitted < count) {
+    const long done = syscall(
+      __NR_io_uring_enter, ring->fd, (unsigned)(count - submitted), 0, 0, NULL, 0);
+    if (done > 0) {
+      submitted += (size_t)done;
+    } else if (done == -1 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+      continue;
+    } else {
+      // take back entries the kernel did not consume and write those
+      // synchronously
+      __atomic_store_n(ring->sq_tail, head + (unsigned)submitted, __ATOMIC_RELEASE);
+      for (size_t index = submitted; index < count; index++)
+        if (finish_run(region, fd, iov[index], offsets[index], 0) == -1)
+          result = -1;
+      break;
+    }
+  }
+
+  size_t reaped = 0;
+  while (reaped < submitted) {
+    unsigned cq_head = *ring->cq_head;
+    const unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    if (cq_head == cq_tail) {
+      if (syscall(__NR_io_uring_enter, ring->fd, 0,
+                  (unsigned)(submitted - reaped), IORING_ENTER_GETEVENTS,
+                  NULL, 0) == -1 && errno != EINTR)
+        sched_yield();
+      continue;
+    }
+    for (; cq_head != cq_tail; cq_head++, reaped++) {
+      const struct io_uring_cqe *cqe = &ring->cqes[cq_head & *ring->cq_mask];
+      const size_t index = (size_t)cqe->user_data;
+      const size_t written = cqe->res > 0 ? (size_t)cqe->res : 0;
+      assert(index < count);
+      if (written < iov[index].iov_len &&
+          finish_run(region, fd, iov[index], offsets[index], written) == -1)
+        result = -1;
+    }
+    __atomic_store_n(ring->cq_head, cq_head, __ATOMIC_RELEASE);
+  }
+
+  return result;
+}
+#endif
+
+nonnull_all
+static int write_batch(
+  region_writer_t *writer, region_t *region, int fd,
+  const struct iovec *iov, const off_t *offsets, size_t count)
+{
+#if defined(HAVE_IO_URING)
+  if (writer->ring.fd != -1)
+    return write_ring(&writer->ring, region, fd, iov, offsets, count);
+#else
+  (void)writer;
+#endif
+  int result = 0;
+  for (size_t index = 0; index < count; index++)
+    if (finish_run(region, fd, iov[index], offsets[index], 0) == -1)
+      result = -1;
+  return result;
+}
+
+// write back updated pages of snapshot, then the administration
+nonnull_all
+static int write_back(region_writer_t *writer, region_t *region, region_t *snapshot)
+{
+  struct iovec iov[BATCH];
+  off_t offsets[BATCH];
+  size_t queued = 0;
+  int result = 0;
+  const int fd = region_mapping(region)->fd;
+
+  size_t count;
+  bool discard;
+  for (size_t bit = region_copy_next(snapshot, 0, &count, &discard);
+       count;
+       bit = region_copy_next(snapshot, bit + count, &count, &discard))
+  {
+    if (discard) {
+      region_discard(region, bit * PAGE_SIZE, count * PAGE_SIZE);
+      continue;
+    }
+    iov[queued].iov_base = swizzle(snapshot, (intptr_t)(bit * PAGE_SIZE));
+    iov[queued].iov_len = count * PAGE_SIZE;
+    offsets[queued] = (off_t)(bit * PAGE_SIZE);
+    if (++queued == BATCH) {
+      if (write_batch(writer, region, fd, iov, offsets, queued) == -1)
+        result = -1;
+      queued = 0;
+    }
+  }
+
+  if (queued && write_batch(writer, region, fd, iov, offsets, queued) == -1)
+    result = -1;
+  if (region_barrier(region) == -1)
+    result = -1;
+  if (region_copy_end(region, snapshot) == -1)
+    result = -1;
+  return result;
+}
+
+nonnull_all
+static void *work(void *arg)
+{
+  region_writer_t *writer = arg;
+
+  pthread_mutex_lock(&writer->lock);
+  for (;;) {
+    while (!writer->head && !writer->stop)
+      pthread_cond_wait(&writer->queued, &writer->lock);
+    if (!writer->head)
+      break;
+    struct job *job = writer->head;
+    if (!(writer->head = job->next))
+      writer->tail = &writer->head;
+    pthread_mutex_unlock(&writer->lock);
+
+    const int result = write_back(writer, job->region, job->snapshot);
+    region_trace(region_mapping(job->snapshot), REGION_TRACE_COMMIT, 0, 0, -1);
+    // pairs with is_writing_back, the region can be committed again from
+    // the callback
+    __atomic_store_n(&region_mapping(job->region)->writeback, false, __ATOMIC_RELEASE);
+    if (job->callback)
+      job->callback(job->region, job->snapshot, result, job->arg);
+    free(job);
+
+    pthread_mutex_lock(&writer->lock);
+    if (!--writer->pending)
+      pthread_cond_broadcast(&writer->idle);
+  }
+  pthread_mutex_unlock(&writer->lock);
+  return NULL;
+}
+
+region_writer_t *region_writer_create(void)
+{
+  region_writer_t *writer = calloc(1, sizeof(*writer));
+  if (!writer)
+    return NULL;
+
+  writer->tail = &writer->head;
+#if defined(HAVE_IO_URING)
+  // kernels without io_uring (or with io_uring disabled) use pwritev
+  if (open_ring(&writer->ring) == -1)
+    writer->ring.fd = -1;
+#endif
+  if (pthread_mutex_init(&writer->lock, NULL))
+    goto error_lock;
+  if (pthread_cond_init(&writer->queued, NULL))
+    goto error_queued;
+  if (pthread_cond_init(&writer->idle, NULL))
+    goto error_idle;
+  if (pthread_create(&writer->thread, NULL, work, writer))
+    goto error_thread;
+  return writer;
+error_thread:
+  pthread_cond_destroy(&writer->idle);
+error_idle:
+  pthread_cond_destroy(&writer->queued);
+error_queued:
+  pthread_mutex_destroy(&writer->lock);
+error_lock:
+#if defined(HAVE_IO_URING)
+  if (writer->ring.fd != -1)
+    close_ring(&writer->ring);
+#endif
+  free(writer);
+  return NULL;
+}
+
+void region_writer_destroy(region_writer_t *writer)
+{
+  assert(writer);
+
+  pthread_mutex_lock(&writer->lock);
+  writer->stop = true;
+  pthread_cond_signal(&writer->queued);
+  pthread_mutex_unlock(&writer->lock);
+  pthread_join(writer->thread, NULL);
+  assert(!writer->pending);
+
+#if defined(HAVE_IO_URING)
+  if (writer->ring.fd != -1)
+    close_ring(&writer->ring);
+#endif
+  pthread_cond_destroy(&writer->idle);
+  pthread_cond_destroy(&writer->queued);
+  pthread_mutex_destroy(&writer->lock);
+  free(writer);
+}
+
+void region_writer_wait(region_writer_t *writer)
+{
+  assert(writer);
+
+  pthread_mutex_lock(&writer->lock);
+  while (writer->pending)
+    pthread_cond_wait(&writer->idle, &writer->lock);
+  pthread_mutex_unlock(&writer->lock);
+}
+
+int region_commit_async(
+  region_writer_t *writer,
+  region_t *snapshot,
+  region_written_t callback,
+  void *arg)
+{
+  assert(writer);
+  assert(snapshot);
+
+  const struct mapping *mapping = region_mapping(snapshot);
+  if (!(mapping->flags & MAPPING_PRIVATE) || !mapping->origin)
+    return -1;
+
+  // pages are copied in memory, there is nothing to wait for
+  if (!(region_mapping(mapping->origin)->flags & MAPPING_FILE)) {
+    region_t *region = region_commit(snapshot);
+    if (!region)
+      return -1;
+    if (callback)
+      callback(region, snapshot, 0, arg);
+    return 0;
+  }
+
+  struct job *job = malloc(sizeof(*job));
+  if (!job)
+    return -1;
+
+  region_t *region = region_prepare_commit(snapshot);
+  if (!region || region_copy_begin(region, snapshot) == -1) {
+    free(job);
+    return -1;
+  }
+
+  job->next = NULL;
+  job->region = region;
+  job->snapshot = snapshot;
+  job->callback = callback;
+  job->arg = arg;
+  __atomic_store_n(&region_mapping(region)->writeback, true, __ATOMIC_RELEASE);
+
+  pthread_mutex_lock(&writer->lock);
+  *writer->tail = job;
+  writer->tail = &job->next;
+  writer->pending++;
+  pthread_cond_signal(&writer->queued);
+  pthread_mutex_unlock(&writer->lock);
+  return 0;
+}